@@ -61,6 +61,87 @@ int main(void)
     regcomp(&preg, "regex", 0);
 }
 
+#elif TEST_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int main(void)
+{
+    struct io_uring_params params = { 0 };
+    struct io_uring_sqe sqe = { 0 };
+
+    sqe.opcode = IORING_OP_READ;
+    return syscall(__NR_io_uring_setup, 1, &params) + sqe.opcode;
+}
+
+#elif TEST_PTHREAD
+
+#include <pthread.h>
+
+static void *run(void *arg)
+{
+    return arg;
+}
+
+int main(void)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, run, NULL) != 0)
+        return 1;
+    return pthread_join(thread, NULL);
+}
+
+#elif TEST_FIDEDUPERANGE
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+int main(void)
+{
+    struct file_dedupe_range range = { 0 };
+
+    return ioctl(-1, FIDEDUPERANGE, &range);
+}
+
+#elif TEST_FIEMAP
+
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+int main(void)
+{
+    struct fiemap map = { 0 };
+
+    return ioctl(-1, FS_IOC_FIEMAP, &map);
+}
+
+#elif TEST_STATX
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+int main(void)
+{
+    struct statx stx;
+
+    return statx(AT_FDCWD, ".", AT_SYMLINK_NOFOLLOW, STATX_INO, &stx);
+}
+
+#elif TEST_INOTIFY
+
+#include <sys/inotify.h>
+
+int main(void)
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+
+    return inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+}
+
 #elif TEST_XATTR
 
 #include <sys/xattr.h>
@@ -22,8 +22,8 @@
  */
 
 #define _GNU_SOURCE             /* GNU extensions (optional) */
-#define _POSIX_C_SOURCE 200112L /* POSIX functions */
-#define _XOPEN_SOURCE      600  /* nftw() */
+#define _POSIX_C_SOURCE 200809L /* POSIX functions */
+#define _XOPEN_SOURCE      700  /* openat(), fdopendir() */
 
 #define _FILE_OFFSET_BITS   64  /* Large file support */
 #define _LARGEFILE_SOURCE       /* Large file support */
@@ -32,21 +32,27 @@
 #include <sys/types.h>          /* stat */
 #include <sys/stat.h>           /* stat */
 #include <sys/time.h>           /* getrlimit, getrusage */
+#include <time.h>               /* clock_gettime() */
 #include <sys/resource.h>       /* getrlimit, getrusage */
 #include <unistd.h>             /* stat */
 #include <fcntl.h>              /* posix_fadvise */
-#include <ftw.h>                /* ftw */
-#include <search.h>             /* tsearch() and friends */
+#include <dirent.h>             /* fdopendir(), readdir() */
+#include <sys/mman.h>           /* mmap(), posix_madvise() */
+#include <sys/statvfs.h>        /* statvfs() */
+#include <sys/sysmacros.h>      /* major(), minor() */
 
 #include <errno.h>              /* strerror, errno */
 #include <locale.h>             /* setlocale */
+#include <setjmp.h>             /* sigsetjmp(), siglongjmp() */
 #include <signal.h>             /* SIG*, sigaction */
 #include <stdio.h>              /* stderr, fprint */
 #include <stdarg.h>             /* va_arg */
 #include <stdlib.h>             /* free(), realloc() */
 #include <string.h>             /* strcmp() and friends */
 #include <assert.h>             /* assert() */
-#include <ctype.h>              /* tolower() */
+#include <ctype.h>              /* tolower(), isdigit() */
+#include <stdint.h>             /* uint64_t */
+#include <limits.h>             /* CHAR_BIT */
 
 /* Some boolean names for clarity */
 typedef enum hl_bool {
@@ -86,21 +92,97 @@ typedef enum hl_bool {
 #endif
 
 #ifdef HAVE_XATTR
-#include <attr/xattr.h>         /* listxattr, getxattr */
+#include <sys/xattr.h>          /* flistxattr(), fgetxattr() */
 #endif
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>            /* pthread_create() and friends */
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>     /* struct io_uring_sqe and friends */
+#include <sys/syscall.h>        /* syscall() */
+#endif
+
+#ifdef HAVE_FIDEDUPERANGE
+#include <linux/fs.h>           /* FIDEDUPERANGE */
+#include <sys/ioctl.h>          /* ioctl() */
+#endif
+
+#ifdef HAVE_FIEMAP
+#include <linux/fiemap.h>       /* struct fiemap */
+#include <linux/fs.h>           /* FS_IOC_FIEMAP */
+#include <sys/ioctl.h>          /* ioctl() */
+#endif
+
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>        /* inotify_init1(), inotify_add_watch() */
+#include <poll.h>               /* poll() */
+#endif
+
+/* Storage for static buffers, per thread if we have threads */
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+/**
+ * enum digest_stage - Stages of the grouping of files with equal size
+ * @DIGEST_EDGES: Digest of the first and last block of the file
+ * @DIGEST_FULL:  Digest of the complete contents of the file
+ * @DIGEST_STAGES: Number of stages
+ *
+ * Files in a bucket are first told apart by their edges, then by their
+ * complete contents, and only files surviving both stages are compared
+ * byte for byte.
+ */
+enum digest_stage {
+    DIGEST_EDGES,
+    DIGEST_FULL,
+    DIGEST_STAGES
+};
+
 /**
  * struct file - Information about a file
- * @st:       The stat buffer associated with the file
- * @next:     Next file with the same size
+ * @dev:      The device of the inode
+ * @ino:      The inode number
+ * @size:     The size of the file
+ * @blocks:   The number of 512-byte blocks allocated to the file
+ * @mtime:    The time of the last modification, in seconds
+ * @ctime:    The time of the last status change, in seconds
+ * @nlink:    The number of links to the inode
+ * @mode:     The file mode
+ * @uid:      The owner
+ * @gid:      The group
+ * @mtime_nsec: The nanoseconds of @mtime
+ * @ctime_nsec: The nanoseconds of @ctime
+ * @next:     Next file with the same size, only used while walking
+ * @digests:  What is known about the contents, %NULL while walking
  * @basename: The offset off the basename in the filename
  * @path:     The path of the file
  *
- * This contains all information we need about a file.
+ * This contains all information we need about a file. Only the parts of
+ * struct stat we need are kept, as there may be many millions of files,
+ * with the times split so that the small fields pack without padding.
+ * The digests are only needed for files in buckets, so they are kept
+ * aside, see collect_bucket().
  */
 struct file {
-    struct stat st;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    blkcnt_t blocks;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t nlink;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
     struct file *next;
+    struct digests *digests;
     struct link {
         struct link *next;
         int basename;
@@ -114,6 +196,20 @@ struct file {
     } *links;
 };
 
+/**
+ * struct digests - What is known about the contents of a file
+ * @digested: Bit mask of the stages in @digest which have been computed
+ * @group:    Class of equal contents within the bucket, 0 if unknown
+ * @digest:   Digests of the contents, one per #enum digest_stage
+ * @xattr:    Digest of the extended attributes, see file_xattr_digest()
+ */
+struct digests {
+    unsigned int digested;
+    uint32_t group;
+    uint64_t digest[DIGEST_STAGES];
+    uint64_t xattr;
+};
+
 /**
  * enum log_level - Logging levels
  * @JLOG_SYSFAT:  Fatal error message with errno, will be printed to stderr
@@ -136,26 +232,191 @@ enum log_level {
     JLOG_DEBUG2
 };
 
+/**
+ * enum phase - The phases of a run, timed separately in struct statistics
+ * @PHASE_TRAVERSAL: Walking the directories
+ * @PHASE_GROUPING:  Collecting and ordering the buckets
+ * @PHASE_COMPARING: Comparing files, summed over all threads
+ * @PHASE_LINKING:   Linking files, summed over all threads
+ * @PHASES:          The number of phases, also used when done
+ */
+enum phase {
+    PHASE_TRAVERSAL,
+    PHASE_GROUPING,
+    PHASE_COMPARING,
+    PHASE_LINKING,
+    PHASES
+};
+
+static const char *const phase_names[PHASES] = {
+    "traversal", "grouping", "comparing", "linking"
+};
+
+/**
+ * enum call - Kinds of system calls counted in struct statistics
+ * @CALL_OPEN:  open() of files and directories
+ * @CALL_READ:  pread(), io_uring_enter() and mmap() to read file contents
+ * @CALL_STAT:  lstat(), fstat(), fstatat() and statx()
+ * @CALL_LINK:  linkat(), renameat() and FIDEDUPERANGE
+ * @CALL_XATTR: flistxattr() and fgetxattr()
+ * @CALLS:      The number of kinds
+ */
+enum call {
+    CALL_OPEN,
+    CALL_READ,
+    CALL_STAT,
+    CALL_LINK,
+    CALL_XATTR,
+    CALLS
+};
+
+static const char *const call_names[CALLS] = {
+    "open", "read", "stat", "link", "xattr"
+};
+
+/* Number of power-of-two bins in the bucket histograms */
+#define STATS_HISTOGRAM 64
+
 /**
  * struct statistic - Statistics about the file
  * @started: Whether we are post command-line processing
  * @files: The number of files worked on
  * @linked: The number of files replaced by a hardlink to a master
+ * @queued: The number of links queued for the linker, see linker_add()
+ * @link_errors: The number of queued links which could not be made
+ * @already_linked: The number of links which already were links to the master
  * @xattr_comparisons: The number of extended attribute comparisons
  * @comparisons: The number of comparisons
- * @saved: The (exaggerated) amount of space saved
+ * @digests: The number of file digests computed
+ * @deduped: The number of files sharing their extents with another file
+ * @saved: The space freed, from the blocks of inodes whose last link is gone
+ * @bytes_read: The bytes of file contents read
+ * @calls: The number of system calls, per #enum call
+ * @wall_ns: The wall-clock time per #enum phase, in nanoseconds
+ * @cpu_ns: The CPU time per #enum phase, in nanoseconds
+ * @phase: The phase the main thread is in, see phase_enter()
+ * @phase_wall: The wall-clock time @phase was entered at
+ * @phase_cpu: The CPU time of the process when @phase was entered
+ * @buckets: The number of buckets
+ * @bucket_sizes: Buckets by number of files, bin i counts up to 2^i files
+ * @bucket_costs: Buckets by cost, bin i counts costs up to 2^i bytes
  * @start_time: The time we started at, in seconds since some unspecified point
  */
 static struct statistics {
     hl_bool started;
     size_t files;
     size_t linked;
+    size_t queued;
+    size_t link_errors;
+    size_t already_linked;
     size_t xattr_comparisons;
     size_t comparisons;
-    double saved;
+    size_t digests;
+    size_t deduped;
+    unsigned long long saved;
+    unsigned long long bytes_read;
+    unsigned long long calls[CALLS];
+    unsigned long long wall_ns[PHASES];
+    unsigned long long cpu_ns[PHASES];
+    enum phase phase;
+    unsigned long long phase_wall;
+    unsigned long long phase_cpu;
+    size_t buckets;
+    size_t bucket_sizes[STATS_HISTOGRAM];
+    size_t bucket_costs[STATS_HISTOGRAM];
     double start_time;
 } stats;
 
+/**
+ * STATS_ADD - Add to a counter in stats
+ * @field: The name of the counter
+ * @n:     The amount to add
+ *
+ * The counters are updated by all worker threads, so do it atomically.
+ */
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+#define STATS_ADD(field, n) ((void) __sync_fetch_and_add(&stats.field, (n)))
+#else
+#define STATS_ADD(field, n) ((void) (stats.field += (n)))
+#endif
+
+/**
+ * ATOMIC_DEC - Decrement a counter shared by threads
+ * @var: The counter
+ *
+ * Returns: The new value.
+ */
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+#define ATOMIC_DEC(var) __sync_sub_and_fetch(&(var), 1)
+#else
+#define ATOMIC_DEC(var) (--(var))
+#endif
+
+/**
+ * ATOMIC_ADD - Add to a counter shared by threads
+ * @var: The counter
+ * @n:   The amount to add
+ */
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+#define ATOMIC_ADD(var, n) ((void) __sync_fetch_and_add(&(var), (n)))
+#else
+#define ATOMIC_ADD(var, n) ((void) ((var) += (n)))
+#endif
+
+/**
+ * ATOMIC_FETCH_OR - Set bits in a variable shared by threads
+ * @var:  The variable
+ * @bits: The bits to set
+ *
+ * Returns: The old value.
+ */
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+#define ATOMIC_FETCH_OR(var, bits) __sync_fetch_and_or(&(var), (bits))
+#else
+#define ATOMIC_FETCH_OR(var, bits) atomic_fetch_or_plain(&(var), (bits))
+
+/**
+ * atomic_fetch_or_plain - ATOMIC_FETCH_OR() without threads
+ * @var:  The variable
+ * @bits: The bits to set
+ */
+static unsigned char atomic_fetch_or_plain(unsigned char *var,
+                                           unsigned char bits)
+{
+    unsigned char old = *var;
+
+    *var |= bits;
+    return old;
+}
+#endif
+
+/* Count a system call of the given #enum call */
+#define COUNT_CALL(kind) STATS_ADD(calls[kind], 1)
+
+/**
+ * enum compare_method - How the contents of files of equal size are compared
+ * @COMPARE_DIGEST:   Staged digests, then byte-for-byte per pair (default)
+ * @COMPARE_LOCKSTEP: Read all files of a bucket block by block in lockstep
+ * @COMPARE_MMAP:     Like %COMPARE_DIGEST, but compare large files mapped
+ */
+enum compare_method {
+    COMPARE_DIGEST,
+    COMPARE_LOCKSTEP,
+    COMPARE_MMAP
+};
+
+/**
+ * enum physical_order - When to read files in the order of their blocks
+ * @ORDER_AUTO:   On rotating disks (default)
+ * @ORDER_ALWAYS: On all devices
+ * @ORDER_NEVER:  Never
+ */
+enum physical_order {
+    ORDER_AUTO,
+    ORDER_ALWAYS,
+    ORDER_NEVER
+};
+
 /**
  * struct options - Processed command-line options
  * @include: A linked list of regular expressions for the --include option
@@ -170,11 +431,27 @@ static struct statistics {
  * @minimise: Chose the file with the lowest link count as master
  * @keep_oldest: Choose the file with oldest timestamp as master (default = FALSE)
  * @dry_run: Specifies whether hardlink should not link files (default = FALSE)
+ * @prescan: Count the sizes in a first walk, see struct sketch (default = FALSE)
+ * @dedupe: Share extents instead of linking, see bucket_dedupe() (default = FALSE)
+ * @stats_json: Print the statistics as JSON, see print_stats() (default = FALSE)
+ * @watch: Keep linking new files after the first run, see watch_run() (default = FALSE)
+ * @xdev: Do not descend into other file systems (default = FALSE)
+ * @uncached: Read without atime updates and drop the pages, see open_contents() (default = FALSE)
+ * @direct: Read with O_DIRECT, see open_contents() (default = FALSE)
  * @min_size: Minimum size of files to consider. (default = 1 byte)
+ * @max_memory: Memory for the files before spilling, see spill_run() (default = 0, unlimited)
+ * @compare: The #enum compare_method to use (default = COMPARE_DIGEST)
+ * @physical_order: See device_rotational() (default = ORDER_AUTO)
+ * @lockstep_files: Maximum number of files to open for a lockstep comparison
+ * @jobs: Number of threads comparing and linking buckets (default = 1)
+ * @apply: The plan to make the links of, see plan_apply() (default = NULL)
+ * @resume: The checkpoint to resume from, see checkpoint_resume() (default = NULL)
  */
 static struct options {
     struct regex_link {
         regex_t preg;
+        const char *source;
+        hl_bool prune;
         struct regex_link *next;
     } *include, *exclude;
     signed int verbosity;
@@ -187,26 +464,121 @@ static struct options {
     unsigned int minimise:1;
     unsigned int keep_oldest:1;
     unsigned int dry_run:1;
+    unsigned int prescan:1;
+    unsigned int dedupe:1;
+    unsigned int stats_json:1;
+    unsigned int watch:1;
+    unsigned int xdev:1;
+    unsigned int uncached:1;
+    unsigned int direct:1;
     unsigned long long min_size;
+    unsigned long long max_memory;
+    enum compare_method compare;
+    enum physical_order physical_order;
+    size_t lockstep_files;
+    unsigned int jobs;
+    const char *apply;
+    const char *resume;
 } opts;
 
+/**
+ * struct table - Open-addressing hash table of files
+ * @slots: The slots, %NULL if empty
+ * @mask:  The number of slots minus one, the number is a power of two
+ * @count: The number of slots in use
+ */
+struct table {
+    struct file **slots;
+    size_t mask;
+    size_t count;
+};
+
+/*
+ * files, files_by_ino
+ *
+ * Hash tables of files. files maps each device and size to a linked list
+ * of files, files_by_ino maps each inode (and with --respect-name, each
+ * basename) to its file. See table_find_size() and table_find_ino().
+ */
+static struct table files;
+static struct table files_by_ino;
+
+/*
+ * walk_arena, bucket_files, bucket_links
+ *
+ * Files found while walking are allocated from walk_arena. Afterwards,
+ * only files which share their size with others are moved into
+ * bucket_files and bucket_links, bucket by bucket, and walk_arena is
+ * freed as a whole. With --watch, the tables are kept and files come and
+ * go, so each file and link is allocated on its own, see walk_alloc().
+ */
+static struct arena walk_arena;
+static struct arena bucket_files;
+static struct arena bucket_links;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t files_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define lock_files() pthread_mutex_lock(&files_mutex)
+#define unlock_files() pthread_mutex_unlock(&files_mutex)
+#else
+#define lock_files() ((void) 0)
+#define unlock_files() ((void) 0)
+#endif
+
+/**
+ * struct bucket - Files with equal device and size
+ * @files:    The files in the bucket, ordered by file_compare(), master first
+ * @count:    The number of files in @files
+ * @cost:     The estimated cost of comparing the files, see collect_bucket()
+ * @physical: The physical offsets of @files on a rotating disk, or %NULL
+ * @start:    The lowest of @physical, or %UINT64_MAX if there are none
+ * @unlinked: While checkpointing, the links queued for the bucket and not
+ *            made yet, plus one until the bucket has been compared
+ */
+struct bucket {
+    struct file *files;
+    size_t count;
+    double cost;
+    uint64_t *physical;
+    uint64_t start;
+    size_t unlinked;
+};
+
 /*
- * files
+ * buckets
  *
- * A binary tree of files, managed using tsearch(). To see which nodes
- * are considered equal, see compare_nodes()
+ * The buckets with at least two files, collected by collect_buckets()
+ * and ordered by cost, most expensive first.
  */
-static void *files;
-static void *files_by_ino;
+static struct {
+    struct bucket *items;
+    size_t count;
+    size_t alloc;
+} buckets;
 
 /*
  * last_signal
  *
  * The last signal we received. We store the signal here in order to be able
- * to break out of loops gracefully and to return from our nftw() handler.
+ * to break out of loops gracefully and to stop walking directories.
  */
 static int last_signal;
 
+/*
+ * stats_requested
+ *
+ * Set by SIGUSR1. The next thread calling handle_interrupt() prints the
+ * statistics, as that cannot be done safely in the signal handler.
+ */
+static volatile sig_atomic_t stats_requested;
+
+/*
+ * stats_fd
+ *
+ * The file given by --stats-file, or -1 to print statistics to stdout.
+ */
+static int stats_fd = -1;
+
 __attribute__ ((format(printf, 2, 3)))
 /**
  * jlog - Logging for hardlink
@@ -220,6 +592,7 @@ static void jlog(enum log_level level, const char *format, ...)
     va_list args;
 
     if (level <= opts.verbosity) {
+        flockfile(stream);
         if (level <= JLOG_FATAL)
             fprintf(stream, "ERROR: ");
         else if (level < 0)
@@ -231,7 +604,10 @@ static void jlog(enum log_level level, const char *format, ...)
             fprintf(stream, ": %s\n", strerror(errno_));
         else
             fputc('\n', stream);
+        funlockfile(stream);
     }
+
+    errno = errno_;             /* callers may still check it */
 }
 
 /**
@@ -252,7 +628,7 @@ static void jlog(enum log_level level, const char *format, ...)
  */
 static const char *format(double bytes)
 {
-    static char buf[256];
+    static THREAD_LOCAL char buf[256];
 
     if (bytes >= 1024 * 1024 * 1024)
         snprintf(buf, sizeof(buf), "%.2f GiB", (bytes / 1024 / 1024 / 1024));
@@ -279,13 +655,125 @@ static double gettime(void)
     return (double) tv.tv_sec + (double) tv.tv_usec / 1000000;
 }
 
+/**
+ * clock_ns - Read a clock in nanoseconds
+ * @clock: The clock, such as CLOCK_MONOTONIC or CLOCK_THREAD_CPUTIME_ID
+ */
+static unsigned long long clock_ns(clockid_t clock)
+{
+    struct timespec ts = { 0, 0 };
+
+    clock_gettime(clock, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * phase_enter - Account the time of the current phase and start another
+ * @phase: The next #enum phase, %PHASES when done
+ *
+ * Only called by the main thread, for the phases it runs alone. The time
+ * of %PHASE_COMPARING and %PHASE_LINKING is summed up by bucket_run().
+ */
+static void phase_enter(enum phase phase)
+{
+    unsigned long long wall = clock_ns(CLOCK_MONOTONIC);
+    unsigned long long cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+    if (stats.phase < PHASE_COMPARING && stats.phase_wall != 0) {
+        stats.wall_ns[stats.phase] += wall - stats.phase_wall;
+        stats.cpu_ns[stats.phase] += cpu - stats.phase_cpu;
+    }
+
+    stats.phase = phase;
+    stats.phase_wall = wall;
+    stats.phase_cpu = cpu;
+}
+
+/*
+ * ARENA_BLOCK_SIZE - Size of the blocks allocated by an arena
+ * ARENA_ALIGN      - Alignment of the objects allocated from an arena
+ */
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+#define ARENA_ALIGN      16
+
+/**
+ * struct arena - Allocator for many small objects freed all at once
+ * @block: The current block, blocks are chained through their first word
+ * @next:  The next free byte in @block
+ * @left:  The number of free bytes in @block
+ * @size:  The number of bytes allocated from the arena
+ *
+ * Allocating is just bumping a pointer, and there is no per-object
+ * overhead. Objects allocated one after another are next to each other.
+ */
+struct arena {
+    void *block;
+    char *next;
+    size_t left;
+    size_t size;
+};
+
+/**
+ * arena_alloc - Allocate zeroed memory from an arena
+ * @arena: The arena
+ * @size:  The size of the object
+ *
+ * Aborts if memory cannot be allocated.
+ */
+static void *arena_alloc(struct arena *arena, size_t size)
+{
+    void *mem;
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+    if (size > arena->left) {
+        size_t len = ARENA_ALIGN + (size > ARENA_BLOCK_SIZE ? size :
+                                    ARENA_BLOCK_SIZE);
+        char *block = malloc(len);
+
+        if (block == NULL) {
+            jlog(JLOG_SYSFAT, "Cannot allocate memory");
+            exit(1);
+        }
+
+        *(void **) block = arena->block;
+        arena->block = block;
+        arena->next = block + ARENA_ALIGN;
+        arena->left = len - ARENA_ALIGN;
+    }
+
+    mem = arena->next;
+    arena->next += size;
+    arena->left -= size;
+    arena->size += size;
+
+    return memset(mem, 0, size);
+}
+
+/**
+ * arena_free - Free all objects allocated from an arena
+ * @arena: The arena
+ */
+static void arena_free(struct arena *arena)
+{
+    while (arena->block != NULL) {
+        void *block = arena->block;
+
+        arena->block = *(void **) block;
+        free(block);
+    }
+    arena->next = NULL;
+    arena->left = 0;
+    arena->size = 0;
+}
+
 /**
  * regexec_any - Match against multiple regular expressions
  * @pregs: A linked list of regular expressions
  * @what:  The string to match against
  *
  * Checks whether any of the regular expressions in the list matches the
- * string.
+ * string. The list usually holds a single expression, see combine_regex().
  */
 static hl_bool regexec_any(struct regex_link *pregs, const char *what)
 {
@@ -296,637 +784,6729 @@ static hl_bool regexec_any(struct regex_link *pregs, const char *what)
 }
 
 /**
- * compare_nodes - Node comparison function
- * @_a: The first node (a #struct file)
- * @_b: The second node (a #struct file)
+ * path_excluded - Check whether --exclude and --include skip a file
+ * @path: The path of the file
  *
- * Compare the two nodes for the binary tree.
+ * A file is skipped if an --exclude pattern matches and no --include
+ * pattern does, or if only --include patterns are given and none matches.
  */
-static int compare_nodes(const void *_a, const void *_b)
+static hl_bool path_excluded(const char *path)
 {
-    const struct file *a = _a;
-    const struct file *b = _b;
-    int diff = 0;
+    if (opts.exclude != NULL)
+        return regexec_any(opts.exclude, path) &&
+            !regexec_any(opts.include, path);
+    return opts.include != NULL && !regexec_any(opts.include, path);
+}
 
-    if (diff == 0)
-        diff = CMP(a->st.st_dev, b->st.st_dev);
-    if (diff == 0)
-        diff = CMP(a->st.st_size, b->st.st_size);
+/**
+ * dir_excluded - Check whether every file below a directory is excluded
+ * @dir:  The path of the parent directory, or %NULL
+ * @name: The name of the directory within @dir
+ *
+ * The path of the directory is matched with a slash appended and with
+ * REG_NOTEOL, so that a pattern matching it matches the path of every
+ * file below the directory, too. If such an --exclude pattern matches
+ * and no --include pattern could take a file back, path_excluded() would
+ * skip all files in the subtree, so it need not be read at all.
+ */
+static hl_bool dir_excluded(const char *dir, const char *name)
+{
+    size_t dirlen = dir ? strlen(dir) : 0;
+    size_t namelen = strlen(name);
+    struct regex_link *link;
+    hl_bool excluded = FALSE;
+    char *path;
 
-    return diff;
+    if (opts.include != NULL)
+        return FALSE;
+    for (link = opts.exclude; link != NULL && !link->prune; link = link->next)
+        ;
+    if (link == NULL)
+        return FALSE;
+
+    if ((path = malloc(dirlen + namelen + 3)) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    if (dirlen > 0)
+        memcpy(path, dir, dirlen);
+    if (dirlen > 0 && dir[dirlen - 1] != '/')
+        path[dirlen++] = '/';
+    memcpy(path + dirlen, name, namelen + 1);
+    if (dirlen + namelen == 0 || path[dirlen + namelen - 1] != '/')
+        strcpy(path + dirlen + namelen, "/");
+
+    for (; link != NULL && !excluded; link = link->next)
+        excluded = link->prune &&
+            regexec(&link->preg, path, 0, NULL, REG_NOTEOL) == 0;
+
+    if (excluded)
+        jlog(JLOG_DEBUG1, "Skipped %s (excluded)", path);
+
+    free(path);
+    return excluded;
 }
 
 /**
- * compare_nodes_ino - Node comparison function
+ * compare_nodes - Node comparison function
  * @_a: The first node (a #struct file)
  * @_b: The second node (a #struct file)
  *
- * Compare the two nodes for the binary tree.
+ * Order files by device and size.
  */
-static int compare_nodes_ino(const void *_a, const void *_b)
+static int compare_nodes(const void *_a, const void *_b)
 {
     const struct file *a = _a;
     const struct file *b = _b;
     int diff = 0;
 
     if (diff == 0)
-        diff = CMP(a->st.st_dev, b->st.st_dev);
+        diff = CMP(a->dev, b->dev);
     if (diff == 0)
-        diff = CMP(a->st.st_ino, b->st.st_ino);
-
-    /* If opts.respect_name is used, we will restrict a struct file to
-     * contain only links with the same basename to keep the rest simple.
-     */
-    if (diff == 0 && opts.respect_name)
-        diff = strcmp(a->links->path + a->links->basename,
-                      b->links->path + b->links->basename);
+        diff = CMP(a->size, b->size);
 
     return diff;
 }
 
+/*
+ * TABLE_MIN_SIZE - Initial number of slots in a hash table
+ * TABLE_MAX_HINT - Maximum number of files to size a hash table for up front
+ */
+#define TABLE_MIN_SIZE 1024
+#define TABLE_MAX_HINT (4 * 1024 * 1024)
+
 /**
- * print_stats - Print statistics to stdout
+ * hash_mix - Hash two integers
+ * @a: The first integer
+ * @b: The second integer
  */
-static void print_stats(void)
+static size_t hash_mix(uint64_t a, uint64_t b)
 {
-    jlog(JLOG_SUMMARY, "Mode:     %s", opts.dry_run ? "dry-run" : "real");
-    jlog(JLOG_SUMMARY, "Files:    %zu", stats.files);
-    jlog(JLOG_SUMMARY, "Linked:   %zu files", stats.linked);
-#ifdef HAVE_XATTR
-    jlog(JLOG_SUMMARY, "Compared: %zu xattrs", stats.xattr_comparisons);
-#endif
-    jlog(JLOG_SUMMARY, "Compared: %zu files", stats.comparisons);
-    jlog(JLOG_SUMMARY, "Saved:    %s", format(stats.saved));
-    jlog(JLOG_SUMMARY, "Duration: %.2f seconds", gettime() - stats.start_time);
+    uint64_t h = (a * 0x9E3779B97F4A7C15ULL) ^ b;
+
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return (size_t) h;
 }
 
 /**
- * handle_interrupt - Handle a signal
+ * hash_ino - Hash the inode of a file
+ * @f: The file
  *
- * Returns: %TRUE on SIGINT, SIGTERM; %FALSE on all other signals.
+ * With --respect-name, the basename of the first link is included, as
+ * there is one #struct file per inode and basename then.
  */
-static hl_bool handle_interrupt(void)
+static size_t hash_ino(const struct file *f)
 {
-    switch (last_signal) {
-    case SIGINT:
-    case SIGTERM:
-        return TRUE;
-    case SIGUSR1:
-        print_stats();
-        putchar('\n');
-        break;
-    }
+    size_t h = hash_mix(f->dev, f->ino);
 
-    last_signal = 0;
-    return FALSE;
+    if (opts.respect_name) {
+        const unsigned char *c;
+
+        for (c = (const unsigned char *) f->links->path + f->links->basename;
+             *c != '\0'; c++)
+            h = (h ^ *c) * 0x100000001B3ULL;
+    }
+    return h;
 }
 
-#ifdef HAVE_XATTR
+/**
+ * hash_size - Hash the device and size of a file
+ * @f: The file
+ */
+static size_t hash_size(const struct file *f)
+{
+    return hash_mix(f->dev, f->size);
+}
 
 /**
- * malloc_or_die -- Wrapper for malloc()
+ * table_init - Allocate the slots of a hash table
+ * @t:    The table
+ * @hint: The number of entries expected
  *
- * This does the same thing as malloc() except that it aborts if memory
- * can't be allocated.
+ * Aborts if memory cannot be allocated.
  */
-static void *malloc_or_die(size_t size)
+static void table_init(struct table *t, size_t hint)
 {
-    void *mem = malloc(size);
+    size_t size = TABLE_MIN_SIZE;
 
-    if (!mem) {
+    while (size < 2 * hint)
+        size *= 2;
+
+    free(t->slots);
+    if ((t->slots = calloc(size, sizeof(*t->slots))) == NULL) {
         jlog(JLOG_SYSFAT, "Cannot allocate memory");
         exit(1);
     }
-    return mem;
+    t->mask = size - 1;
+    t->count = 0;
 }
 
 /**
- * llistxattr_or_die - Wrapper for llistxattr()
+ * table_added - Account for an entry added to a hash table
+ * @t:    The table
+ * @hash: The hash function of the table
  *
- * This does the same thing as llistxattr() except that it aborts if any error
- * other than "not supported" is detected.
+ * Doubles the number of slots when the table is half full. Pointers to
+ * slots are invalid afterwards.
  */
-static ssize_t llistxattr_or_die(const char *path, char *list, size_t size)
+static void table_added(struct table *t, size_t (*hash)(const struct file *))
 {
-    ssize_t len = llistxattr(path, list, size);
+    struct file **old = t->slots;
+    size_t old_size = t->mask + 1;
+    size_t i;
 
-    if (len < 0 && errno != ENOTSUP) {
-        jlog(JLOG_SYSFAT, "Cannot get xattr names for %s", path);
-        exit(1);
+    if (++t->count * 2 <= t->mask)
+        return;
+
+    t->slots = NULL;
+    table_init(t, old_size);
+
+    for (i = 0; i < old_size; i++) {
+        size_t j;
+
+        if (old[i] == NULL)
+            continue;
+        for (j = hash(old[i]) & t->mask; t->slots[j] != NULL;
+             j = (j + 1) & t->mask);
+        t->slots[j] = old[i];
+        t->count++;
     }
-    return len;
+
+    free(old);
 }
 
 /**
- * lgetxattr_or_die - Wrapper for lgetxattr()
+ * table_remove - Empty a slot of a hash table
+ * @t:    The table
+ * @slot: The slot, as returned by table_find_ino() or table_find_size()
+ * @hash: The hash function of the table
  *
- * This does the same thing as lgetxattr() except that it aborts upon error.
+ * Entries after the slot which would no longer be found are moved back,
+ * so no tombstones are needed. Pointers to slots are invalid afterwards.
  */
-static ssize_t lgetxattr_or_die(const char *path, const char *name, void *value,
-                                size_t size)
+static void table_remove(struct table *t, struct file **slot,
+                         size_t (*hash)(const struct file *))
 {
-    ssize_t len = lgetxattr(path, name, value, size);
+    size_t i = slot - t->slots;
+    size_t j = i;
 
-    if (len < 0) {
-        jlog(JLOG_SYSFAT, "Cannot get xattr value of %s for %s", name, path);
-        exit(1);
+    for (;;) {
+        size_t home;
+
+        j = (j + 1) & t->mask;
+        if (t->slots[j] == NULL)
+            break;
+
+        /* Move the entry unless its home slot lies in (i, j] */
+        home = hash(t->slots[j]) & t->mask;
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
     }
-    return len;
+
+    t->slots[i] = NULL;
+    t->count--;
 }
 
 /**
- * get_xattr_name_count - Count the number of xattr names
- * @names: a non-empty table of concatenated, null-terminated xattr names
- * @len: the total length of the table
+ * table_find_ino - Find the slot of an inode
+ * @t: The table
+ * @f: A file with the inode (and basename) to look for
  *
- * @Returns the number of xattr names
+ * Returns: The slot holding the inode, or the empty slot it belongs into.
  */
-static int get_xattr_name_count(const char *const names, ssize_t len)
+static struct file **table_find_ino(struct table *t, const struct file *f)
 {
-    int count = 0;
-    const char *name;
+    size_t i;
 
-    for (name = names; name < (names + len); name += strlen(name) + 1)
-        count++;
+    if (t->slots == NULL)
+        table_init(t, 0);
 
-    return count;
+    for (i = hash_ino(f) & t->mask; t->slots[i] != NULL; i = (i + 1) & t->mask) {
+        const struct file *other = t->slots[i];
+
+        /* If opts.respect_name is used, we will restrict a struct file to
+         * contain only links with the same basename to keep the rest simple.
+         */
+        if (other->ino == f->ino && other->dev == f->dev &&
+            (!opts.respect_name ||
+             strcmp(other->links->path + other->links->basename,
+                    f->links->path + f->links->basename) == 0))
+            break;
+    }
+    return &t->slots[i];
 }
 
 /**
- * cmp_xattr_name_ptrs - Compare two pointers to xattr names by comparing
- * the names they point to.
+ * table_find_size - Find the slot of the files with a device and size
+ * @t: The table
+ * @f: A file with the device and size to look for
+ *
+ * Returns: The slot holding the files, or the empty slot they belong into.
  */
-static int cmp_xattr_name_ptrs(const void *ptr1, const void *ptr2)
+static struct file **table_find_size(struct table *t, const struct file *f)
 {
-    return strcmp(*(char *const *) ptr1, *(char *const *) ptr2);
+    size_t i;
+
+    if (t->slots == NULL)
+        table_init(t, 0);
+
+    for (i = hash_size(f) & t->mask; t->slots[i] != NULL; i = (i + 1) & t->mask)
+        if (t->slots[i]->size == f->size && t->slots[i]->dev == f->dev)
+            break;
+
+    return &t->slots[i];
 }
 
 /**
- * get_sorted_xattr_name_table - Create a sorted table of xattr names.
- * @names - table of concatenated, null-terminated xattr names
- * @n - the number of names
+ * files_hint - Estimate the number of files in the given paths
+ * @paths: The paths given on the command line
+ * @count: The number of paths
+ * @bound: Whether an upper bound is wanted instead of an estimate
  *
- * @Returns allocated table of pointers to the names, sorted alphabetically
+ * The number of inodes in use on the file system of a path bounds the
+ * number of files below it. It is only a fair estimate for a path at the
+ * root of its file system, so other paths count nothing unless @bound is
+ * set, and the tables grow as their files are found. Up to TABLE_MAX_HINT.
  */
-static const char **get_sorted_xattr_name_table(const char *names, int n)
+static unsigned long long files_hint(char *const paths[], int count,
+                                     hl_bool bound)
 {
-    const char **table = malloc_or_die(n * sizeof(char *));
+    unsigned long long hint = 0;
     int i;
 
-    for (i = 0; i < n; i++) {
-        table[i] = names;
-        names += strlen(names) + 1;
-    }
+    for (i = 0; i < count; i++) {
+        size_t len = strlen(paths[i]);
+        struct statvfs sv;
+        struct stat st;
+        struct stat up;
+        char *parent;
 
-    qsort(table, n, sizeof(char *), cmp_xattr_name_ptrs);
+        if (statvfs(paths[i], &sv) != 0 || sv.f_files <= sv.f_ffree)
+            continue;
 
-    return table;
-}
+        if (!bound) {
+            if ((parent = malloc(len + sizeof("/.."))) == NULL) {
+                jlog(JLOG_SYSFAT, "Cannot allocate memory");
+                exit(1);
+            }
+            memcpy(parent, paths[i], len);
+            strcpy(parent + len, "/..");
+
+            /* Not a mount point, nor the root directory */
+            if (stat(paths[i], &st) != 0 || stat(parent, &up) != 0 ||
+                (st.st_dev == up.st_dev && st.st_ino != up.st_ino)) {
+                free(parent);
+                continue;
+            }
+            free(parent);
+        }
+
+        hint += sv.f_files - sv.f_ffree;
+    }
+    if (hint > TABLE_MAX_HINT)
+        hint = TABLE_MAX_HINT;
+
+    return hint;
+}
+
+/**
+ * table_hint - Size the tables for the expected number of files
+ * @hint: The number of files expected, see files_hint()
+ *
+ * Sizing the tables up front means that they rarely have to grow.
+ */
+static void table_hint(unsigned long long hint)
+{
+    jlog(JLOG_DEBUG1, "Expecting up to %llu files", hint);
+
+    table_init(&files_by_ino, hint);
+    table_init(&files, hint);
+}
+
+/*
+ * SKETCH_MIN_BITS - Minimum number of counters in the sketch
+ * SKETCH_BITS_PER_FILE - Counters per expected file, to keep collisions rare
+ */
+#define SKETCH_MIN_BITS (64 * 1024)
+#define SKETCH_BITS_PER_FILE 8
+
+/**
+ * struct sketch - Sizes seen during the first walk of --prescan
+ * @once:       Bit map of the slots seen at least once
+ * @twice:      Bit map of the slots seen at least twice
+ * @mask:       The number of bits in each map, minus one
+ * @candidates: The number of files in slots seen at least twice
+ * @filter:     Whether the first walk is done and files are being filtered
+ *
+ * Every (device, size) pair maps to a slot holding a counter saturating at
+ * two. A file whose slot has been seen only once cannot have a partner, so
+ * the second walk does not keep it. Distinct sizes sharing a slot merely
+ * turn unique files into candidates, they never hide a duplicate. The same
+ * goes for the names of an inode with several links, which are counted
+ * once per name.
+ */
+static struct sketch {
+    unsigned char *once;
+    unsigned char *twice;
+    size_t mask;
+    unsigned long long candidates;
+    hl_bool filter;
+} sketch;
+
+/**
+ * sketch_init - Allocate the sketch for the first walk of --prescan
+ * @hint: The number of files expected, see files_hint()
+ */
+static void sketch_init(unsigned long long hint)
+{
+    size_t bits = SKETCH_MIN_BITS;
+
+    while (bits < hint * SKETCH_BITS_PER_FILE)
+        bits *= 2;
+
+    sketch.once = calloc(bits / CHAR_BIT, 1);
+    sketch.twice = calloc(bits / CHAR_BIT, 1);
+    if (sketch.once == NULL || sketch.twice == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    sketch.mask = bits - 1;
+}
+
+/**
+ * sketch_add - Count a file in the sketch
+ * @sb: The stat() result of the file
+ *
+ * This may be called from several walker threads at once.
+ */
+static void sketch_add(const struct stat *sb)
+{
+    size_t i = hash_mix(sb->st_dev, sb->st_size) & sketch.mask;
+    unsigned char bit = 1 << (i % CHAR_BIT);
+
+    if (!(ATOMIC_FETCH_OR(sketch.once[i / CHAR_BIT], bit) & bit))
+        return;
+    if (ATOMIC_FETCH_OR(sketch.twice[i / CHAR_BIT], bit) & bit)
+        ATOMIC_ADD(sketch.candidates, 1);
+    else
+        ATOMIC_ADD(sketch.candidates, 2);
+}
+
+/**
+ * sketch_collides - Check whether a file may share its size with another
+ * @sb: The stat() result of the file
+ */
+static hl_bool sketch_collides(const struct stat *sb)
+{
+    size_t i = hash_mix(sb->st_dev, sb->st_size) & sketch.mask;
+
+    return (sketch.twice[i / CHAR_BIT] >> (i % CHAR_BIT)) & 1;
+}
+
+/**
+ * sketch_free - Free the sketch
+ */
+static void sketch_free(void)
+{
+    free(sketch.once);
+    free(sketch.twice);
+    memset(&sketch, 0, sizeof(sketch));
+}
+
+/**
+ * struct outbuf - A buffer for formatting output
+ * @buf:  The buffer
+ * @size: The size of @buf
+ * @len:  The length of the output in @buf, output beyond @size is dropped
+ */
+struct outbuf {
+    char *buf;
+    size_t size;
+    size_t len;
+};
+
+__attribute__ ((format(printf, 2, 3)))
+/**
+ * outbuf_printf - Append formatted output to a buffer
+ * @out:    The buffer
+ * @format: A format string for printf()
+ */
+static void outbuf_printf(struct outbuf *out, const char *format, ...)
+{
+    va_list args;
+    int len;
+
+    if (out->len >= out->size)
+        return;
+
+    va_start(args, format);
+    len = vsnprintf(out->buf + out->len, out->size - out->len, format, args);
+    va_end(args);
+
+    if (len > 0)
+        out->len += len;
+    if (out->len > out->size - 1)
+        out->len = out->size - 1;
+}
+
+/**
+ * stats_text - Format the statistics as text
+ * @out: The buffer
+ */
+static void stats_text(struct outbuf *out)
+{
+    outbuf_printf(out, "Mode:     %s\n", opts.dry_run ? "dry-run" : "real");
+    outbuf_printf(out, "Files:    %zu\n", stats.files);
+    outbuf_printf(out, "Linked:   %zu files\n", stats.linked);
+    if (stats.link_errors > 0)
+        outbuf_printf(out, "Failed:   %zu links\n", stats.link_errors);
+    if (stats.already_linked > 0)
+        outbuf_printf(out, "Already:  %zu links\n", stats.already_linked);
+#ifdef HAVE_XATTR
+    outbuf_printf(out, "Compared: %zu xattrs\n", stats.xattr_comparisons);
+#endif
+    outbuf_printf(out, "Compared: %zu files\n", stats.comparisons);
+    outbuf_printf(out, "Digested: %zu files\n", stats.digests);
+    if (opts.dedupe)
+        outbuf_printf(out, "Deduped:  %zu files\n", stats.deduped);
+    outbuf_printf(out, "Saved:    %s\n", format((double) stats.saved));
+    outbuf_printf(out, "Duration: %.2f seconds\n",
+                  gettime() - stats.start_time);
+}
+
+/**
+ * stats_histogram - Format a bucket histogram as a JSON array
+ * @out:  The buffer
+ * @name: The name of the histogram
+ * @bins: The bins, see struct statistics
+ */
+static void stats_histogram(struct outbuf *out, const char *name,
+                            const size_t bins[STATS_HISTOGRAM])
+{
+    const char *sep = "";
+    int i;
+
+    outbuf_printf(out, "\"%s\":[", name);
+    for (i = 0; i < STATS_HISTOGRAM; i++) {
+        if (bins[i] == 0)
+            continue;
+        outbuf_printf(out, "%s{\"up_to\":%llu,\"buckets\":%zu}", sep,
+                      1ULL << i, bins[i]);
+        sep = ",";
+    }
+    outbuf_printf(out, "]");
+}
+
+/**
+ * stats_json - Format the statistics as a JSON object
+ * @out: The buffer
+ *
+ * The times of the phase the main thread is in include the time spent in
+ * it so far, so that snapshots taken by SIGUSR1 are up to date.
+ */
+static void stats_json(struct outbuf *out)
+{
+    unsigned long long wall = clock_ns(CLOCK_MONOTONIC);
+    unsigned long long cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    int i;
+
+    outbuf_printf(out, "{\"mode\":\"%s\",", opts.dry_run ? "dry-run" : "real");
+    outbuf_printf(out, "\"files\":%zu,\"linked\":%zu,\"deduped\":%zu,",
+                  stats.files, stats.linked, stats.deduped);
+    outbuf_printf(out, "\"queued\":%zu,\"link_errors\":%zu,",
+                  stats.queued, stats.link_errors);
+    outbuf_printf(out, "\"already_linked\":%zu,", stats.already_linked);
+    outbuf_printf(out, "\"comparisons\":%zu,\"xattr_comparisons\":%zu,",
+                  stats.comparisons, stats.xattr_comparisons);
+    outbuf_printf(out, "\"digests\":%zu,\"bytes_read\":%llu,",
+                  stats.digests, stats.bytes_read);
+    outbuf_printf(out, "\"saved_bytes\":%llu,\"duration_seconds\":%.6f,",
+                  stats.saved, gettime() - stats.start_time);
+
+    outbuf_printf(out, "\"phases\":{");
+    for (i = 0; i < PHASES; i++) {
+        unsigned long long phase_wall = stats.wall_ns[i];
+        unsigned long long phase_cpu = stats.cpu_ns[i];
+
+        if ((enum phase) i == stats.phase && stats.phase_wall != 0 &&
+            stats.phase < PHASE_COMPARING) {
+            phase_wall += wall - stats.phase_wall;
+            phase_cpu += cpu - stats.phase_cpu;
+        }
+        outbuf_printf(out, "%s\"%s\":{\"wall_seconds\":%.6f,"
+                      "\"cpu_seconds\":%.6f}", i ? "," : "", phase_names[i],
+                      phase_wall / 1e9, phase_cpu / 1e9);
+    }
+    outbuf_printf(out, "},");
+
+    outbuf_printf(out, "\"syscalls\":{");
+    for (i = 0; i < CALLS; i++)
+        outbuf_printf(out, "%s\"%s\":%llu", i ? "," : "", call_names[i],
+                      stats.calls[i]);
+    outbuf_printf(out, "},");
+
+    outbuf_printf(out, "\"buckets\":{\"count\":%zu,", stats.buckets);
+    stats_histogram(out, "files", stats.bucket_sizes);
+    outbuf_printf(out, ",");
+    stats_histogram(out, "cost_bytes", stats.bucket_costs);
+    outbuf_printf(out, "}}\n");
+}
+
+/**
+ * print_stats - Print statistics to stdout or the --stats-file
+ *
+ * The statistics are formatted into a buffer first and written at once.
+ * A regular --stats-file is rewritten, so that it always holds the latest
+ * statistics, anything else gets one after the other.
+ */
+static void print_stats(void)
+{
+    char buf[8192];
+    struct outbuf out = { buf, sizeof(buf), 0 };
+    struct stat st;
+
+    if (opts.stats_json)
+        stats_json(&out);
+    else
+        stats_text(&out);
+
+    if (stats_fd < 0) {
+        if (JLOG_SUMMARY <= opts.verbosity) {
+            flockfile(stdout);
+            fwrite(buf, 1, out.len, stdout);
+            fflush(stdout);
+            funlockfile(stdout);
+        }
+    } else if (fstat(stats_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (ftruncate(stats_fd, 0) != 0 ||
+            pwrite(stats_fd, buf, out.len, 0) != (ssize_t) out.len)
+            jlog(JLOG_SYSERR, "Cannot write statistics");
+    } else if (write(stats_fd, buf, out.len) != (ssize_t) out.len) {
+        jlog(JLOG_SYSERR, "Cannot write statistics");
+    }
+}
+
+/**
+ * handle_interrupt - Handle a signal
+ *
+ * Print the statistics if they have been requested by SIGUSR1, exactly
+ * once even if several threads get here at the same time.
+ *
+ * Returns: %TRUE on SIGINT, SIGTERM; %FALSE on all other signals.
+ */
+static hl_bool handle_interrupt(void)
+{
+    switch (last_signal) {
+    case SIGINT:
+    case SIGTERM:
+        return TRUE;
+    }
+
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+    if (stats_requested && __sync_bool_compare_and_swap(&stats_requested, 1, 0)) {
+#else
+    if (stats_requested) {
+        stats_requested = 0;
+#endif
+        print_stats();
+        if (stats_fd < 0 && !opts.stats_json)
+            putchar('\n');
+    }
+
+    return FALSE;
+}
+
+#ifdef HAVE_XATTR
+
+/**
+ * malloc_or_die -- Wrapper for malloc()
+ *
+ * This does the same thing as malloc() except that it aborts if memory
+ * can't be allocated.
+ */
+static void *malloc_or_die(size_t size)
+{
+    void *mem = malloc(size);
+
+    if (!mem) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    return mem;
+}
+
+/**
+ * get_xattr_name_count - Count the number of xattr names
+ * @names: a non-empty table of concatenated, null-terminated xattr names
+ * @len: the total length of the table
+ *
+ * @Returns the number of xattr names
+ */
+static int get_xattr_name_count(const char *const names, ssize_t len)
+{
+    int count = 0;
+    const char *name;
+
+    for (name = names; name < (names + len); name += strlen(name) + 1)
+        count++;
+
+    return count;
+}
+
+/**
+ * cmp_xattr_name_ptrs - Compare two pointers to xattr names by comparing
+ * the names they point to.
+ */
+static int cmp_xattr_name_ptrs(const void *ptr1, const void *ptr2)
+{
+    return strcmp(*(char *const *) ptr1, *(char *const *) ptr2);
+}
+
+/**
+ * get_sorted_xattr_name_table - Create a sorted table of xattr names.
+ * @names - table of concatenated, null-terminated xattr names
+ * @n - the number of names
+ *
+ * @Returns allocated table of pointers to the names, sorted alphabetically
+ */
+static const char **get_sorted_xattr_name_table(const char *names, int n)
+{
+    const char **table = malloc_or_die(n * sizeof(char *));
+    int i;
+
+    for (i = 0; i < n; i++) {
+        table[i] = names;
+        names += strlen(names) + 1;
+    }
+
+    qsort(table, n, sizeof(char *), cmp_xattr_name_ptrs);
+
+    return table;
+}
+
+/**
+ * xattr_read - Read the extended attributes of a file in canonical form
+ * @f:    The file
+ * @blob: Set to the attributes, to be free()d, or %NULL if there are none
+ * @len:  Set to the length of @blob
+ *
+ * The attributes are sorted by name and stored one after the other as the
+ * name, its null byte, the length of the value as a uint32_t and the value,
+ * so that two files have the same attributes if their blobs are equal. The
+ * attributes are read through a file descriptor, so that the path is only
+ * resolved once.
+ *
+ * Returns: %FALSE if the attributes could not be read.
+ */
+static hl_bool xattr_read(const struct file *f, char **blob, size_t *len)
+{
+    const char **table = NULL;
+    char *names = NULL;
+    char *buf = NULL;
+    size_t alloc = 0;
+    size_t pos = 0;
+    ssize_t names_len;
+    hl_bool ret = FALSE;
+    int fd;
+    int n;
+    int i;
+
+    *blob = NULL;
+    *len = 0;
+
+    COUNT_CALL(CALL_OPEN);
+    if ((fd = open(f->links->path, O_RDONLY | O_NOFOLLOW)) < 0) {
+        jlog(JLOG_SYSERR, "Cannot open %s", f->links->path);
+        return FALSE;
+    }
+
+    COUNT_CALL(CALL_XATTR);
+    names_len = flistxattr(fd, NULL, 0);
+    if (names_len > 0) {
+        names = malloc_or_die(names_len);
+        COUNT_CALL(CALL_XATTR);
+        names_len = flistxattr(fd, names, names_len);
+    }
+    if (names_len < 0 && errno != ENOTSUP) {
+        jlog(JLOG_SYSERR, "Cannot get xattr names for %s", f->links->path);
+        goto out;
+    }
+    if (names_len <= 0) {
+        ret = TRUE;             /* xattrs not supported or none at all */
+        goto out;
+    }
+
+    n = get_xattr_name_count(names, names_len);
+    table = get_sorted_xattr_name_table(names, n);
+
+    for (i = 0; i < n; i++) {
+        size_t name_len = strlen(table[i]) + 1;
+        ssize_t value_len = fgetxattr(fd, table[i], NULL, 0);
+        uint32_t value_len32;
+
+        COUNT_CALL(CALL_XATTR);
+
+        if (value_len >= 0 &&
+            pos + name_len + sizeof(value_len32) + value_len > alloc) {
+            alloc = 2 * (pos + name_len + sizeof(value_len32) + value_len);
+            if ((buf = realloc(buf, alloc)) == NULL) {
+                jlog(JLOG_SYSFAT, "Cannot allocate memory");
+                exit(1);
+            }
+        }
+        if (value_len >= 0) {
+            COUNT_CALL(CALL_XATTR);
+            value_len = fgetxattr(fd, table[i],
+                                  buf + pos + name_len + sizeof(value_len32),
+                                  value_len);
+        }
+        if (value_len < 0) {
+            jlog(JLOG_SYSERR, "Cannot get xattr value of %s for %s",
+                 table[i], f->links->path);
+            goto out;
+        }
+
+        value_len32 = value_len;
+        memcpy(buf + pos, table[i], name_len);
+        memcpy(buf + pos + name_len, &value_len32, sizeof(value_len32));
+        pos += name_len + sizeof(value_len32) + value_len;
+    }
+
+    *blob = buf;
+    *len = pos;
+    buf = NULL;
+    ret = TRUE;
+
+  out:
+    close(fd);
+    free(names);
+    free(table);
+    free(buf);
+    return ret;
+}
+#endif
+
+/*
+ * DIRECT_ALIGN - Alignment of buffers, offsets and sizes for O_DIRECT
+ *
+ * A multiple of the logical block size of about every device.
+ */
+#define DIRECT_ALIGN 4096
+
+/**
+ * open_contents - Open a file to read its contents
+ * @path: The path of the file
+ *
+ * With --uncached, the file is opened with O_NOATIME, so that reading it
+ * does not write its inode, unless we do not own it and are not allowed
+ * to. With --direct-io, it is opened with O_DIRECT as well where the file
+ * system supports it, see direct_off().
+ *
+ * Returns: The file descriptor, or -1 with errno set.
+ */
+static int open_contents(const char *path)
+{
+    int flags = O_RDONLY;
+    int fd;
+
+#ifdef O_NOATIME
+    if (opts.uncached)
+        flags |= O_NOATIME;
+#endif
+#ifdef O_DIRECT
+    if (opts.direct)
+        flags |= O_DIRECT;
+#endif
+
+    COUNT_CALL(CALL_OPEN);
+    while ((fd = open(path, flags)) < 0 && flags != O_RDONLY) {
+#ifdef O_NOATIME
+        if (errno == EPERM && (flags & O_NOATIME)) {
+            flags &= ~O_NOATIME;
+            COUNT_CALL(CALL_OPEN);
+            continue;
+        }
+#endif
+#ifdef O_DIRECT
+        if (errno == EINVAL && (flags & O_DIRECT)) {
+            flags &= ~O_DIRECT;
+            COUNT_CALL(CALL_OPEN);
+            continue;
+        }
+#endif
+        break;
+    }
+
+    return fd;
+}
+
+/**
+ * close_contents - Close a file opened by open_contents()
+ * @fd: The file descriptor
+ *
+ * With --uncached, the pages of the file are dropped from the page cache
+ * first, so that comparing files does not push out those of other programs.
+ */
+static void close_contents(int fd)
+{
+    if (opts.uncached)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/**
+ * direct_off - Read a file through the page cache after all
+ * @fd: The file descriptor
+ *
+ * Reads with O_DIRECT fail with EINVAL if the buffer, offset or length is
+ * not aligned as the device requires it, which happens for the rest of a
+ * file after a short read, for example.
+ *
+ * Returns: %TRUE if O_DIRECT was set and has been cleared, so that the
+ * read can be retried.
+ */
+static hl_bool direct_off(int fd)
+{
+#ifdef O_DIRECT
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags >= 0 && (flags & O_DIRECT) &&
+        fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0)
+        return TRUE;
+#endif
+    (void) fd;
+    return FALSE;
+}
+
+/**
+ * malloc_aligned - Allocate a buffer suitable for O_DIRECT
+ * @size: The size of the buffer
+ */
+static void *malloc_aligned(size_t size)
+{
+    void *mem;
+
+    if (posix_memalign(&mem, DIRECT_ALIGN, size) != 0) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    return mem;
+}
+
+/**
+ * pread_full - Read as much of a block as possible
+ * @fd:  The file descriptor to read from
+ * @buf: The buffer to read into
+ * @len: The number of bytes to read
+ * @off: The offset to read from
+ *
+ * Like pread(), but retries on short reads, and without O_DIRECT if the
+ * read is not aligned for it. Returns the number of bytes read, which is
+ * smaller than @len only at the end of the file, or -1 on error.
+ */
+static ssize_t pread_full(int fd, void *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t r = pread(fd, (char *) buf + done, len - done, off + done);
+
+        COUNT_CALL(CALL_READ);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && errno == EINVAL && direct_off(fd))
+            continue;
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    STATS_ADD(bytes_read, done);
+    return done;
+}
+
+/*
+ * COMPARE_BLOCK_SIZE - Size of the blocks compared at once
+ */
+#define COMPARE_BLOCK_SIZE 65536
+
+/*
+ * COMPARE_RUN_SIZE - Size of the blocks compared at once on rotating disks
+ *
+ * Large enough that reading it takes much longer than seeking to it.
+ */
+#define COMPARE_RUN_SIZE (4 * 1024 * 1024)
+
+/*
+ * devices
+ *
+ * Whether the devices seen so far are rotating disks. Filled by
+ * device_rotational() while collecting buckets, only read afterwards.
+ */
+static struct {
+    dev_t dev;
+    hl_bool rotational;
+} devices[64];
+static size_t devices_count;
+
+/**
+ * device_rotational - Check whether files should be read in physical order
+ * @dev: The device
+ *
+ * With --physical-order=auto, this is the case for rotating disks, as
+ * reported by /sys/dev/block/MAJOR:MINOR/queue/rotational.
+ */
+static hl_bool device_rotational(dev_t dev)
+{
+    char path[64];
+    char c = '0';
+    size_t i;
+    int fd;
+
+    if (opts.physical_order != ORDER_AUTO)
+        return opts.physical_order == ORDER_ALWAYS;
+
+    for (i = 0; i < devices_count; i++)
+        if (devices[i].dev == dev)
+            return devices[i].rotational;
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational",
+             major(dev), minor(dev));
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        /* A partition uses the queue of its disk */
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational",
+                 major(dev), minor(dev));
+        fd = open(path, O_RDONLY);
+    }
+    if (fd >= 0) {
+        if (read(fd, &c, 1) != 1)
+            c = '0';
+        close(fd);
+    }
+
+    if (devices_count < sizeof(devices) / sizeof(devices[0])) {
+        devices[devices_count].dev = dev;
+        devices[devices_count].rotational = c == '1';
+        devices_count++;
+    }
+    jlog(JLOG_DEBUG1, "Device %u:%u is %s", major(dev), minor(dev),
+         c == '1' ? "rotational, reading in physical order" : "not rotational");
+    return c == '1';
+}
+
+/**
+ * file_physical - Find where the contents of a file start on the disk
+ * @f: The file
+ *
+ * Uses FIEMAP to find the physical offset of the first extent. Without
+ * FIEMAP, the inode number serves as a rough substitute, as file systems
+ * tend to allocate blocks near their inode.
+ *
+ * Returns: The offset, or %UINT64_MAX if it is not known.
+ */
+static uint64_t file_physical(const struct file *f)
+{
+#ifdef HAVE_FIEMAP
+    uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) /
+                 sizeof(uint64_t) + 1];
+    struct fiemap *map = (struct fiemap *) buf;
+    uint64_t physical = UINT64_MAX;
+    int fd;
+
+    COUNT_CALL(CALL_OPEN);
+    if ((fd = open(f->links->path, O_RDONLY | O_NOFOLLOW)) < 0)
+        return UINT64_MAX;
+
+    memset(buf, 0, sizeof(buf));
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0 &&
+        !(map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))
+        physical = map->fm_extents[0].fe_physical;
+
+    close(fd);
+    return physical;
+#else
+    return f->ino;
+#endif
+}
+
+/**
+ * contents_compare_read - Compare two open files using read()
+ * @a:     The first file
+ * @b:     The second file
+ * @fa:    Descriptor of @a
+ * @fb:    Descriptor of @b
+ * @buf_a: Buffer for blocks of @a
+ * @buf_b: Buffer for blocks of @b
+ * @len:   The size of the buffers
+ *
+ * Returns: 0 if the contents are equal, non-zero if they differ, cannot be
+ * read or we were interrupted.
+ */
+static int contents_compare_read(const struct file *a, const struct file *b,
+                                 int fa, int fb, char *buf_a, char *buf_b,
+                                 size_t len)
+{
+    int cmp = 0;                /* zero => equal */
+    off_t off = 0;              /* current offset */
+
+    while (!handle_interrupt() && cmp == 0) {
+        ssize_t ca;
+        ssize_t cb;
+
+        if ((ca = pread_full(fa, buf_a, len, off)) < 0) {
+            jlog(JLOG_SYSERR, "Cannot read %s", a->links->path);
+            return 1;
+        }
+        if ((cb = pread_full(fb, buf_b, len, off)) < 0) {
+            jlog(JLOG_SYSERR, "Cannot read %s", b->links->path);
+            return 1;
+        }
+
+        off += ca;
+
+        if ((ca != cb || ca == 0)) {
+            cmp = CMP(ca, cb);
+            break;
+        }
+        cmp = memcmp(buf_a, buf_b, ca);
+    }
+    return cmp;
+}
+
+/**
+ * contents_compare_runs - Compare two open files on a rotating disk
+ * @a:  The first file
+ * @b:  The second file
+ * @fa: Descriptor of @a
+ * @fb: Descriptor of @b
+ *
+ * Like contents_compare_read(), but in blocks of %COMPARE_RUN_SIZE, so
+ * that the disk reads long runs of each file instead of seeking between
+ * them every few blocks.
+ *
+ * Returns: 0 if the contents are equal, non-zero if they differ, cannot be
+ * read or we were interrupted.
+ */
+static int contents_compare_runs(const struct file *a, const struct file *b,
+                                 int fa, int fb)
+{
+    size_t len = a->size < COMPARE_RUN_SIZE ? (size_t) a->size + 1 :
+        COMPARE_RUN_SIZE;
+    char *buf;
+    int cmp;
+
+    len = (len + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1);
+    buf = malloc_aligned(2 * len);
+
+    cmp = contents_compare_read(a, b, fa, fb, buf, buf + len, len);
+    free(buf);
+    return cmp;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * URING_CHUNK_SIZE - Size of a single read submitted to the ring
+ * URING_DEPTH      - Number of reads kept in flight per file
+ */
+#define URING_CHUNK_SIZE (256 * 1024)
+#define URING_DEPTH      4
+
+/**
+ * struct uring - An io_uring instance, mapped into our address space
+ * @fd:       The ring file descriptor
+ * @sq_head:  Head of the submission queue (advanced by the kernel)
+ * @sq_tail:  Tail of the submission queue (advanced by us)
+ * @sq_mask:  Mask for indices into the submission queue
+ * @sq_array: Indices of submitted entries in @sqes
+ * @sqes:     The submission queue entries
+ * @cq_head:  Head of the completion queue (advanced by us)
+ * @cq_tail:  Tail of the completion queue (advanced by the kernel)
+ * @cq_mask:  Mask for indices into the completion queue
+ * @cqes:     The completion queue entries
+ * @bufs:     Aligned buffers, two times URING_DEPTH blocks
+ * @sq:       The mapping of the submission queue, of @sq_len bytes
+ * @cq:       The mapping of the completion queue, of @cq_len bytes
+ * @sqes_len: The size of the mapping of @sqes
+ * @tried:    Whether the ring has been set up, or failed to be
+ * @broken:   Whether io_uring_enter() failed, so reads may still be pending
+ *
+ * We use the raw system calls, in order not to depend on liburing. Each
+ * thread has its own ring, set up by uring_get().
+ */
+static THREAD_LOCAL struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    char *bufs;
+    char *sq;
+    size_t sq_len;
+    char *cq;
+    size_t cq_len;
+    size_t sqes_len;
+    hl_bool tried;
+    hl_bool broken;
+} thread_ring = { -1 };
+
+/**
+ * uring_unmap - Unmap the queues of the ring of the current thread
+ */
+static void uring_unmap(void)
+{
+    struct uring *ring = &thread_ring;
+
+    if (ring->sq != NULL && ring->sq != MAP_FAILED)
+        munmap(ring->sq, ring->sq_len);
+    if (ring->cq != NULL && ring->cq != MAP_FAILED && ring->cq != ring->sq)
+        munmap(ring->cq, ring->cq_len);
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    ring->sq = ring->cq = NULL;
+    ring->sqes = NULL;
+}
+
+/**
+ * uring_get - Get the ring of the current thread
+ *
+ * The ring is set up on first use. If io_uring is not available, this
+ * is remembered and %NULL returned from then on, as it is for a ring
+ * which failed.
+ */
+static struct uring *uring_get(void)
+{
+    static hl_bool unavailable;
+    struct uring *ring = &thread_ring;
+    struct io_uring_params p;
+    int fd;
+
+    if (ring->tried)
+        return ring->bufs != NULL && !ring->broken ? ring : NULL;
+    if (unavailable)
+        return NULL;
+
+    ring->tried = TRUE;
+    memset(&p, 0, sizeof(p));
+
+    if ((fd = syscall(__NR_io_uring_setup, 2 * URING_DEPTH, &p)) < 0) {
+        jlog(JLOG_DEBUG1, "io_uring not available, using read()");
+        unavailable = TRUE;
+        return NULL;
+    }
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_len > ring->sq_len)
+        ring->sq_len = ring->cq_len;
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq :
+        mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (ring->sq == MAP_FAILED || ring->cq == MAP_FAILED ||
+        ring->sqes == MAP_FAILED ||
+        posix_memalign((void **) &ring->bufs, 4096,
+                       2 * URING_DEPTH * URING_CHUNK_SIZE) != 0) {
+        jlog(JLOG_SYSERR, "Cannot set up io_uring, using read()");
+        ring->bufs = NULL;
+        uring_unmap();
+        close(fd);
+        return NULL;
+    }
+
+    ring->fd = fd;
+    ring->sq_head = (unsigned *) (ring->sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (ring->sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (ring->sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (ring->sq + p.sq_off.array);
+    ring->cq_head = (unsigned *) (ring->cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (ring->cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (ring->cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (ring->cq + p.cq_off.cqes);
+
+    return ring;
+}
+
+/**
+ * uring_release - Tear down the ring of the current thread
+ *
+ * Must be called by every thread which compared files before it ends. The
+ * buffers of a broken ring are kept, as the kernel may still read into them.
+ */
+static void uring_release(void)
+{
+    struct uring *ring = &thread_ring;
+
+    if (ring->bufs != NULL) {
+        close(ring->fd);
+        uring_unmap();
+        if (!ring->broken)
+            free(ring->bufs);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/**
+ * uring_read - Queue a read
+ * @ring: The ring
+ * @fd:   The file to read from
+ * @buf:  The buffer to read into, URING_CHUNK_SIZE bytes
+ * @off:  The offset to read from
+ * @data: Identifies the read in its completion
+ *
+ * The read is only queued, call uring_enter() to submit it.
+ */
+static void uring_read(struct uring *ring, int fd, char *buf, off_t off,
+                       unsigned data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = URING_CHUNK_SIZE;
+    sqe->off = off;
+    sqe->user_data = data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * uring_enter - Submit queued reads and wait for a completion
+ * @ring:    The ring
+ * @submit:  The number of reads queued since the last call
+ * @res:     Set to the result of the completed read
+ *
+ * Returns: The data of the completed read, or -1 on error.
+ */
+static long uring_enter(struct uring *ring, unsigned submit, int *res)
+{
+    unsigned head = *ring->cq_head;
+    struct io_uring_cqe *cqe;
+    long data;
+
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        COUNT_CALL(CALL_READ);
+        if (syscall(__NR_io_uring_enter, ring->fd, submit, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return -1;
+        submit = 0;
+    }
+    if (submit > 0 && syscall(__NR_io_uring_enter, ring->fd, submit, 0, 0,
+                              NULL, 0) < 0)
+        return -1;
+
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    data = cqe->user_data;
+    *res = cqe->res;
+    if (cqe->res > 0)
+        STATS_ADD(bytes_read, cqe->res);
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return data;
+}
+
+/**
+ * contents_compare_uring - Compare two open files using io_uring
+ * @a:  The first file
+ * @b:  The second file
+ * @fa: Descriptor of @a
+ * @fb: Descriptor of @b
+ *
+ * Keep URING_DEPTH large reads in flight for each file and compare the
+ * blocks in order as they complete, while the following ones are still
+ * being read.
+ *
+ * Returns: 0 if the contents are equal, non-zero if they differ, cannot be
+ * read or we were interrupted, -1 if io_uring is not available or failed,
+ * so that the files are compared with read() instead.
+ */
+static int contents_compare_uring(const struct file *a, const struct file *b,
+                                  int fa, int fb)
+{
+    struct uring *ring = uring_get();
+    ssize_t len[URING_DEPTH][2];
+    unsigned pending = 0;       /* reads submitted but not completed */
+    unsigned queued = 0;        /* reads queued but not submitted */
+    unsigned long long block = 0;       /* the next block to compare */
+    int cmp = 0;
+    unsigned i;
+
+    if (ring == NULL)
+        return -1;
+
+    for (i = 0; i < URING_DEPTH; i++) {
+        len[i][0] = len[i][1] = -2;     /* -2 => in flight */
+        uring_read(ring, fa, ring->bufs + (2 * i) * URING_CHUNK_SIZE,
+                   (off_t) i * URING_CHUNK_SIZE, 2 * i);
+        uring_read(ring, fb, ring->bufs + (2 * i + 1) * URING_CHUNK_SIZE,
+                   (off_t) i * URING_CHUNK_SIZE, 2 * i + 1);
+    }
+    queued = pending = 2 * URING_DEPTH;
+
+    while (cmp == 0) {
+        unsigned slot = block % URING_DEPTH;
+        char *buf_a = ring->bufs + (2 * slot) * URING_CHUNK_SIZE;
+        char *buf_b = buf_a + URING_CHUNK_SIZE;
+        off_t off = (off_t) block * URING_CHUNK_SIZE;
+
+        /* Wait until both blocks are there, storing other completions */
+        while (len[slot][0] == -2 || len[slot][1] == -2) {
+            int res;
+            long data = uring_enter(ring, queued, &res);
+
+            if (data < 0) {
+                jlog(JLOG_SYSERR, "Cannot wait for io_uring, using read()");
+                ring->broken = TRUE;
+                return -1;
+            }
+            queued = 0;
+            pending--;
+            /* -3 => rejected by O_DIRECT, read again with pread_full() */
+            len[data / 2][data % 2] = res == -EINVAL ? -3 :
+                res < 0 ? (errno = -res, -1) : res;
+        }
+
+        /* Complete short reads, which may happen before the end */
+        for (i = 0; i < 2; i++) {
+            ssize_t done = len[slot][i] == -3 ? 0 : len[slot][i];
+            ssize_t more;
+            char *buf = i == 0 ? buf_a : buf_b;
+
+            if (done < 0 || (done == 0 && len[slot][i] != -3) ||
+                done == URING_CHUNK_SIZE)
+                continue;
+            more = pread_full(i == 0 ? fa : fb, buf + done,
+                              URING_CHUNK_SIZE - done, off + done);
+            len[slot][i] = more < 0 ? -1 : done + more;
+        }
+
+        if (len[slot][0] < 0 || len[slot][1] < 0) {
+            jlog(JLOG_SYSERR, "Cannot read %s",
+                 len[slot][0] < 0 ? a->links->path : b->links->path);
+            cmp = 1;
+            break;
+        }
+        if (len[slot][0] != len[slot][1] || len[slot][0] == 0) {
+            cmp = CMP(len[slot][0], len[slot][1]);
+            break;
+        }
+        if ((cmp = memcmp(buf_a, buf_b, len[slot][0])) != 0)
+            break;
+        if (len[slot][0] < URING_CHUNK_SIZE || handle_interrupt())
+            break;
+
+        /* Reuse the slot for the block URING_DEPTH blocks ahead */
+        len[slot][0] = len[slot][1] = -2;
+        off += (off_t) URING_DEPTH * URING_CHUNK_SIZE;
+        uring_read(ring, fa, buf_a, off, 2 * slot);
+        uring_read(ring, fb, buf_b, off, 2 * slot + 1);
+        queued += 2;
+        pending += 2;
+        block++;
+    }
+
+    /* The buffers are ours again only once all reads have completed */
+    while (pending > 0) {
+        int res;
+
+        if (uring_enter(ring, queued, &res) < 0) {
+            jlog(JLOG_SYSERR, "Cannot wait for io_uring, using read()");
+            ring->broken = TRUE;
+            return -1;
+        }
+        queued = 0;
+        pending--;
+    }
+
+    return cmp != 0;
+}
+#else
+static int contents_compare_uring(const struct file *a, const struct file *b,
+                                  int fa, int fb)
+{
+    return -1;
+}
+
+static void uring_release(void)
+{
+}
+#endif
+
+/*
+ * MMAP_THRESHOLD   - Minimum file size for comparing mapped files
+ * MMAP_WINDOW_SIZE - Size of the part of a file mapped at once
+ *
+ * Mapping a file costs more than a few read() calls, which pays off only
+ * for larger files. Both are defaults, not measured crossovers; the
+ * "large" and "large-mmap" scenarios of test/bench.sh compare the two
+ * methods on files from 1 to 16 MiB.
+ */
+#define MMAP_THRESHOLD   (1024 * 1024)
+#define MMAP_WINDOW_SIZE (16 * 1024 * 1024)
+
+/*
+ * mmap_fault
+ *
+ * Where sigbus_handler() returns to if a mapped file is truncated while
+ * we are comparing it, %NULL outside of contents_compare_mmap().
+ */
+static THREAD_LOCAL sigjmp_buf *mmap_fault;
+
+/**
+ * sigbus_handler - Signal handler for SIGBUS
+ * @i: The signal number
+ *
+ * Access to a part of a mapping beyond the end of the file raises SIGBUS.
+ * Jump back into the comparison in that case, die otherwise.
+ */
+static void sigbus_handler(int i)
+{
+    if (mmap_fault != NULL)
+        siglongjmp(*mmap_fault, 1);
+
+    signal(i, SIG_DFL);
+    raise(i);
+}
+
+/**
+ * contents_compare_mmap - Compare two open files by mapping them
+ * @a:  The first file
+ * @b:  The second file
+ * @fa: Descriptor of @a
+ * @fb: Descriptor of @b
+ *
+ * Map the files window by window, advise the kernel to read ahead, and
+ * compare the mapped memory directly, saving the copies into buffers.
+ *
+ * Returns: 0 if the contents are equal, non-zero if they differ, cannot be
+ * read or we were interrupted.
+ */
+static int contents_compare_mmap(const struct file *a, const struct file *b,
+                                 int fa, int fb)
+{
+    sigjmp_buf fault;
+    struct stat sa;
+    struct stat sb;
+    char *volatile map_a = MAP_FAILED;
+    char *volatile map_b = MAP_FAILED;
+    volatile size_t len = 0;
+    volatile off_t off;
+    int cmp = 0;
+
+    if (fstat(fa, &sa) != 0 || fstat(fb, &sb) != 0) {
+        jlog(JLOG_SYSERR, "Cannot stat %s or %s", a->links->path,
+             b->links->path);
+        return 1;
+    }
+    if (sa.st_size != sb.st_size)
+        return 1;
+
+    if (sigsetjmp(fault, 1) != 0) {
+        mmap_fault = NULL;
+        jlog(JLOG_ERROR, "%s or %s was truncated while comparing",
+             a->links->path, b->links->path);
+        cmp = 1;
+        goto out;
+    }
+    mmap_fault = &fault;
+
+    for (off = 0; off < sa.st_size && cmp == 0; off += len) {
+        if (handle_interrupt()) {
+            cmp = 1;
+            break;
+        }
+
+        len = sa.st_size - off;
+        if (len > MMAP_WINDOW_SIZE)
+            len = MMAP_WINDOW_SIZE;
+
+        map_a = mmap(NULL, len, PROT_READ, MAP_SHARED, fa, off);
+        map_b = mmap(NULL, len, PROT_READ, MAP_SHARED, fb, off);
+        COUNT_CALL(CALL_READ);
+        COUNT_CALL(CALL_READ);
+
+        if (map_a == MAP_FAILED || map_b == MAP_FAILED) {
+            jlog(JLOG_SYSERR, "Cannot map %s",
+                 map_a == MAP_FAILED ? a->links->path : b->links->path);
+            cmp = 1;
+            break;
+        }
+
+        posix_madvise(map_a, len, POSIX_MADV_SEQUENTIAL);
+        posix_madvise(map_b, len, POSIX_MADV_SEQUENTIAL);
+        posix_madvise(map_a, len, POSIX_MADV_WILLNEED);
+        posix_madvise(map_b, len, POSIX_MADV_WILLNEED);
+
+        cmp = memcmp(map_a, map_b, len);
+        STATS_ADD(bytes_read, 2 * len);
+
+        munmap(map_a, len);
+        munmap(map_b, len);
+        map_a = map_b = MAP_FAILED;
+    }
+
+    mmap_fault = NULL;
+
+  out:
+    if (map_a != MAP_FAILED)
+        munmap(map_a, len);
+    if (map_b != MAP_FAILED)
+        munmap(map_b, len);
+    return cmp != 0;
+}
+
+/**
+ * file_contents_equal - Compare contents of two files for equality
+ * @a: The first file
+ * @b: The second file
+ *
+ * Compare the contents of the files for equality. Files larger than a
+ * single block are read through io_uring if available, so that several
+ * reads are in flight at any time. With --compare=mmap, files of at least
+ * MMAP_THRESHOLD bytes are mapped instead. On rotating disks, they are
+ * read in long runs by contents_compare_runs().
+ */
+static hl_bool file_contents_equal(const struct file *a, const struct file *b)
+{
+    static THREAD_LOCAL char *buf;     /* aligned for O_DIRECT */
+    int fa = -1;
+    int fb = -1;
+    int cmp = 1;                /* zero => equal */
+
+    assert(a->links != NULL);
+    assert(b->links != NULL);
+
+    jlog(JLOG_DEBUG1, "Comparing %s to %s", a->links->path, b->links->path);
+
+    STATS_ADD(comparisons, 1);
+
+    if (buf == NULL)
+        buf = malloc_aligned(2 * COMPARE_BLOCK_SIZE);
+
+    if ((fa = open_contents(a->links->path)) < 0) {
+        jlog(JLOG_SYSERR, "Cannot open %s", a->links->path);
+        goto out;
+    }
+    if ((fb = open_contents(b->links->path)) < 0) {
+        jlog(JLOG_SYSERR, "Cannot open %s", b->links->path);
+        goto out;
+    }
+
+    posix_fadvise(fa, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fb, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (opts.compare == COMPARE_MMAP && a->size >= MMAP_THRESHOLD)
+        cmp = contents_compare_mmap(a, b, fa, fb);
+    else if (a->size > COMPARE_BLOCK_SIZE && device_rotational(a->dev))
+        cmp = contents_compare_runs(a, b, fa, fb);
+    else if (a->size <= COMPARE_BLOCK_SIZE ||
+             (cmp = contents_compare_uring(a, b, fa, fb)) == -1)
+        cmp = contents_compare_read(a, b, fa, fb, buf,
+                                    buf + COMPARE_BLOCK_SIZE,
+                                    COMPARE_BLOCK_SIZE);
+
+  out:
+    if (fa >= 0)
+        close_contents(fa);
+    if (fb >= 0)
+        close_contents(fb);
+    return !handle_interrupt() && cmp == 0;
+}
+
+/*
+ * DIGEST_EDGE_SIZE - Size of the blocks hashed at each end of a file
+ *
+ * Files smaller than two such blocks skip the %DIGEST_EDGES stage and are
+ * digested in full straight away.
+ */
+#define DIGEST_EDGE_SIZE 4096
+
+/*
+ * DIGEST_BLOCK_SIZE - Size of the blocks read for a full digest
+ *
+ * At least two edges, which are read at once.
+ */
+#define DIGEST_BLOCK_SIZE 65536
+
+/* Bit in struct digests.digested recording that the file could not be read */
+#define DIGEST_FAILED (1u << DIGEST_STAGES)
+
+/* Bit in struct digests.digested recording that the cache has been consulted */
+#define DIGEST_LOOKED_UP (1u << (DIGEST_STAGES + 1))
+
+/* Bit in struct digests.digested recording a digest not yet in the cache */
+#define DIGEST_DIRTY (1u << (DIGEST_STAGES + 2))
+
+/* Bits in struct digests.digested recording the state of its xattr */
+#define XATTR_DIGESTED (1u << (DIGEST_STAGES + 3))
+#define XATTR_FAILED (1u << (DIGEST_STAGES + 4))
+
+/* Bit in struct digests.digested recording that we linked a file to it */
+#define DIGEST_LINKED (1u << (DIGEST_STAGES + 5))
+
+/**
+ * digest_update - Feed a buffer into a running digest
+ * @h:   The digest so far
+ * @buf: The data to add
+ * @len: The length of @buf
+ *
+ * A simple 64-bit multiply-rotate hash. It is not cryptographic, equal
+ * digests merely nominate files for the byte-for-byte comparison.
+ */
+static uint64_t digest_update(uint64_t h, const unsigned char *buf, size_t len)
+{
+    const uint64_t k1 = 0x9E3779B97F4A7C15ULL;
+    const uint64_t k2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t w;
+
+    for (; len >= sizeof(w); buf += sizeof(w), len -= sizeof(w)) {
+        memcpy(&w, buf, sizeof(w));
+        h ^= w * k1;
+        h = ((h << 31) | (h >> 33)) * k2;
+    }
+    for (; len > 0; buf++, len--) {
+        h ^= *buf * k1;
+        h = ((h << 31) | (h >> 33)) * k2;
+    }
+    return h;
+}
+
+/*
+ * CACHE_MAGIC - Identifies a digest cache file, including its version
+ */
+#define CACHE_MAGIC "HLCACHE1"
+
+/* Bits in struct cache_record.flags */
+#define CACHE_HAVE_EDGES (1u << DIGEST_EDGES)
+#define CACHE_HAVE_FULL  (1u << DIGEST_FULL)
+#define CACHE_HAVE_XATTR (1u << DIGEST_STAGES)
+
+/**
+ * struct cache_record - The cached digests of an inode
+ * @dev:    The device of the inode
+ * @ino:    The inode number
+ * @size:   The size of the file when the digests were computed
+ * @mtime:  The modification time, seconds and nanoseconds
+ * @ctime:  The change time, seconds and nanoseconds
+ * @digest: The digests, one per #enum digest_stage
+ * @xattr:  A digest of the extended attributes
+ * @flags:  Which of the digests are valid, %CACHE_HAVE_*
+ * @pad:    Unused, zero
+ *
+ * The cache file consists of %CACHE_MAGIC followed by these records in
+ * native byte order. New records are appended, a later record for the same
+ * inode replaces earlier ones.
+ */
+struct cache_record {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime[2];
+    int64_t ctime[2];
+    uint64_t digest[DIGEST_STAGES];
+    uint64_t xattr;
+    uint32_t flags;
+    uint32_t pad;
+};
+
+/*
+ * cache
+ *
+ * The digest cache given by --cache. The records of the file are mapped
+ * at @records, and @index is an open-addressing hash table of indices into
+ * @records plus one, keyed by device and inode number. New records wait
+ * in @pending until cache_save(). @foreign is set if the file exists but
+ * could not be read as a cache, so that it is left alone. @saved is set
+ * once cache_save() has written the file, which is appended to after.
+ */
+static struct {
+    const char *path;
+    void *map;
+    size_t map_len;
+    const struct cache_record *records;
+    size_t count;
+    size_t live;
+    uint32_t *index;
+    size_t mask;
+    hl_bool misaligned;
+    hl_bool foreign;
+    hl_bool saved;
+    struct cache_record *pending;
+    size_t pending_count;
+    size_t pending_alloc;
+} cache;
+
+/**
+ * cache_slot - Find the index slot of an inode
+ * @dev: The device
+ * @ino: The inode number
+ *
+ * Returns: The slot holding the inode, or the empty slot it belongs into.
+ */
+static size_t cache_slot(uint64_t dev, uint64_t ino)
+{
+    size_t i = (size_t) ((dev * 0x9E3779B97F4A7C15ULL) ^ ino) * 0xC2B2AE3D27D4EB4FULL;
+
+    for (i &= cache.mask; cache.index[i] != 0; i = (i + 1) & cache.mask) {
+        const struct cache_record *r = &cache.records[cache.index[i] - 1];
+
+        if (r->dev == dev && r->ino == ino)
+            break;
+    }
+    return i;
+}
+
+/**
+ * cache_open - Map the cache file and index its records
+ * @path: The path of the cache file
+ *
+ * A missing or empty cache file is not an error, it will be created by
+ * cache_save(). Any other file which is not a cache is not touched.
+ */
+static void cache_open(const char *path)
+{
+    struct stat st;
+    size_t header = sizeof(CACHE_MAGIC) - 1;
+    size_t i;
+    int fd;
+
+    cache.path = path;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        if (errno != ENOENT) {
+            jlog(JLOG_SYSERR, "Cannot open cache %s", path);
+            cache.foreign = TRUE;
+        }
+        return;
+    }
+    if (fstat(fd, &st) != 0) {
+        jlog(JLOG_SYSERR, "Cannot open cache %s", path);
+        cache.foreign = TRUE;
+        close(fd);
+        return;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    if ((size_t) st.st_size < header) {
+        jlog(JLOG_ERROR, "Ignoring cache %s of unknown format", path);
+        cache.foreign = TRUE;
+        close(fd);
+        return;
+    }
+
+    cache.map_len = st.st_size;
+    cache.map = mmap(NULL, cache.map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (cache.map == MAP_FAILED) {
+        jlog(JLOG_SYSERR, "Cannot map cache %s", path);
+        cache.map = NULL;
+        cache.foreign = TRUE;
+        return;
+    }
+    if (memcmp(cache.map, CACHE_MAGIC, header) != 0) {
+        jlog(JLOG_ERROR, "Ignoring cache %s of unknown format", path);
+        munmap(cache.map, cache.map_len);
+        cache.map = NULL;
+        cache.foreign = TRUE;
+        return;
+    }
+
+    posix_madvise(cache.map, cache.map_len, POSIX_MADV_WILLNEED);
+
+    cache.records = (const struct cache_record *) ((char *) cache.map + header);
+    cache.count = (cache.map_len - header) / sizeof(struct cache_record);
+    cache.misaligned = (cache.map_len - header) % sizeof(struct cache_record) != 0;
+
+    for (cache.mask = 1023; cache.mask < 2 * cache.count; cache.mask = cache.mask * 2 + 1);
+    if ((cache.index = calloc(cache.mask + 1, sizeof(*cache.index))) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+
+    for (i = 0; i < cache.count; i++) {
+        size_t slot = cache_slot(cache.records[i].dev, cache.records[i].ino);
+
+        if (cache.index[slot] == 0)
+            cache.live++;
+        cache.index[slot] = i + 1;
+    }
+
+    jlog(JLOG_DEBUG1, "Loaded %zu digests from cache %s", cache.live, path);
+}
+
+/**
+ * cache_fill - Fill a cache record for a file
+ * @r: The record
+ * @f: The file
+ */
+static void cache_fill(struct cache_record *r, const struct file *f)
+{
+    memset(r, 0, sizeof(*r));
+    r->dev = f->dev;
+    r->ino = f->ino;
+    r->size = f->size;
+    r->mtime[0] = f->mtime;
+    r->mtime[1] = f->mtime_nsec;
+    r->ctime[0] = f->ctime;
+    r->ctime[1] = f->ctime_nsec;
+    memcpy(r->digest, f->digests->digest, sizeof(r->digest));
+    r->xattr = f->digests->xattr;
+    r->flags = f->digests->digested & (CACHE_HAVE_EDGES | CACHE_HAVE_FULL);
+    if (f->digests->digested & XATTR_DIGESTED)
+        r->flags |= CACHE_HAVE_XATTR;
+}
+
+/**
+ * cache_lookup - Take the digests of a file from the cache
+ * @f: The file
+ *
+ * The cached digests are only used if the size and the modification and
+ * change times of the inode are still the same as when they were computed.
+ */
+static void cache_lookup(struct file *f)
+{
+    const struct cache_record *r;
+    size_t slot;
+
+    f->digests->digested |= DIGEST_LOOKED_UP;
+
+    if (cache.index == NULL)
+        return;
+
+    slot = cache_slot(f->dev, f->ino);
+    if (cache.index[slot] == 0)
+        return;
+
+    r = &cache.records[cache.index[slot] - 1];
+    if (r->size != (uint64_t) f->size ||
+        r->mtime[0] != f->mtime ||
+        r->mtime[1] != f->mtime_nsec ||
+        r->ctime[0] != f->ctime ||
+        r->ctime[1] != f->ctime_nsec)
+        return;
+
+    memcpy(f->digests->digest, r->digest, sizeof(f->digests->digest));
+    f->digests->digested |= r->flags & (CACHE_HAVE_EDGES | CACHE_HAVE_FULL);
+    if (r->flags & CACHE_HAVE_XATTR) {
+        f->digests->xattr = r->xattr;
+        f->digests->digested |= XATTR_DIGESTED;
+    }
+}
+
+/**
+ * cache_write - Write records to a file descriptor
+ * @fd:    The file descriptor
+ * @r:     The records
+ * @count: The number of records
+ */
+static hl_bool cache_write(int fd, const void *r, size_t count)
+{
+    const char *buf = r;
+    size_t len = count * sizeof(struct cache_record);
+
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0)
+            return FALSE;
+        buf += w;
+        len -= w;
+    }
+    return TRUE;
+}
+
+/**
+ * file_unchanged - Check whether a file is still the one we compared
+ * @f:  The file
+ * @st: The current stat() information of a link to @f
+ */
+static hl_bool file_unchanged(const struct file *f, const struct stat *st)
+{
+    return st->st_dev == f->dev && st->st_ino == f->ino &&
+        st->st_size == f->size &&
+        st->st_mtim.tv_sec == f->mtime &&
+        st->st_mtim.tv_nsec == f->mtime_nsec;
+}
+
+/**
+ * cache_collect - Take the new digests of the files in the buckets
+ *
+ * The records are kept until cache_save() writes them, so that the
+ * buckets can be freed before. Linking changes the change time of the
+ * master, so files are stat()ed again to record the times they have now,
+ * which means all links must have been made. A new change time is only
+ * taken when our links explain it: the file must have all its contents
+ * unchanged and exactly the link count we gave it.
+ */
+static void cache_collect(void)
+{
+    size_t i;
+
+    if (cache.path == NULL)
+        return;
+
+    for (i = 0; i < buckets.count; i++) {
+        size_t j;
+
+        for (j = 0; j < buckets.items[i].count; j++) {
+            struct file *f = &buckets.items[i].files[j];
+            struct stat st;
+
+            if (!(f->digests->digested & DIGEST_DIRTY))
+                continue;
+
+            /* Files linked away in a dry run are still there unchanged */
+            if (f->links != NULL || !opts.dry_run) {
+                if (f->links == NULL || lstat(f->links->path, &st) != 0 ||
+                    !file_unchanged(f, &st))
+                    continue;
+                if ((st.st_ctim.tv_sec != f->ctime ||
+                     st.st_ctim.tv_nsec != f->ctime_nsec) &&
+                    (!(f->digests->digested & DIGEST_LINKED) ||
+                     st.st_nlink != f->nlink))
+                    continue;
+                f->ctime = st.st_ctim.tv_sec;
+                f->ctime_nsec = st.st_ctim.tv_nsec;
+            }
+            f->digests->digested &= ~(DIGEST_DIRTY | DIGEST_LINKED);
+
+            if (cache.pending_count == cache.pending_alloc) {
+                size_t alloc = cache.pending_alloc ? 2 * cache.pending_alloc
+                    : 1024;
+                struct cache_record *r = realloc(cache.pending,
+                                                 alloc * sizeof(*r));
+
+                if (r == NULL) {
+                    jlog(JLOG_SYSFAT, "Cannot allocate memory");
+                    exit(1);
+                }
+                cache.pending = r;
+                cache.pending_alloc = alloc;
+            }
+            cache_fill(&cache.pending[cache.pending_count++], f);
+        }
+    }
+}
+
+/**
+ * cache_save - Add the digests computed in this run to the cache
+ *
+ * The new records, see cache_collect(), are appended to the cache file.
+ * If more than half of the records in the file have been superseded, or
+ * the file is damaged, it is rewritten with only the latest record per
+ * inode instead. A new cache is written the same way, through a temporary
+ * file. A file which cache_open() found not to be a cache is not written.
+ * Called again and again by --watch, the later calls only append.
+ */
+static void cache_save(void)
+{
+    struct cache_record *records;
+    size_t count;
+    hl_bool compact;
+    size_t i;
+    int fd;
+
+    if (cache.path == NULL)
+        return;
+    if (cache.foreign) {
+        jlog(JLOG_ERROR, "Not saving cache to %s, which is not a cache",
+             cache.path);
+        return;
+    }
+
+    cache_collect();
+    records = cache.pending;
+    count = cache.pending_count;
+    cache.pending = NULL;
+    cache.pending_count = cache.pending_alloc = 0;
+
+    /* What was mapped does not include what we wrote, only compact once */
+    compact = !cache.saved && (cache.map == NULL || cache.misaligned ||
+                               cache.count > 2 * cache.live);
+
+    if (count == 0 && !compact) {
+        free(records);
+        return;
+    }
+
+    if (compact) {
+        size_t len = strlen(cache.path) + sizeof(".tmp");
+        char *tmp = malloc(len);
+        hl_bool ok;
+
+        if (tmp == NULL) {
+            jlog(JLOG_SYSERR, "Cannot save cache %s", cache.path);
+            free(records);
+            return;
+        }
+        snprintf(tmp, len, "%s.tmp", cache.path);
+
+        ok = (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0 &&
+            write(fd, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1) ==
+            sizeof(CACHE_MAGIC) - 1;
+
+        for (i = 0; ok && cache.index && i <= cache.mask; i++)
+            if (cache.index[i] != 0)
+                ok = cache_write(fd, &cache.records[cache.index[i] - 1], 1);
+
+        ok = ok && cache_write(fd, records, count);
+        if (fd >= 0 && close(fd) != 0)
+            ok = FALSE;
+        if (ok && rename(tmp, cache.path) != 0)
+            ok = FALSE;
+        if (!ok) {
+            jlog(JLOG_SYSERR, "Cannot save cache %s", cache.path);
+            unlink(tmp);
+        }
+        cache.saved = ok;
+        free(tmp);
+    } else {
+        fd = open(cache.path, O_WRONLY | O_APPEND);
+
+        if (fd < 0 || !cache_write(fd, records, count) || close(fd) != 0)
+            jlog(JLOG_SYSERR, "Cannot save cache %s", cache.path);
+    }
+
+    jlog(JLOG_DEBUG1, "Saved %zu digests to cache %s", count, cache.path);
+    free(records);
+}
+
+/**
+ * file_digest - Compute a digest of a file, if not done already
+ * @f:     The file
+ * @stage: The stage of the digest to compute
+ *
+ * The digest is stored in @f so that every file is read at most once per
+ * stage, no matter how many other files it is compared to. If a digest
+ * cache is used, unchanged files are not read at all.
+ *
+ * Returns: %TRUE if the digest is available, %FALSE if the file could not
+ * be read or we were interrupted.
+ */
+static hl_bool file_digest(struct file *f, enum digest_stage stage)
+{
+    static THREAD_LOCAL unsigned char *buf;    /* aligned for O_DIRECT */
+    uint64_t h = 0;
+    off_t off = 0;
+    ssize_t len;
+    int fd;
+
+    assert(f->links != NULL);
+
+    if (f->digests->digested & DIGEST_FAILED)
+        return FALSE;
+    if (!(f->digests->digested & DIGEST_LOOKED_UP))
+        cache_lookup(f);
+    if (f->digests->digested & (1u << stage))
+        return TRUE;
+    if (f->size <= 2 * DIGEST_EDGE_SIZE)
+        stage = DIGEST_FULL;
+
+    jlog(JLOG_DEBUG2, "Digesting %s (%s)", f->links->path,
+         stage == DIGEST_FULL ? "full" : "edges");
+
+    if (buf == NULL)
+        buf = malloc_aligned(DIGEST_BLOCK_SIZE);
+
+    if ((fd = open_contents(f->links->path)) < 0) {
+        jlog(JLOG_SYSERR, "Cannot open %s", f->links->path);
+        f->digests->digested |= DIGEST_FAILED;
+        return FALSE;
+    }
+
+    STATS_ADD(digests, 1);
+
+    if (stage == DIGEST_EDGES) {
+        len = pread_full(fd, buf, DIGEST_EDGE_SIZE, 0);
+        if (len >= 0)
+            h = digest_update(h, buf, len);
+        if (len >= 0) {
+            /* Read the last edge from an aligned offset, for O_DIRECT */
+            off = (f->size - DIGEST_EDGE_SIZE) & ~(off_t) (DIRECT_ALIGN - 1);
+            len = pread_full(fd, buf, 2 * DIGEST_EDGE_SIZE, off);
+            off = f->size - DIGEST_EDGE_SIZE - off;
+        }
+        if (len >= 0) {
+            len = len > off ? len - off : 0;
+            h = digest_update(h, buf + off, len < DIGEST_EDGE_SIZE ? len :
+                              DIGEST_EDGE_SIZE);
+        }
+    } else {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        while ((len = pread_full(fd, buf, DIGEST_BLOCK_SIZE, off)) > 0) {
+            if (handle_interrupt()) {
+                close_contents(fd);
+                return FALSE;
+            }
+            h = digest_update(h, buf, len);
+            off += len;
+        }
+    }
+
+    if (len < 0) {
+        jlog(JLOG_SYSERR, "Cannot read %s", f->links->path);
+        f->digests->digested |= DIGEST_FAILED;
+        close_contents(fd);
+        return FALSE;
+    }
+
+    close_contents(fd);
+
+    f->digests->digest[stage] = h;
+    f->digests->digested |= (1u << stage) | DIGEST_DIRTY;
+
+    /* For small files, the full digest serves as the edge digest as well */
+    if (stage == DIGEST_FULL && f->size <= 2 * DIGEST_EDGE_SIZE) {
+        f->digests->digest[DIGEST_EDGES] = h;
+        f->digests->digested |= 1u << DIGEST_EDGES;
+    }
+
+    return TRUE;
+}
+
+/**
+ * file_digests_equal - Check whether two files may have the same contents
+ * @a: The first file
+ * @b: The second file
+ *
+ * Compare the digests of the two files stage by stage, computing them as
+ * needed. Files that differ early are never read in full.
+ *
+ * Returns: %FALSE if the files are known to differ or cannot be read,
+ * %TRUE if they are candidates for a byte-for-byte comparison.
+ */
+static hl_bool file_digests_equal(struct file *a, struct file *b)
+{
+    int stage;
+
+    for (stage = 0; stage < DIGEST_STAGES; stage++) {
+        if (!file_digest(a, stage) || !file_digest(b, stage))
+            return FALSE;
+        if (a->digests->digest[stage] != b->digests->digest[stage])
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+#ifdef HAVE_XATTR
+/**
+ * file_xattr_digest - Compute a digest of the extended attributes of a file
+ * @f: The file
+ *
+ * The attributes of each inode are read once by xattr_read(), no matter
+ * how many other files it is compared to, or not at all if the digest is
+ * in the cache. Files without attributes have the digest 0.
+ *
+ * Returns: %TRUE if the digest is available.
+ */
+static hl_bool file_xattr_digest(struct file *f)
+{
+    char *blob;
+    size_t len;
+
+    if (f->digests->digested & XATTR_FAILED)
+        return FALSE;
+    if (!(f->digests->digested & DIGEST_LOOKED_UP))
+        cache_lookup(f);
+    if (f->digests->digested & XATTR_DIGESTED)
+        return TRUE;
+
+    if (!xattr_read(f, &blob, &len)) {
+        f->digests->digested |= XATTR_FAILED;
+        return FALSE;
+    }
+
+    f->digests->xattr = len ? digest_update(len, (unsigned char *) blob, len)
+        : 0;
+    f->digests->digested |= XATTR_DIGESTED | DIGEST_DIRTY;
+    free(blob);
+
+    return TRUE;
+}
+
+/**
+ * file_xattrs_equal - Compare the extended attributes of two files
+ * @a: The first file
+ * @b: The second file
+ * @confirm: Whether to compare the attributes themselves if the digests match
+ *
+ * Comparing the digests is cheap, so it can be done before the contents
+ * are read. Only pairs about to be linked need to be confirmed.
+ *
+ * @Returns: %TRUE if and only if extended attributes are equal
+ */
+static hl_bool file_xattrs_equal(struct file *a, struct file *b,
+                                 hl_bool confirm)
+{
+    char *blob_a = NULL;
+    char *blob_b = NULL;
+    size_t len_a;
+    size_t len_b;
+    hl_bool ret;
+
+    assert(a->links != NULL);
+    assert(b->links != NULL);
+
+    if (!file_xattr_digest(a) || !file_xattr_digest(b) ||
+        a->digests->xattr != b->digests->xattr)
+        return FALSE;
+    if (!confirm || (a->digests->xattr == 0 && b->digests->xattr == 0))
+        return TRUE;
+
+    jlog(JLOG_DEBUG1, "Comparing xattrs of %s to %s", a->links->path,
+         b->links->path);
+
+    STATS_ADD(xattr_comparisons, 1);
+
+    ret = xattr_read(a, &blob_a, &len_a) && xattr_read(b, &blob_b, &len_b) &&
+        len_a == len_b && memcmp(blob_a, blob_b, len_a) == 0;
+
+    free(blob_a);
+    free(blob_b);
+    return ret;
+}
+#else
+static hl_bool file_xattrs_equal(struct file *a, struct file *b,
+                                 hl_bool confirm)
+{
+    return TRUE;
+}
+#endif
+
+/*
+ * LOCKSTEP_BLOCK_SIZE - Size of the blocks read per file in lockstep
+ * LOCKSTEP_MAX_FILES  - Upper bound for the files opened at once
+ */
+#define LOCKSTEP_BLOCK_SIZE 65536
+#define LOCKSTEP_MAX_FILES  256
+
+/**
+ * lockstep_budget - Number of files a lockstep comparison may open
+ *
+ * Leaves some file descriptors free for everything else.
+ */
+static size_t lockstep_budget(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+        return LOCKSTEP_MAX_FILES;
+    if (rl.rlim_cur < 32)
+        return 2;
+    if (rl.rlim_cur - 16 < LOCKSTEP_MAX_FILES)
+        return rl.rlim_cur - 16;
+    return LOCKSTEP_MAX_FILES;
+}
+
+/**
+ * bucket_lockstep - Split a bucket into classes of equal contents
+ * @files: The files in the bucket
+ * @count: The number of files in the bucket
+ *
+ * Open all files in the bucket and read them block by block, splitting the
+ * files into classes as soon as their blocks differ. Files which are alone
+ * in their class are closed right away. Every byte of every file is read at
+ * most once, and the result is exact, so no byte-for-byte comparison is
+ * needed afterwards. The class is stored in struct digests.group.
+ *
+ * Returns: %TRUE if the bucket has been classified, %FALSE if it is too
+ * large for the file descriptor budget or we were interrupted.
+ */
+static hl_bool bucket_lockstep(struct file *files, size_t count)
+{
+    struct member {
+        struct file *file;
+        int fd;
+        ssize_t len;
+        unsigned char *buf;
+    } *members = NULL;
+    size_t *order = NULL;       /* members, with classes being contiguous */
+    size_t *next = NULL;        /* scratch space for splitting a class */
+    char *starts = NULL;        /* whether a class starts at this position */
+    unsigned char *bufs = NULL;
+    hl_bool active = TRUE;
+    hl_bool ret = FALSE;
+    off_t off = 0;
+    size_t group = 0;
+    size_t i, j;
+
+    if (count > opts.lockstep_files)
+        return FALSE;
+
+    members = calloc(count, sizeof(*members));
+    order = calloc(count, sizeof(*order));
+    next = calloc(count, sizeof(*next));
+    starts = calloc(count, sizeof(*starts));
+    bufs = malloc_aligned(count * LOCKSTEP_BLOCK_SIZE);
+
+    if (!members || !order || !next || !starts || !bufs) {
+        jlog(JLOG_SYSERR, "Cannot allocate memory for lockstep comparison");
+        goto out;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct file *f = &files[i];
+
+        members[i].file = f;
+        members[i].buf = bufs + i * LOCKSTEP_BLOCK_SIZE;
+        members[i].fd = open_contents(f->links->path);
+        if (members[i].fd < 0)
+            jlog(JLOG_SYSERR, "Cannot open %s", f->links->path);
+        else
+            posix_fadvise(members[i].fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        order[i] = i;
+    }
+
+    jlog(JLOG_DEBUG1, "Comparing %zu files of %s in lockstep", count,
+         format(files->size));
+
+    STATS_ADD(comparisons, count);
+    starts[0] = TRUE;
+
+    while (active) {
+        size_t start;
+        size_t end;
+
+        if (handle_interrupt())
+            goto out;
+
+        active = FALSE;
+
+        for (start = 0; start < count; start = end) {
+            size_t lo = start;
+            size_t hi;
+            size_t pos = start;
+
+            for (end = start + 1; end < count && !starts[end]; end++);
+
+            if (end - start < 2)
+                continue;
+
+            /* Read the next block of every member of this class */
+            for (i = start; i < end; i++) {
+                struct member *m = &members[order[i]];
+
+                if (m->fd < 0) {
+                    m->len = -1;
+                } else if ((m->len = pread_full(m->fd, m->buf,
+                                                LOCKSTEP_BLOCK_SIZE,
+                                                off)) < 0) {
+                    jlog(JLOG_SYSERR, "Cannot read %s", m->file->links->path);
+                }
+            }
+
+            /* Split the class by the contents of the block. The members
+             * not yet assigned to a new class are kept in order[lo..hi).
+             */
+            for (hi = end; lo < hi; hi = j) {
+                struct member *rep = &members[order[lo]];
+                size_t first = pos;
+
+                starts[pos] = TRUE;
+                next[pos++] = order[lo];
+
+                for (i = lo + 1, j = lo + 1; i < hi; i++) {
+                    struct member *m = &members[order[i]];
+
+                    if (rep->len >= 0 && m->len == rep->len &&
+                        memcmp(m->buf, rep->buf, m->len) == 0) {
+                        starts[pos] = FALSE;
+                        next[pos++] = order[i];
+                    } else {
+                        order[j++] = order[i];
+                    }
+                }
+                lo++;
+
+                if (pos - first == 1 && rep->fd >= 0) {
+                    close_contents(rep->fd);    /* alone, free it */
+                    rep->fd = -1;
+                } else if (pos - first > 1 && rep->len == LOCKSTEP_BLOCK_SIZE) {
+                    active = TRUE;
+                }
+            }
+
+            memcpy(order + start, next + start, (end - start) * sizeof(*order));
+        }
+
+        off += LOCKSTEP_BLOCK_SIZE;
+    }
+
+    ret = TRUE;
+
+  out:
+    for (i = 0; members != NULL && i < count; i++)
+        if (members[i].fd >= 0)
+            close_contents(members[i].fd);
+    if (ret) {
+        for (i = 0; i < count; i++) {
+            if (starts[i])
+                group++;
+            members[order[i]].file->digests->group = group;
+        }
+    }
+    free(members);
+    free(order);
+    free(next);
+    free(starts);
+    free(bufs);
+    return ret;
+}
+
+/**
+ * file_may_link_to - Check whether a file may replace another one
+ * @a: The first file
+ * @b: The second file
+ * @staged: Whether to compare digests before the contents
+ *
+ * Check whether the two fies are considered equal and can be linked
+ * together. If the two files are identical, the result will be FALSE,
+ * as replacing a link with an identical one is stupid.
+ *
+ * If both files have been classified by bucket_lockstep(), their classes
+ * decide about the contents instead of reading the files again. With -X,
+ * the digests of the extended attributes are compared before the contents
+ * are read, and the attributes themselves only once the contents match.
+ */
+static hl_bool file_may_link_to(struct file *a, struct file *b,
+                                hl_bool staged)
+{
+    return (a->size != 0 &&
+            a->size == b->size &&
+            a->links != NULL && b->links != NULL &&
+            a->dev == b->dev &&
+            a->ino != b->ino &&
+            (!opts.respect_mode || a->mode == b->mode) &&
+            (!opts.respect_owner || a->uid == b->uid) &&
+            (!opts.respect_owner || a->gid == b->gid) &&
+            (!opts.respect_time || a->mtime == b->mtime) &&
+            (!opts.respect_name
+             || strcmp(a->links->path + a->links->basename,
+                       b->links->path + b->links->basename) == 0) &&
+            (!opts.respect_xattrs || file_xattrs_equal(a, b, FALSE)) &&
+            (a->digests->group != 0 && b->digests->group != 0 ?
+             a->digests->group == b->digests->group :
+             (!staged || file_digests_equal(a, b)) &&
+             file_contents_equal(a, b)) &&
+            (!opts.respect_xattrs || file_xattrs_equal(a, b, TRUE)));
+}
+
+/**
+ * file_compare - Compare two files to decide which should be master
+ * @a: The first file
+ * @b: The second file
+ *
+ * Check which of the files should be considered greater and thus serve
+ * as the master when linking (the master is the file that all equal files
+ * will be replaced with).
+ */
+static int file_compare(const struct file *a, const struct file *b)
+{
+    int res = 0;
+    if (a->dev == b->dev && a->ino == b->ino)
+        return 0;
+
+    if (res == 0 && opts.maximise)
+        res = CMP(a->nlink, b->nlink);
+    if (res == 0 && opts.minimise)
+        res = CMP(b->nlink, a->nlink);
+    if (res == 0)
+        res = opts.keep_oldest ? CMP(b->mtime, a->mtime)
+            : CMP(a->mtime, b->mtime);
+    if (res == 0)
+        res = CMP(b->ino, a->ino);
+
+    return res;
+}
+
+/**
+ * struct dir_handle - The directory of the last file replaced by a thread
+ * @fd:    A file descriptor for the directory, or -1
+ * @len:   The length of @path
+ * @alloc: The allocated size of @path
+ * @path:  The path of the directory, including the final slash
+ *
+ * Files of a bucket are often in the same directory, so keeping the last
+ * one open avoids resolving its path again for every link.
+ */
+static THREAD_LOCAL struct dir_handle {
+    int fd;
+    size_t len;
+    size_t alloc;
+    char *path;
+} dir_handle = { -1, 0, 0, NULL };
+
+/**
+ * dir_open - Get a file descriptor for the directory containing a link
+ * @link: The link
+ *
+ * Returns: A file descriptor which must not be closed, or -1 on failure.
+ */
+static int dir_open(const struct link *link)
+{
+    size_t len = link->basename;
+
+    if (len == 0)
+        return AT_FDCWD;
+    if (dir_handle.fd >= 0 && dir_handle.len == len &&
+        memcmp(dir_handle.path, link->path, len) == 0)
+        return dir_handle.fd;
+
+    if (dir_handle.fd >= 0)
+        close(dir_handle.fd);
+    dir_handle.fd = -1;
+
+    if (len + 1 > dir_handle.alloc) {
+        char *path = realloc(dir_handle.path, len + 1);
+
+        if (path == NULL) {
+            jlog(JLOG_SYSFAT, "Cannot allocate memory");
+            exit(1);
+        }
+        dir_handle.path = path;
+        dir_handle.alloc = len + 1;
+    }
+    memcpy(dir_handle.path, link->path, len);
+    dir_handle.path[len] = '\0';
+    dir_handle.len = len;
+
+    COUNT_CALL(CALL_OPEN);
+    dir_handle.fd = open(dir_handle.path, O_RDONLY | O_DIRECTORY);
+    return dir_handle.fd;
+}
+
+/**
+ * dir_release - Close the directory kept open by dir_open()
+ *
+ * Must be called by every thread which linked files before it ends.
+ */
+static void dir_release(void)
+{
+    if (dir_handle.fd >= 0)
+        close(dir_handle.fd);
+    free(dir_handle.path);
+    memset(&dir_handle, 0, sizeof(dir_handle));
+    dir_handle.fd = -1;
+}
+
+/**
+ * file_pin - Open a file to be linked to
+ * @f: The file
+ *
+ * The link is made from the returned file descriptor, so the inode which
+ * is linked is the one checked here, even if its path is replaced later.
+ *
+ * Returns: A file descriptor, or -1 if the file cannot be opened or is
+ * no longer the file that has been compared.
+ */
+static int file_pin(const struct file *f)
+{
+#ifdef O_PATH
+    int fd = open(f->links->path, O_PATH | O_NOFOLLOW);
+#else
+    int fd = open(f->links->path, O_RDONLY | O_NOFOLLOW);
+#endif
+    struct stat st;
+
+    COUNT_CALL(CALL_OPEN);
+
+    if (fd < 0) {
+        jlog(JLOG_SYSERR, "Cannot open %s", f->links->path);
+        return -1;
+    }
+    COUNT_CALL(CALL_STAT);
+    if (fstat(fd, &st) != 0 || !file_unchanged(f, &st)) {
+        jlog(JLOG_ERROR, "%s changed since it was compared, skipping",
+             f->links->path);
+        close(fd);
+        errno = ESTALE;
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * link_pinned - Create a link to a file opened by file_pin()
+ * @fd:    The file descriptor returned by file_pin()
+ * @path:  The path the file was opened from
+ * @dirfd: The directory to create the link in
+ * @name:  The name of the new link in @dirfd
+ *
+ * Linking a file descriptor with AT_EMPTY_PATH needs privileges, so it
+ * falls back to linking the descriptor through /proc, and to linking
+ * @path if /proc is not mounted either.
+ *
+ * Returns: 0 on success, -1 on failure with errno set.
+ */
+static int link_pinned(int fd, const char *path, int dirfd, const char *name)
+{
+    static THREAD_LOCAL int empty_path_denied;  /* found out per thread */
+    char proc[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+
+    COUNT_CALL(CALL_LINK);
+
+#ifdef AT_EMPTY_PATH
+    if (!empty_path_denied) {
+        if (linkat(fd, "", dirfd, name, AT_EMPTY_PATH) == 0)
+            return 0;
+        if (errno != ENOENT && errno != EPERM && errno != EINVAL)
+            return -1;
+        empty_path_denied = 1;
+    }
+#else
+    (void) empty_path_denied;
+#endif
+
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, proc, dirfd, name, AT_SYMLINK_FOLLOW) == 0)
+        return 0;
+    if (errno != ENOENT)
+        return -1;
+
+    return linkat(AT_FDCWD, path, dirfd, name, 0);
+}
+
+/**
+ * enum link_result - The outcome of link_replace()
+ * @LINK_FAILED:  The link could not be replaced, with errno set
+ * @LINK_MADE:    The link was replaced with a link to the master
+ * @LINK_ALREADY: The link already was a link to the master, such as when
+ *                a plan is applied again
+ */
+enum link_result {
+    LINK_FAILED,
+    LINK_MADE,
+    LINK_ALREADY
+};
+
+/**
+ * link_replace - Replace a link of b with a link to a
+ * @a:    The file to link to
+ * @fa:   The file descriptor of @a returned by file_pin()
+ * @b:    The file to replace
+ * @link: The link of @b to replace
+ *
+ * The file is first linked to a temporary name in the directory of @b,
+ * and then renamed to the name of @b, making the replace atomic (@b will
+ * always exist). Both happen relative to the directory, so its path is
+ * only resolved once for all files replaced in it.
+ */
+static enum link_result link_replace(const struct file *a, int fa,
+                                     const struct file *b,
+                                     const struct link *link)
+{
+    static const char suffix[] = ".hardlink-temporary";
+    const char *name = link->path + link->basename;
+    char tmp[NAME_MAX + sizeof(suffix)];
+    struct stat st;
+    int dirfd;
+
+    if ((dirfd = dir_open(link)) == -1) {
+        jlog(JLOG_SYSERR, "Cannot open directory of %s", link->path);
+        return LINK_FAILED;
+    }
+    if ((size_t) snprintf(tmp, sizeof(tmp), "%s%s", name, suffix) >=
+        sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        jlog(JLOG_SYSERR, "Cannot link %s to %s", a->links->path, link->path);
+        return LINK_FAILED;
+    }
+
+    COUNT_CALL(CALL_STAT);
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        memset(&st, 0, sizeof(st));
+    else if (st.st_dev == a->dev && st.st_ino == a->ino) {
+        jlog(JLOG_INFO, "%s is already linked to %s", link->path,
+             a->links->path);
+        return LINK_ALREADY;
+    }
+    if (!file_unchanged(b, &st)) {
+        jlog(JLOG_ERROR, "%s changed since it was compared, skipping",
+             link->path);
+        errno = ESTALE;
+        return LINK_FAILED;
+    }
+
+    if (link_pinned(fa, a->links->path, dirfd, tmp) != 0) {
+        jlog(JLOG_SYSERR, "Cannot link %s to %s%s", a->links->path,
+             link->path, suffix);
+        return LINK_FAILED;
+    }
+    COUNT_CALL(CALL_LINK);
+    if (renameat(dirfd, tmp, dirfd, name) != 0) {
+        int err = errno;
+
+        jlog(JLOG_SYSERR, "Cannot rename %s%s to %s", link->path, suffix,
+             link->path);
+        unlinkat(dirfd, tmp, 0);        /* cleanup failed rename */
+        errno = err;
+        return LINK_FAILED;
+    }
+
+    return LINK_MADE;
+}
+
+/**
+ * PLAN_MAGIC - Identifies a plan file written by --plan-out
+ */
+#define PLAN_MAGIC "HLPLAN01"
+
+/**
+ * struct plan_record - A link to be made, as written by plan_add()
+ * @dev:    The device of both files
+ * @ino:    The inode numbers of the master and of the file to replace
+ * @size:   The size of both files
+ * @mtime:  The modification times of the master and of the file to replace
+ * @blocks: The number of 512-byte blocks of the file to replace
+ * @nlink:  The link count of the file to replace, before this link
+ * @len:    The lengths of the paths of the master and of the file to replace
+ *
+ * The plan file consists of %PLAN_MAGIC followed by these records in
+ * native byte order, each followed by the two paths without terminators.
+ */
+struct plan_record {
+    uint64_t dev;
+    uint64_t ino[2];
+    uint64_t size;
+    int64_t mtime[2][2];
+    uint64_t blocks;
+    uint64_t nlink;
+    uint32_t len[2];
+};
+
+/*
+ * plan
+ *
+ * The plan file given by --plan-out, or %NULL if links are to be made.
+ */
+static struct {
+    const char *path;
+    FILE *out;
+} plan;
+
+/**
+ * plan_open - Create the plan file
+ * @path: The path of the plan file
+ */
+static hl_bool plan_open(const char *path)
+{
+    plan.path = path;
+    if ((plan.out = fopen(path, "wb")) == NULL ||
+        fwrite(PLAN_MAGIC, sizeof(PLAN_MAGIC) - 1, 1, plan.out) != 1) {
+        jlog(JLOG_SYSERR, "Cannot create plan %s", path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * plan_add - Write the link of the first link of b to a to the plan
+ * @a: The file to link to
+ * @b: The file to replace
+ *
+ * May be called from several threads, stdio locks the file for us.
+ */
+static hl_bool plan_add(const struct file *a, const struct file *b)
+{
+    struct plan_record r;
+    hl_bool ok;
+
+    memset(&r, 0, sizeof(r));
+    r.dev = a->dev;
+    r.ino[0] = a->ino;
+    r.ino[1] = b->ino;
+    r.size = a->size;
+    r.mtime[0][0] = a->mtime;
+    r.mtime[0][1] = a->mtime_nsec;
+    r.mtime[1][0] = b->mtime;
+    r.mtime[1][1] = b->mtime_nsec;
+    r.blocks = b->blocks;
+    r.nlink = b->nlink;
+    r.len[0] = strlen(a->links->path);
+    r.len[1] = strlen(b->links->path);
+
+    flockfile(plan.out);
+    ok = fwrite(&r, sizeof(r), 1, plan.out) == 1 &&
+        fwrite(a->links->path, 1, r.len[0], plan.out) == r.len[0] &&
+        fwrite(b->links->path, 1, r.len[1], plan.out) == r.len[1];
+    funlockfile(plan.out);
+
+    if (!ok)
+        jlog(JLOG_SYSERR, "Cannot write plan %s", plan.path);
+    return ok;
+}
+
+/**
+ * plan_close - Finish the plan file
+ */
+static hl_bool plan_close(void)
+{
+    hl_bool ok = fclose(plan.out) == 0;
+
+    if (!ok)
+        jlog(JLOG_SYSERR, "Cannot write plan %s", plan.path);
+    plan.out = NULL;
+    return ok;
+}
+
+/*
+ * CHECKPOINT_MAGIC - Identifies a checkpoint written by --checkpoint
+ * CHECKPOINT_INTERVAL - Minimum seconds between checkpoints while walking
+ */
+#define CHECKPOINT_MAGIC "HLCKPT02"
+#define CHECKPOINT_INTERVAL 60
+
+/**
+ * enum checkpoint_type - Kinds of records in a checkpoint
+ * @CHECKPOINT_OPTIONS:  The options of the run, see checkpoint_options()
+ * @CHECKPOINT_PATH:     A path to walk again, followed by the path
+ * @CHECKPOINT_BUCKET:   The following paths are the files of the next bucket
+ * @CHECKPOINT_FINISHED: The bucket numbered @len is finished
+ */
+enum checkpoint_type {
+    CHECKPOINT_OPTIONS = 'O',
+    CHECKPOINT_PATH = 'P',
+    CHECKPOINT_BUCKET = 'B',
+    CHECKPOINT_FINISHED = 'X'
+};
+
+/**
+ * struct checkpoint_record - A record in a checkpoint
+ * @type: The #enum checkpoint_type
+ * @len:  The length of the path or options following the record, or a
+ *        bucket number
+ */
+struct checkpoint_record {
+    uint32_t type;
+    uint32_t len;
+};
+
+/*
+ * checkpoint
+ *
+ * While walking, the checkpoint holds the paths of the files found so far
+ * and of the directories still to be read, and is replaced every now and
+ * then. Once walking is done, it holds the files of every bucket, and a
+ * record is appended to @out whenever a bucket is finished. Resuming walks
+ * all paths again, except those of finished buckets, see
+ * checkpoint_resume(). Every checkpoint starts with @options, which must
+ * be the same when resuming.
+ */
+static struct {
+    const char *path;
+    FILE *out;
+    double next;
+    uint32_t buckets;
+    char *options;
+} checkpoint;
+
+/*
+ * checkpoint_bucket
+ *
+ * The bucket this thread is comparing while checkpointing, which the links
+ * queued by linker_add() belong to.
+ */
+static THREAD_LOCAL struct bucket *checkpoint_bucket;
+
+/**
+ * checkpoint_finished - Record that a bucket is finished
+ * @bucket: The bucket
+ *
+ * Called once the bucket has been compared and all links queued for it
+ * have been made, see bucket_run(). May be called from several threads,
+ * stdio locks the file for us.
+ */
+static void checkpoint_finished(const struct bucket *bucket)
+{
+    struct checkpoint_record r;
+
+    r.type = CHECKPOINT_FINISHED;
+    r.len = bucket - buckets.items;
+
+    flockfile(checkpoint.out);
+    if (fwrite(&r, sizeof(r), 1, checkpoint.out) != 1 ||
+        fflush(checkpoint.out) != 0)
+        jlog(JLOG_SYSERR, "Cannot write checkpoint %s", checkpoint.path);
+    funlockfile(checkpoint.out);
+}
+
+/**
+ * LINK_BATCH - The number of links queued before they are made
+ */
+#define LINK_BATCH 16384
+
+/**
+ * struct link_op - A link queued by file_link()
+ * @a:    The file to link to
+ * @b:    The file @link belongs to
+ * @link:   The link to replace, already moved to the links of @a
+ * @seq:    The position in the queue, to keep the order within a directory
+ * @bucket: The bucket of @a and @b while checkpointing, or %NULL
+ */
+struct link_op {
+    struct file *a;
+    struct file *b;
+    struct link *link;
+    size_t seq;
+    struct bucket *bucket;
+};
+
+/**
+ * struct link_fixup - A queued link which did not end up where it was queued
+ * @from:   The file the link was moved to by file_link()
+ * @to:     The file the link belongs to now
+ * @link:   The link
+ * @linked: %TRUE if @link was linked to @to, %FALSE if it stayed with @to
+ */
+struct link_fixup {
+    struct file *from;
+    struct file *to;
+    struct link *link;
+    hl_bool linked;
+};
+
+/*
+ * linker
+ *
+ * Links are queued by file_link() while the buckets are compared, and made
+ * in batches of %LINK_BATCH, directory by directory, so that the updates
+ * of each directory are close together. The linker threads make one batch
+ * while the next is queued. Without threads, a full batch is made by the
+ * thread that filled it.
+ *
+ * file_link() moves the links to the master when queueing them, so links
+ * which fail or go to another master are recorded as fixups, protected by
+ * lock_files(), and moved once all queued links are made.
+ */
+static struct {
+    hl_bool active;
+    struct link_op *queue;
+    size_t count;
+    struct link_op *batch;
+    size_t batch_count;
+    size_t seq;
+    struct link_fixup *fixups;
+    size_t fixup_count;
+    size_t fixup_size;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    unsigned int started;
+    hl_bool full;
+    hl_bool sorting;
+    hl_bool sorted;
+    hl_bool finish;
+    size_t next;
+    size_t busy;
+#endif
+} linker;
+
+/**
+ * link_dir_compare - Compare the directories of two links
+ * @a: The first link
+ * @b: The second link
+ */
+static int link_dir_compare(const struct link *a, const struct link *b)
+{
+    int len = a->basename < b->basename ? a->basename : b->basename;
+    int cmp = memcmp(a->path, b->path, len);
+
+    return cmp != 0 ? cmp : a->basename - b->basename;
+}
+
+/**
+ * link_op_compare - Order queued links by directory, then by master
+ * @_a: The first #struct link_op
+ * @_b: The second #struct link_op
+ */
+static int link_op_compare(const void *_a, const void *_b)
+{
+    const struct link_op *a = _a;
+    const struct link_op *b = _b;
+    int cmp = link_dir_compare(a->link, b->link);
+
+    if (cmp != 0)
+        return cmp;
+    if (a->a != b->a)
+        return a->a < b->a ? -1 : 1;
+    return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/**
+ * linker_fixup - Record that a queued link did not go to its master
+ * @from:   The master the link was queued for
+ * @to:     The file the link belongs to now
+ * @link:   The link
+ * @linked: %TRUE if @link was linked to @to, %FALSE if it was not replaced
+ */
+static void linker_fixup(struct file *from, struct file *to,
+                         struct link *link, hl_bool linked)
+{
+    struct link_fixup *fixup;
+
+    lock_files();
+    if (linker.fixup_count == linker.fixup_size) {
+        size_t size = linker.fixup_size ? 2 * linker.fixup_size : 64;
+
+        fixup = realloc(linker.fixups, size * sizeof(*fixup));
+        if (fixup == NULL) {
+            jlog(JLOG_SYSFAT, "Cannot allocate memory");
+            exit(1);
+        }
+        linker.fixups = fixup;
+        linker.fixup_size = size;
+    }
+    fixup = &linker.fixups[linker.fixup_count++];
+    fixup->from = from;
+    fixup->to = to;
+    fixup->link = link;
+    fixup->linked = linked;
+    unlock_files();
+}
+
+/**
+ * linker_fixups_apply - Move the links recorded by linker_fixup()
+ *
+ * Must only be called once all queued links have been made, while no
+ * buckets are being compared.
+ */
+static void linker_fixups_apply(void)
+{
+    size_t i;
+
+    for (i = 0; i < linker.fixup_count; i++) {
+        struct link_fixup *fixup = &linker.fixups[i];
+        struct link **l;
+
+        for (l = &fixup->from->links->next; *l != fixup->link;
+             l = &(*l)->next)
+            assert(*l != NULL);
+        *l = fixup->link->next;
+        fixup->from->nlink--;
+
+        if (fixup->to->links == NULL) {
+            fixup->link->next = NULL;
+            fixup->to->links = fixup->link;
+        } else {
+            fixup->link->next = fixup->to->links->next;
+            fixup->to->links->next = fixup->link;
+        }
+        if (fixup->linked) {
+            fixup->to->nlink++;
+            if (fixup->to->digests->digested &
+                (CACHE_HAVE_EDGES | CACHE_HAVE_FULL | XATTR_DIGESTED))
+                fixup->to->digests->digested |= DIGEST_DIRTY | DIGEST_LINKED;
+        }
+    }
+    linker.fixup_count = 0;
+}
+
+/**
+ * link_ops - Make queued links
+ * @ops:   The links, ordered by link_op_compare()
+ * @count: The number of links
+ *
+ * The master is only pinned once for consecutive links to it. If the
+ * master has too many links already (%EMLINK), the file which could not
+ * be linked to it is kept and pinned instead, and the remaining links to
+ * the master in this directory are made to that file.
+ */
+static void link_ops(const struct link_op *ops, size_t count)
+{
+    const struct file *pinned = NULL;
+    struct file *other = NULL;
+    struct file master;
+    enum link_result result;
+    int fa = -1;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        const struct link_op *op = &ops[i];
+        const struct file *a = other != NULL ? &master : op->a;
+
+        if (op->a != pinned) {
+            if (fa >= 0)
+                close(fa);
+            pinned = op->a;
+            other = NULL;
+            a = op->a;
+            fa = file_pin(a);
+        }
+        if (fa < 0) {
+            STATS_ADD(link_errors, 1);
+            linker_fixup(op->a, op->b, op->link, FALSE);
+            continue;
+        }
+        if (op->b == other) {
+            /* Another link of the new master, which it keeps */
+            linker_fixup(op->a, op->b, op->link, FALSE);
+            continue;
+        }
+
+        jlog(JLOG_INFO, "Linking %s to %s (-%s)", a->links->path,
+             op->link->path, format(a->size));
+
+        result = link_replace(a, fa, op->b, op->link);
+        if (result == LINK_ALREADY) {
+            /* Only the link count of the master is off by one */
+            STATS_ADD(already_linked, 1);
+            linker_fixup(op->a, other != NULL ? other : op->a, op->link,
+                         FALSE);
+            continue;
+        }
+        if (result == LINK_FAILED) {
+            linker_fixup(op->a, op->b, op->link, FALSE);
+            if (errno != EMLINK) {
+                STATS_ADD(link_errors, 1);
+                continue;
+            }
+
+            /* Link the rest to this file, which is unchanged */
+            close(fa);
+            other = op->b;
+            memset(&master, 0, sizeof(master));
+            master.dev = op->b->dev;
+            master.ino = op->b->ino;
+            master.size = op->b->size;
+            master.mtime = op->b->mtime;
+            master.mtime_nsec = op->b->mtime_nsec;
+            master.links = op->link;
+            fa = file_pin(&master);
+            continue;
+        }
+
+        STATS_ADD(linked, 1);
+        if (other != NULL)
+            linker_fixup(op->a, other, op->link, TRUE);
+        if (ATOMIC_DEC(op->b->nlink) == 0)
+            STATS_ADD(saved, (unsigned long long) op->b->blocks * 512);
+    }
+
+    if (fa >= 0)
+        close(fa);
+
+    for (i = 0; i < count; i++)
+        if (ops[i].bucket != NULL && ATOMIC_DEC(ops[i].bucket->unlinked) == 0)
+            checkpoint_finished(ops[i].bucket);
+}
+
+/**
+ * linker_batch - Make the links of the queue in the calling thread
+ */
+static void linker_batch(void)
+{
+    qsort(linker.queue, linker.count, sizeof(*linker.queue), link_op_compare);
+    link_ops(linker.queue, linker.count);
+    linker.count = 0;
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ * linker_take - Take the links of the next directory of the batch
+ * @count: Set to the number of links taken
+ *
+ * Must be called with the lock held.
+ *
+ * Returns: The links, or %NULL if there are none left.
+ */
+static const struct link_op *linker_take(size_t *count)
+{
+    size_t start = linker.next;
+    size_t end = start + 1;
+
+    if (!linker.full || !linker.sorted || start == linker.batch_count)
+        return NULL;
+
+    while (end < linker.batch_count &&
+           link_dir_compare(linker.batch[start].link,
+                            linker.batch[end].link) == 0)
+        end++;
+
+    linker.next = end;
+    *count = end - start;
+    return &linker.batch[start];
+}
+
+/**
+ * linker_thread - Main function of a linker thread
+ * @arg: Unused
+ *
+ * One thread sorts each batch, then all of them take its directories.
+ * The thread finishing the last directory makes room for the next batch.
+ */
+static void *linker_thread(void *arg)
+{
+    const struct link_op *ops;
+    size_t count;
+
+    (void) arg;
+
+    pthread_mutex_lock(&linker.lock);
+    for (;;) {
+        if ((ops = linker_take(&count)) != NULL) {
+            unsigned long long wall = clock_ns(CLOCK_MONOTONIC);
+            unsigned long long cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+            linker.busy++;
+            pthread_mutex_unlock(&linker.lock);
+            link_ops(ops, count);
+            STATS_ADD(wall_ns[PHASE_LINKING], clock_ns(CLOCK_MONOTONIC) - wall);
+            STATS_ADD(cpu_ns[PHASE_LINKING],
+                      clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu);
+            pthread_mutex_lock(&linker.lock);
+
+            if (--linker.busy == 0 && linker.next == linker.batch_count) {
+                linker.full = FALSE;
+                pthread_cond_broadcast(&linker.cond);
+            }
+        } else if (linker.full && !linker.sorting && !linker.sorted) {
+            linker.sorting = TRUE;
+            pthread_mutex_unlock(&linker.lock);
+            qsort(linker.batch, linker.batch_count, sizeof(*linker.batch),
+                  link_op_compare);
+            pthread_mutex_lock(&linker.lock);
+            linker.sorting = FALSE;
+            linker.sorted = TRUE;
+            pthread_cond_broadcast(&linker.cond);
+        } else if (!linker.full && linker.finish) {
+            break;
+        } else {
+            pthread_cond_wait(&linker.cond, &linker.lock);
+        }
+    }
+    pthread_mutex_unlock(&linker.lock);
+
+    dir_release();
+    return NULL;
+}
+
+/**
+ * linker_hand_over - Give the queue to the linker threads as next batch
+ *
+ * Waits until the previous batch is done. Must be called with the lock
+ * held, and only if linker threads are running.
+ */
+static void linker_hand_over(void)
+{
+    struct link_op *batch;
+
+    while (linker.full)
+        pthread_cond_wait(&linker.cond, &linker.lock);
+
+    batch = linker.batch;
+    linker.batch = linker.queue;
+    linker.batch_count = linker.count;
+    linker.queue = batch;
+    linker.count = 0;
+    linker.next = 0;
+    linker.sorted = FALSE;
+    linker.full = linker.batch_count > 0;
+    pthread_cond_broadcast(&linker.cond);
+}
+#endif
+
+/**
+ * linker_start - Queue links from now on, and start the linker threads
+ *
+ * Starts as many linker threads as --jobs gives.
+ */
+static void linker_start(void)
+{
+    linker.queue = malloc(LINK_BATCH * sizeof(*linker.queue));
+    linker.batch = malloc(LINK_BATCH * sizeof(*linker.batch));
+    if (linker.queue == NULL || linker.batch == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    linker.active = TRUE;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&linker.lock, NULL);
+    pthread_cond_init(&linker.cond, NULL);
+
+    if ((linker.threads = calloc(opts.jobs, sizeof(pthread_t))) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    while (linker.started < opts.jobs &&
+           pthread_create(&linker.threads[linker.started], NULL,
+                          linker_thread, NULL) == 0)
+        linker.started++;
+    if (linker.started == 0)
+        jlog(JLOG_SYSERR, "Cannot start linker thread, linking in place");
+#endif
+}
+
+/**
+ * linker_add - Queue a link
+ * @a:    The file to link to
+ * @b:    The file to replace a link of
+ * @link: The link of @b to replace
+ */
+static void linker_add(struct file *a, struct file *b, struct link *link)
+{
+    struct link_op *op;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&linker.lock);
+    if (linker.count == LINK_BATCH && linker.started > 0)
+        linker_hand_over();
+#endif
+    if (linker.count == LINK_BATCH)
+        linker_batch();
+
+    op = &linker.queue[linker.count++];
+    op->a = a;
+    op->b = b;
+    op->link = link;
+    op->seq = linker.seq++;
+    op->bucket = checkpoint_bucket;
+    if (op->bucket != NULL)
+        ATOMIC_ADD(op->bucket->unlinked, 1);
+    STATS_ADD(queued, 1);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&linker.lock);
+#endif
+}
+
+/**
+ * linker_wait - Wait until all queued links have been made
+ */
+static void linker_wait(void)
+{
+    if (!linker.active)
+        return;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&linker.lock);
+    if (linker.started > 0) {
+        linker_hand_over();
+        while (linker.full)
+            pthread_cond_wait(&linker.cond, &linker.lock);
+    }
+    pthread_mutex_unlock(&linker.lock);
+#endif
+
+    if (linker.count > 0) {
+        unsigned long long wall = clock_ns(CLOCK_MONOTONIC);
+        unsigned long long cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+        linker_batch();
+        STATS_ADD(wall_ns[PHASE_LINKING], clock_ns(CLOCK_MONOTONIC) - wall);
+        STATS_ADD(cpu_ns[PHASE_LINKING], clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu);
+        dir_release();
+    }
+
+    linker_fixups_apply();
+}
+
+/**
+ * linker_finish - Make the remaining links and stop the linker threads
+ */
+static void linker_finish(void)
+{
+    if (!linker.active)
+        return;
+
+    linker_wait();
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&linker.lock);
+    linker.finish = TRUE;
+    pthread_cond_broadcast(&linker.cond);
+    pthread_mutex_unlock(&linker.lock);
+
+    while (linker.started > 0)
+        pthread_join(linker.threads[--linker.started], NULL);
+    free(linker.threads);
+    pthread_cond_destroy(&linker.cond);
+    pthread_mutex_destroy(&linker.lock);
+#endif
+
+    free(linker.queue);
+    free(linker.batch);
+    free(linker.fixups);
+    linker.fixups = NULL;
+    linker.fixup_size = 0;
+    linker.active = FALSE;
+}
+
+/*
+ * link_time
+ *
+ * The wall-clock and CPU time this thread spent in file_link(), in
+ * nanoseconds, so that bucket_run() can tell it from the comparisons.
+ */
+static THREAD_LOCAL struct {
+    unsigned long long wall;
+    unsigned long long cpu;
+} link_time;
+
+/**
+ * file_link - Replace b with a link to a
+ * @a: The first file
+ * @b: The second file
+ *
+ * Replace every link of @b with a link to @a, see link_replace(). The
+ * inode of @a is pinned by file_pin() first. With --plan-out, the links
+ * are written to the plan by plan_add() instead. While the linker is
+ * active, the links are queued by linker_add() and made later, so only
+ * the bookkeeping is done here.
+ *
+ * Returns: %FALSE if a link could not be replaced, with errno set.
+ */
+static hl_bool file_link(struct file *a, struct file *b)
+{
+    unsigned long long wall = clock_ns(CLOCK_MONOTONIC);
+    unsigned long long cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    enum link_result result = LINK_MADE;
+    hl_bool ret = TRUE;
+    int fa = -1;
+
+    assert(a->links != NULL);
+    assert(b->links != NULL);
+
+    if (!opts.dry_run && !linker.active && (fa = file_pin(a)) < 0)
+        ret = FALSE;
+
+    while (ret && b->links != NULL) {
+        struct link *new_link = b->links;
+
+        if (linker.active) {
+            linker_add(a, b, new_link);
+        } else {
+            jlog(JLOG_INFO, "%sLinking %s to %s (-%s)",
+                 opts.dry_run ? "[DryRun] " : "", a->links->path,
+                 b->links->path, format(a->size));
+
+            if (plan.out != NULL)
+                result = plan_add(a, b) ? LINK_MADE : LINK_FAILED;
+            else if (!opts.dry_run)
+                result = link_replace(a, fa, b, b->links);
+            if (result == LINK_FAILED) {
+                ret = FALSE;
+                break;
+            }
+
+            /* Update statistics, the linker does it when linking */
+            if (result == LINK_ALREADY) {
+                STATS_ADD(already_linked, 1);
+            } else {
+                STATS_ADD(linked, 1);
+                if (--b->nlink == 0)
+                    STATS_ADD(saved, (unsigned long long) b->blocks * 512);
+            }
+        }
+
+        /* Increase the link count of this file, unless it had the link */
+        if (result != LINK_ALREADY)
+            a->nlink++;
+
+        /* The change time of a changed, so its cached digests need updating */
+        if (!opts.dry_run &&
+            (a->digests->digested & (CACHE_HAVE_EDGES | CACHE_HAVE_FULL |
+                            XATTR_DIGESTED)))
+            a->digests->digested |= DIGEST_DIRTY | DIGEST_LINKED;
+
+        /* Move the link from file b to a */
+        b->links = b->links->next;
+        new_link->next = a->links->next;
+        a->links->next = new_link;
+    }
+
+    if (fa >= 0) {
+        int err = errno;
+
+        close(fa);
+        errno = err;
+    }
+
+    link_time.wall += (wall = clock_ns(CLOCK_MONOTONIC) - wall);
+    link_time.cpu += (cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu);
+    STATS_ADD(wall_ns[PHASE_LINKING], wall);
+    STATS_ADD(cpu_ns[PHASE_LINKING], cpu);
+
+    return ret;
+}
+
+/**
+ * plan_read_link - Read a path from the plan into a new link
+ * @in:  The plan file
+ * @len: The length of the path
+ *
+ * Returns: The link, or %NULL if the plan ended early.
+ */
+static struct link *plan_read_link(FILE *in, uint32_t len)
+{
+    struct link *link = malloc(sizeof(*link) + len + 1);
+    char *slash;
+
+    if (link == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    if (fread(link->path, 1, len, in) != len) {
+        free(link);
+        return NULL;
+    }
+    link->path[len] = '\0';
+    link->next = NULL;
+    slash = strrchr(link->path, '/');
+    link->basename = slash ? slash - link->path + 1 : 0;
+    return link;
+}
+
+/**
+ * plan_file - Fill in a file from a plan record
+ * @f:     The file
+ * @r:     The record
+ * @which: 0 for the master, 1 for the file to replace
+ */
+static void plan_file(struct file *f, const struct plan_record *r, int which)
+{
+    static struct digests none;         /* nothing is read */
+
+    memset(f, 0, sizeof(*f));
+    f->digests = &none;
+    f->dev = r->dev;
+    f->ino = r->ino[which];
+    f->size = r->size;
+    f->mtime = r->mtime[which][0];
+    f->mtime_nsec = r->mtime[which][1];
+    f->blocks = r->blocks;
+    f->nlink = r->nlink;
+}
+
+/**
+ * links_free - Free a list of links allocated by plan_read_link()
+ * @link: The first link
+ */
+static void links_free(struct link *link)
+{
+    while (link != NULL) {
+        struct link *next = link->next;
+
+        free(link);
+        link = next;
+    }
+}
+
+/**
+ * plan_apply - Make the links of a plan written with --plan-out
+ * @path: The path of the plan file
+ *
+ * Consecutive records replacing links of the same inode are linked by one
+ * file_link(), so the master is only pinned once for them. file_pin() and
+ * link_replace() check that both files still have the device, inode, size
+ * and modification time they were compared with, so nothing is read.
+ *
+ * Returns: %FALSE if the plan could not be read or we were interrupted.
+ */
+static hl_bool plan_apply(const char *path)
+{
+    struct plan_record r;
+    struct file a;
+    struct file b;
+    struct link **tail = &b.links;
+    char magic[sizeof(PLAN_MAGIC) - 1];
+    hl_bool damaged = FALSE;
+    hl_bool ret = TRUE;
+    FILE *in;
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+
+    if ((in = fopen(path, "rb")) == NULL) {
+        jlog(JLOG_SYSERR, "Cannot open plan %s", path);
+        return FALSE;
+    }
+    if (fread(magic, sizeof(magic), 1, in) != 1 ||
+        memcmp(magic, PLAN_MAGIC, sizeof(magic)) != 0) {
+        jlog(JLOG_ERROR, "%s is not a plan file", path);
+        fclose(in);
+        return FALSE;
+    }
+
+    for (;;) {
+        size_t n = fread(&r, 1, sizeof(r), in);
+        struct link *master = NULL;
+        struct link *victim = NULL;
+
+        if (n == 0)
+            break;
+        if (handle_interrupt()) {
+            ret = FALSE;
+            break;
+        }
+        if (n != sizeof(r) ||
+            (master = plan_read_link(in, r.len[0])) == NULL ||
+            (victim = plan_read_link(in, r.len[1])) == NULL) {
+            free(master);
+            damaged = TRUE;
+            break;
+        }
+        STATS_ADD(files, 1);
+
+        if (b.links != NULL && (r.dev != b.dev || r.ino[1] != b.ino ||
+                                r.ino[0] != a.ino)) {
+            file_link(&a, &b);
+            links_free(b.links);
+            b.links = NULL;
+        }
+        if (a.links == NULL || r.dev != a.dev || r.ino[0] != a.ino ||
+            strcmp(master->path, a.links->path) != 0) {
+            links_free(a.links);
+            plan_file(&a, &r, 0);
+            a.links = master;
+        } else {
+            free(master);
+        }
+        if (b.links == NULL) {
+            plan_file(&b, &r, 1);
+            tail = &b.links;
+        }
+        *tail = victim;
+        tail = &victim->next;
+    }
+
+    if (ret && ferror(in)) {
+        jlog(JLOG_SYSERR, "Cannot read plan %s", path);
+        ret = FALSE;
+    } else if (damaged) {
+        jlog(JLOG_ERROR, "Plan %s is truncated, ignoring its last link", path);
+    }
+    if (ret && b.links != NULL)
+        file_link(&a, &b);
+
+    links_free(a.links);
+    links_free(b.links);
+    dir_release();
+    fclose(in);
+    return ret;
+}
+
+/**
+ * struct spill_record - A link written to a run by spill_run()
+ * @dev:      The device of the inode
+ * @ino:      The inode number
+ * @size:     The size of the file
+ * @blocks:   The number of 512-byte blocks allocated to the file
+ * @mtime:    The modification time, seconds and nanoseconds
+ * @ctime:    The change time, seconds and nanoseconds
+ * @nlink:    The number of links to the inode
+ * @mode:     The file mode
+ * @uid:      The owner
+ * @gid:      The group
+ * @basename: The offset of the basename in the path
+ * @len:      The length of the path, which follows the record
+ * @pad:      Unused, zero
+ */
+struct spill_record {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t blocks;
+    int64_t mtime[2];
+    int64_t ctime[2];
+    uint64_t nlink;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t basename;
+    uint32_t len;
+    uint32_t pad;
+};
+
+/**
+ * struct spill_key - What runs are sorted by, see spill_compare()
+ * @dev:  The device
+ * @size: The size
+ * @ino:  The inode number
+ * @name: The basename, only compared with --respect-name
+ */
+struct spill_key {
+    uint64_t dev;
+    uint64_t size;
+    uint64_t ino;
+    const char *name;
+};
+
+/*
+ * SPILL_FAN_IN - Maximum number of runs merged at once
+ *
+ * Each run being merged needs an open file, so runs are merged into
+ * longer ones whenever SPILL_FAN_IN of the same level have been written.
+ */
+#define SPILL_FAN_IN 64
+
+/*
+ * spill
+ *
+ * The runs written since the memory given by --max-memory was used up.
+ * Each run is an unlinked temporary file holding the links of some of the
+ * files, sorted by spill_compare(). The level of a run is the number of
+ * merges it went through, levels decrease from the first run to the last.
+ */
+static struct {
+    FILE **runs;
+    unsigned int *levels;
+    size_t count;
+    size_t alloc;
+} spill;
+
+/**
+ * spill_compare - Order the links in runs
+ * @a: The key of the first link
+ * @b: The key of the second link
+ *
+ * Links of files with equal device and size end up next to each other,
+ * and so do the links of an inode, so merged runs can be read bucket by
+ * bucket, see spill_merge().
+ */
+static int spill_compare(const struct spill_key *a, const struct spill_key *b)
+{
+    int diff = CMP(a->dev, b->dev);
+
+    if (diff == 0)
+        diff = CMP(a->size, b->size);
+    if (diff == 0)
+        diff = CMP(a->ino, b->ino);
+    if (diff == 0 && opts.respect_name)
+        diff = strcmp(a->name, b->name);
+
+    return diff;
+}
+
+/**
+ * compare_spill_files - Order files by spill_compare()
+ * @_a: Pointer to a pointer to the first file
+ * @_b: Pointer to a pointer to the second file
+ */
+static int compare_spill_files(const void *_a, const void *_b)
+{
+    const struct file *a = *(const struct file *const *) _a;
+    const struct file *b = *(const struct file *const *) _b;
+    struct spill_key ka = { a->dev, a->size, a->ino,
+                            a->links->path + a->links->basename };
+    struct spill_key kb = { b->dev, b->size, b->ino,
+                            b->links->path + b->links->basename };
+
+    return spill_compare(&ka, &kb);
+}
+
+/**
+ * walk_memory - The memory used by the files found so far
+ */
+static size_t walk_memory(void)
+{
+    return walk_arena.size +
+        (files.mask + 1 + files_by_ino.mask + 1) * sizeof(struct file *);
+}
+
+/**
+ * spill_create - Create a temporary file for a run
+ *
+ * The file is created in $TMPDIR, or /tmp, and unlinked right away.
+ */
+static FILE *spill_create(void)
+{
+    const char *dir = getenv("TMPDIR");
+    size_t len;
+    char *path;
+    FILE *run = NULL;
+    int fd;
+
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+
+    len = strlen(dir) + sizeof("/hardlink-XXXXXX");
+    if ((path = malloc(len)) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    snprintf(path, len, "%s/hardlink-XXXXXX", dir);
+
+    if ((fd = mkstemp(path)) < 0 || unlink(path) != 0 ||
+        (run = fdopen(fd, "w+b")) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot create temporary file in %s", dir);
+        exit(1);
+    }
+
+    free(path);
+    return run;
+}
+
+/**
+ * spill_write - Write a link to a run
+ * @rec:  The record of the link, with @rec->len set
+ * @path: The path of the link
+ * @arg:  The run
+ *
+ * Returns: %TRUE, failing to write is fatal.
+ */
+static hl_bool spill_write(const struct spill_record *rec, const char *path,
+                           void *arg)
+{
+    FILE *run = arg;
+
+    if (fwrite(rec, sizeof(*rec), 1, run) != 1 ||
+        fwrite(path, 1, rec->len, run) != rec->len) {
+        jlog(JLOG_SYSFAT, "Cannot write temporary file");
+        exit(1);
+    }
+    return TRUE;
+}
+
+/**
+ * struct spill_reader - A run being merged
+ * @run:   The run
+ * @rec:   The current record of @run
+ * @path:  The path of the current record
+ * @alloc: The size of @path
+ */
+struct spill_reader {
+    FILE *run;
+    struct spill_record rec;
+    char *path;
+    size_t alloc;
+};
+
+/**
+ * spill_read - Read the next record of a run
+ * @r: The reader
+ *
+ * Returns: %FALSE at the end of the run, failing to read is fatal.
+ */
+static hl_bool spill_read(struct spill_reader *r)
+{
+    if (fread(&r->rec, sizeof(r->rec), 1, r->run) != 1) {
+        if (ferror(r->run)) {
+            jlog(JLOG_SYSFAT, "Cannot read temporary file");
+            exit(1);
+        }
+        return FALSE;
+    }
+
+    if (r->rec.len >= r->alloc) {
+        size_t alloc = r->rec.len + 256;
+        char *path = realloc(r->path, alloc);
+
+        if (path == NULL) {
+            jlog(JLOG_SYSFAT, "Cannot allocate memory");
+            exit(1);
+        }
+        r->path = path;
+        r->alloc = alloc;
+    }
+
+    if (fread(r->path, 1, r->rec.len, r->run) != r->rec.len) {
+        jlog(JLOG_SYSFAT, "Cannot read temporary file");
+        exit(1);
+    }
+    r->path[r->rec.len] = '\0';
+    return TRUE;
+}
+
+/**
+ * spill_reader_compare - Order readers by their current records
+ * @a: The first reader
+ * @b: The second reader
+ */
+static int spill_reader_compare(const struct spill_reader *a,
+                                const struct spill_reader *b)
+{
+    struct spill_key ka = { a->rec.dev, a->rec.size, a->rec.ino,
+                            a->path + a->rec.basename };
+    struct spill_key kb = { b->rec.dev, b->rec.size, b->rec.ino,
+                            b->path + b->rec.basename };
+
+    return spill_compare(&ka, &kb);
+}
+
+/**
+ * spill_sift - Restore the heap order below a reader
+ * @heap:  The readers, a binary heap ordered by spill_reader_compare()
+ * @count: The number of readers in @heap
+ * @i:     The reader which may be out of order
+ */
+static void spill_sift(struct spill_reader *heap, size_t count, size_t i)
+{
+    for (;;) {
+        struct spill_reader tmp;
+        size_t min = i;
+        size_t child;
+
+        for (child = 2 * i + 1; child <= 2 * i + 2 && child < count; child++)
+            if (spill_reader_compare(&heap[child], &heap[min]) < 0)
+                min = child;
+        if (min == i)
+            return;
+
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/**
+ * spill_merge_runs - Merge runs in the order of spill_compare()
+ * @runs:  The runs, which are closed afterwards
+ * @count: The number of runs, at most SPILL_FAN_IN
+ * @emit:  Called for every record in order, returns %FALSE to stop
+ * @arg:   Passed to @emit
+ *
+ * Returns: %FALSE if @emit stopped the merge.
+ */
+static hl_bool spill_merge_runs(FILE **runs, size_t count,
+                                hl_bool (*emit)(const struct spill_record *,
+                                                const char *, void *),
+                                void *arg)
+{
+    struct spill_reader heap[SPILL_FAN_IN];
+    hl_bool going = TRUE;
+    size_t live = 0;
+    size_t i;
+
+    memset(heap, 0, sizeof(heap));
+
+    for (i = 0; i < count; i++) {
+        heap[live].run = runs[i];
+        rewind(runs[i]);
+        if (spill_read(&heap[live]))
+            live++;
+        else
+            fclose(runs[i]);
+    }
+    for (i = live / 2; i-- > 0;)
+        spill_sift(heap, live, i);
+
+    while (live > 0 && going) {
+        going = emit(&heap[0].rec, heap[0].path, arg);
+
+        if (!spill_read(&heap[0])) {
+            struct spill_reader tmp = heap[0];
+
+            fclose(tmp.run);
+            heap[0] = heap[--live];
+            heap[live] = tmp;
+        }
+        spill_sift(heap, live, 0);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (i < live)
+            fclose(heap[i].run);
+        free(heap[i].path);
+    }
+
+    return going;
+}
+
+/**
+ * spill_compact - Merge the last SPILL_FAN_IN runs into a new one
+ *
+ * Returns: The new run, which is not in the list of runs yet.
+ */
+static FILE *spill_compact(void)
+{
+    FILE *run = spill_create();
+
+    spill.count -= SPILL_FAN_IN;
+    spill_merge_runs(spill.runs + spill.count, SPILL_FAN_IN, spill_write, run);
+    if (fflush(run) != 0) {
+        jlog(JLOG_SYSFAT, "Cannot write temporary file");
+        exit(1);
+    }
+    return run;
+}
+
+/**
+ * spill_push - Add a run, merging the last runs if there are too many
+ * @run:   The run, written and flushed
+ * @level: The level of @run, 0 for a run written by spill_run()
+ *
+ * Whenever the last SPILL_FAN_IN runs have the same level, they are merged
+ * into one run of the next level, so every link is written about
+ * log(runs) / log(SPILL_FAN_IN) times.
+ */
+static void spill_push(FILE *run, unsigned int level)
+{
+    for (;;) {
+        if (spill.count == spill.alloc) {
+            size_t alloc = spill.alloc ? 2 * spill.alloc : 2 * SPILL_FAN_IN;
+            FILE **runs = realloc(spill.runs, alloc * sizeof(*runs));
+            unsigned int *levels = realloc(spill.levels,
+                                           alloc * sizeof(*levels));
+
+            if (runs == NULL || levels == NULL) {
+                jlog(JLOG_SYSFAT, "Cannot allocate memory");
+                exit(1);
+            }
+            spill.runs = runs;
+            spill.levels = levels;
+            spill.alloc = alloc;
+        }
+        spill.runs[spill.count] = run;
+        spill.levels[spill.count++] = level;
+
+        if (spill.count < SPILL_FAN_IN ||
+            spill.levels[spill.count - SPILL_FAN_IN] != level)
+            return;
+
+        run = spill_compact();
+        level++;
+    }
+}
+
+/**
+ * spill_run - Write the files found so far to a new run and forget them
+ *
+ * Called by inserter() with the tables locked, once the files take more
+ * than --max-memory.
+ */
+static void spill_run(void)
+{
+    struct file **sorted;
+    struct spill_record rec;
+    size_t count = 0;
+    size_t i;
+    FILE *run;
+
+    if (files_by_ino.count == 0)
+        return;
+
+    if ((sorted = malloc(files_by_ino.count * sizeof(*sorted))) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    for (i = 0; i <= files_by_ino.mask; i++)
+        if (files_by_ino.slots[i] != NULL)
+            sorted[count++] = files_by_ino.slots[i];
+
+    qsort(sorted, count, sizeof(*sorted), compare_spill_files);
+
+    run = spill_create();
+    memset(&rec, 0, sizeof(rec));
+
+    for (i = 0; i < count; i++) {
+        const struct file *f = sorted[i];
+        const struct link *link;
+
+        rec.dev = f->dev;
+        rec.ino = f->ino;
+        rec.size = f->size;
+        rec.blocks = f->blocks;
+        rec.mtime[0] = f->mtime;
+        rec.mtime[1] = f->mtime_nsec;
+        rec.ctime[0] = f->ctime;
+        rec.ctime[1] = f->ctime_nsec;
+        rec.nlink = f->nlink;
+        rec.mode = f->mode;
+        rec.uid = f->uid;
+        rec.gid = f->gid;
+
+        for (link = f->links; link != NULL; link = link->next) {
+            rec.basename = link->basename;
+            rec.len = strlen(link->path);
+            spill_write(&rec, link->path, run);
+        }
+    }
+
+    spill_push(run, 0);
+
+    jlog(JLOG_DEBUG1, "Wrote %zu files to temporary run %zu", count,
+         spill.count);
+
+    /* Start over, the tables grow again as needed */
+    free(sorted);
+    free(files.slots);
+    free(files_by_ino.slots);
+    memset(&files, 0, sizeof(files));
+    memset(&files_by_ino, 0, sizeof(files_by_ino));
+    arena_free(&walk_arena);
+}
+
+#ifdef HAVE_INOTIFY
+/*
+ * WATCH_EVENTS - The events watched for in every directory
+ *
+ * A file is looked at once it has been written and closed, or moved into
+ * a watched directory. New directories are walked once created.
+ */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | \
+                      IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+/*
+ * WATCH_SETTLE - Seconds a new file must be unmodified before linking it
+ *
+ * Files written in several steps would otherwise be linked halfway, and
+ * the next step would then change all files linked to them.
+ */
+#define WATCH_SETTLE 2
+
+/*
+ * watch
+ *
+ * The state of --watch. @dirs maps watch descriptors to the paths of the
+ * directories. While @collect is set, inserter() adds new inodes to
+ * @fresh, so that watch_run() can link them. Protected by lock_files().
+ */
+static struct {
+    int fd;
+    char **dirs;
+    size_t dirs_alloc;
+    hl_bool collect;
+    hl_bool full;
+    struct file **fresh;
+    size_t fresh_count;
+    size_t fresh_alloc;
+} watch = { -1, NULL, 0, FALSE, FALSE, NULL, 0, 0 };
+
+/**
+ * watch_add_dir - Watch a directory for new files
+ * @path: The path of the directory
+ */
+static void watch_add_dir(const char *path)
+{
+    int wd = inotify_add_watch(watch.fd, path, WATCH_EVENTS);
+    char *copy;
+
+    if (wd < 0) {
+        /* Report running out of watches once, not for every directory */
+        if (errno != ENOSPC || !watch.full)
+            jlog(JLOG_SYSERR, "Cannot watch %s", path);
+        watch.full |= errno == ENOSPC;
+        return;
+    }
+    if ((copy = strdup(path)) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+
+    lock_files();
+    if ((size_t) wd >= watch.dirs_alloc) {
+        size_t alloc = 2 * wd + 64;
+        char **dirs = realloc(watch.dirs, alloc * sizeof(*dirs));
+
+        if (dirs == NULL) {
+            jlog(JLOG_SYSFAT, "Cannot allocate memory");
+            exit(1);
+        }
+        memset(dirs + watch.dirs_alloc, 0,
+               (alloc - watch.dirs_alloc) * sizeof(*dirs));
+        watch.dirs = dirs;
+        watch.dirs_alloc = alloc;
+    }
+    /* A directory moved within the tree keeps its watch descriptor */
+    free(watch.dirs[wd]);
+    watch.dirs[wd] = copy;
+    unlock_files();
+}
+
+/**
+ * watch_fresh - Remember a new inode to be linked by watch_run()
+ * @f: The file, just added to the tables by inserter()
+ *
+ * Called with the tables locked.
+ */
+static void watch_fresh(struct file *f)
+{
+    if (watch.fresh_count == watch.fresh_alloc) {
+        size_t alloc = watch.fresh_alloc ? 2 * watch.fresh_alloc : 64;
+        struct file **fresh = realloc(watch.fresh, alloc * sizeof(*fresh));
+
+        if (fresh == NULL) {
+            jlog(JLOG_SYSFAT, "Cannot allocate memory");
+            exit(1);
+        }
+        watch.fresh = fresh;
+        watch.fresh_alloc = alloc;
+    }
+    watch.fresh[watch.fresh_count++] = f;
+}
+#endif
+
+/**
+ * walk_alloc - Allocate zeroed memory for a file or link found
+ * @size: The size to allocate
+ *
+ * From walk_arena, unless watching, where watch_forget() frees the files
+ * which are gone.
+ */
+static void *walk_alloc(size_t size)
+{
+    void *p;
+
+    if (!opts.watch)
+        return arena_alloc(&walk_arena, size);
+    if ((p = calloc(1, size)) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    return p;
+}
+
+/**
+ * inserter - Add a file to the trees
+ * @fpath: The path of the file being visited
+ * @sb:    The stat information of the file
+ * @base:  The offset of the basename in @fpath
+ *
+ * Called by the directory walker for every file found, possibly from several
+ * threads at once. The tables are protected by lock_files().
+ *
+ * Returns: 0 to continue, 1 to stop walking.
+ */
+static int inserter(const char *fpath, const struct stat *sb, int base)
+{
+    struct file key;
+    struct file *fil;
+    struct file **node;
+    struct link *link;
+    size_t pathlen;
+
+    if (handle_interrupt())
+        return 1;
+    if (!S_ISREG(sb->st_mode))
+        return 0;
+    if (path_excluded(fpath))
+        return 0;
+
+    /* First walk of --prescan, only count the size */
+    if (sketch.mask != 0 && !sketch.filter) {
+        if (sb->st_size >= opts.min_size)
+            sketch_add(sb);
+        return 0;
+    }
+
+    STATS_ADD(files, 1);
+
+    if (sb->st_size < opts.min_size) {
+        jlog(JLOG_DEBUG1, "Skipped %s (smaller than configured size)", fpath);
+        return 0;
+    }
+
+    if (sketch.filter && !sketch_collides(sb)) {
+        jlog(JLOG_DEBUG2, "Skipped %s (unique size)", fpath);
+        return 0;
+    }
+
+    jlog(JLOG_DEBUG2, "Visiting %s (file %zu)", fpath, stats.files);
+
+    pathlen = strlen(fpath) + 1;
+
+    memset(&key, 0, sizeof(key));
+    key.dev = sb->st_dev;
+    key.ino = sb->st_ino;
+    key.size = sb->st_size;
+    key.blocks = sb->st_blocks;
+    key.mtime = sb->st_mtim.tv_sec;
+    key.mtime_nsec = sb->st_mtim.tv_nsec;
+    key.ctime = sb->st_ctim.tv_sec;
+    key.ctime_nsec = sb->st_ctim.tv_nsec;
+    key.nlink = sb->st_nlink;
+    key.mode = sb->st_mode;
+    key.uid = sb->st_uid;
+    key.gid = sb->st_gid;
+
+    lock_files();
+
+    link = walk_alloc(sizeof(struct link) + pathlen);
+    link->basename = base;
+    memcpy(link->path, fpath, pathlen);
+    key.links = link;
+
+    node = table_find_ino(&files_by_ino, &key);
+
+    if (*node != NULL) {
+        /* Already known inode, add link to inode information */
+        assert((*node)->dev == sb->st_dev);
+        assert((*node)->ino == sb->st_ino);
+
+        link->next = (*node)->links;
+        (*node)->links = link;
+    } else {
+        fil = walk_alloc(sizeof(*fil));
+        *fil = key;
+        *node = fil;
+        table_added(&files_by_ino, hash_ino);
+
+        /* New inode, insert into by-size table */
+        node = table_find_size(&files, fil);
+
+        /* The list is sorted once it is complete, see collect_bucket() */
+        fil->next = *node;
+        *node = fil;
+        if (fil->next == NULL)
+            table_added(&files, hash_size);
+
+#ifdef HAVE_INOTIFY
+        if (watch.collect)
+            watch_fresh(fil);
+#endif
+    }
+
+    if (opts.max_memory != 0 && walk_memory() > opts.max_memory)
+        spill_run();
+
+    unlock_files();
+
+    return 0;
+}
+
+/**
+ * struct walk_parent - A directory whose subdirectories are waiting
+ * @fd:   A file descriptor for the directory
+ * @refs: The directories waiting, plus one while it is being read
+ *
+ * Subdirectories are opened relative to it, so that their paths are not
+ * resolved again, and a directory renamed or replaced by a symbolic link
+ * in between cannot take the walk elsewhere. @refs is protected by the
+ * lock of the walker.
+ */
+struct walk_parent {
+    int fd;
+    size_t refs;
+};
+
+/**
+ * struct walk_dir - A directory waiting to be read
+ * @next:   The next directory on the stack
+ * @parent: The directory it was found in, or %NULL to open it by @path
+ * @name:   The offset of its name in @path
+ * @path:   The path of the directory
+ */
+struct walk_dir {
+    struct walk_dir *next;
+    struct walk_parent *parent;
+    size_t name;
+#if __STDC_VERSION__ >= 199901L
+    char path[];
+#elif __GNUC__
+    char path[0];
+#else
+    char path[1];
+#endif
+};
+
+/*
+ * walker
+ *
+ * The directories still to be read, shared by all walker threads. A stack
+ * keeps the number of pending directories low. @busy counts the directories
+ * on the stack or being read, @reading only those being read; once @busy
+ * drops to zero, the walk is done. While @pause is set, no directory is
+ * taken from the stack, so that a checkpoint can be written.
+ */
+static struct {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+    struct walk_dir *stack;
+    size_t busy;
+    size_t reading;
+    hl_bool stop;
+    hl_bool pause;
+} walker = {
+#ifdef HAVE_PTHREAD
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+#endif
+    NULL, 0, 0, FALSE, FALSE
+};
+
+/**
+ * checkpoint_options - Describe the options a checkpoint depends on
+ *
+ * The options which decide which files are found and which of them are
+ * linked to which are kept in checkpoint.options. Must be called before
+ * the regular expressions are combined by combine_regex().
+ */
+static void checkpoint_options(void)
+{
+    const struct regex_link *link;
+    struct outbuf out;
+    size_t size = 256;
+
+    for (link = opts.exclude; link != NULL; link = link->next)
+        size += strlen(link->source) + sizeof(" exclude=");
+    for (link = opts.include; link != NULL; link = link->next)
+        size += strlen(link->source) + sizeof(" include=");
+
+    if ((out.buf = malloc(size)) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    out.size = size;
+    out.len = 0;
+
+    outbuf_printf(&out, "mode=%u owner=%u name=%u time=%u xattrs=%u",
+                  opts.respect_mode, opts.respect_owner, opts.respect_name,
+                  opts.respect_time, opts.respect_xattrs);
+    outbuf_printf(&out, " maximize=%u minimize=%u oldest=%u",
+                  opts.maximise, opts.minimise, opts.keep_oldest);
+    outbuf_printf(&out, " min-size=%llu xdev=%u reflink=%u", opts.min_size,
+                  opts.xdev, opts.dedupe);
+    for (link = opts.exclude; link != NULL; link = link->next)
+        outbuf_printf(&out, " exclude=%s", link->source);
+    for (link = opts.include; link != NULL; link = link->next)
+        outbuf_printf(&out, " include=%s", link->source);
+
+    checkpoint.options = out.buf;
+}
+
+/**
+ * checkpoint_due - Whether the next checkpoint of the walk is due
+ */
+static hl_bool checkpoint_due(void)
+{
+    return checkpoint.path != NULL && gettime() >= checkpoint.next;
+}
+
+/**
+ * checkpoint_text - Write a record followed by a string to a checkpoint
+ * @out:  The checkpoint
+ * @type: The #enum checkpoint_type
+ * @text: The string
+ */
+static hl_bool checkpoint_text(FILE *out, enum checkpoint_type type,
+                               const char *text)
+{
+    struct checkpoint_record r;
+
+    r.type = type;
+    r.len = strlen(text);
+    return fwrite(&r, sizeof(r), 1, out) == 1 &&
+        fwrite(text, 1, r.len, out) == r.len;
+}
+
+/**
+ * checkpoint_path - Write a path to a checkpoint
+ * @out:  The checkpoint
+ * @path: The path
+ */
+static hl_bool checkpoint_path(FILE *out, const char *path)
+{
+    return checkpoint_text(out, CHECKPOINT_PATH, path);
+}
+
+/**
+ * checkpoint_create - Start writing a new checkpoint
+ *
+ * The checkpoint is written next to the old one, which is only replaced
+ * by checkpoint_commit(), so there always is a complete one.
+ *
+ * Returns: The new checkpoint, or %NULL on failure.
+ */
+static FILE *checkpoint_create(void)
+{
+    size_t len = strlen(checkpoint.path) + sizeof(".new");
+    char *tmp = malloc(len);
+    FILE *out;
+
+    if (tmp == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    snprintf(tmp, len, "%s.new", checkpoint.path);
+
+    if ((out = fopen(tmp, "wb")) == NULL ||
+        fwrite(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC) - 1, 1, out) != 1 ||
+        !checkpoint_text(out, CHECKPOINT_OPTIONS, checkpoint.options)) {
+        jlog(JLOG_SYSERR, "Cannot write checkpoint %s", tmp);
+        if (out != NULL)
+            fclose(out);
+        out = NULL;
+    }
+
+    free(tmp);
+    return out;
+}
+
+/**
+ * checkpoint_commit - Replace the old checkpoint with a new one
+ * @out:  The new checkpoint, from checkpoint_create()
+ * @ok:   Whether everything was written
+ * @keep: Keep @out open for appending, instead of closing it
+ */
+static hl_bool checkpoint_commit(FILE *out, hl_bool ok, hl_bool keep)
+{
+    size_t len = strlen(checkpoint.path) + sizeof(".new");
+    char *tmp = malloc(len);
+
+    if (tmp == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    snprintf(tmp, len, "%s.new", checkpoint.path);
+
+    /* Synced before renaming, so that a crash leaves one or the other */
+    ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0 &&
+        rename(tmp, checkpoint.path) == 0;
+    if (!ok) {
+        jlog(JLOG_SYSERR, "Cannot write checkpoint %s", tmp);
+        unlink(tmp);
+    }
+    if (!keep || !ok)
+        fclose(out);
+
+    free(tmp);
+    return ok;
+}
+
+/**
+ * checkpoint_walk - Write a checkpoint of the walk
+ *
+ * Called with the walk paused, see walk_pop(), or stopped. The time until
+ * the next checkpoint grows with the time this one took, so that writing
+ * checkpoints never takes more than a tenth of the walk.
+ */
+static void checkpoint_walk(void)
+{
+    double start = gettime();
+    const struct walk_dir *d;
+    FILE *out;
+    hl_bool ok = TRUE;
+    size_t i;
+
+    if ((out = checkpoint_create()) == NULL) {
+        checkpoint.next = start + CHECKPOINT_INTERVAL;
+        return;
+    }
+
+    for (i = 0; ok && files_by_ino.slots != NULL && i <= files_by_ino.mask; i++) {
+        const struct link *link;
+
+        if (files_by_ino.slots[i] == NULL)
+            continue;
+        for (link = files_by_ino.slots[i]->links; ok && link != NULL;
+             link = link->next)
+            ok = checkpoint_path(out, link->path);
+    }
+    for (d = walker.stack; ok && d != NULL; d = d->next)
+        ok = checkpoint_path(out, d->path);
+
+    if (checkpoint_commit(out, ok, FALSE))
+        jlog(JLOG_DEBUG1, "Wrote checkpoint %s", checkpoint.path);
+
+    checkpoint.next = gettime();
+    checkpoint.next += 10 * (checkpoint.next - start) > CHECKPOINT_INTERVAL ?
+        10 * (checkpoint.next - start) : CHECKPOINT_INTERVAL;
+}
+
+/**
+ * checkpoint_buckets - Write a checkpoint of the buckets
+ *
+ * The checkpoint is kept open, so that checkpoint_finished() can append to
+ * it. Failing to write it only stops checkpointing.
+ */
+static void checkpoint_buckets(void)
+{
+    FILE *out = checkpoint_create();
+    hl_bool ok = out != NULL;
+    size_t i;
+
+    for (i = 0; ok && i < buckets.count; i++) {
+        struct checkpoint_record r = { CHECKPOINT_BUCKET, 0 };
+        size_t j;
+
+        ok = fwrite(&r, sizeof(r), 1, out) == 1;
+        for (j = 0; ok && j < buckets.items[i].count; j++) {
+            const struct link *link;
+
+            for (link = buckets.items[i].files[j].links; ok && link != NULL;
+                 link = link->next)
+                ok = checkpoint_path(out, link->path);
+        }
+    }
+
+    if (out != NULL && checkpoint_commit(out, ok, TRUE))
+        checkpoint.out = out;
+    else
+        checkpoint.path = NULL;
+}
+
+/**
+ * checkpoint_close - Finish checkpointing
+ * @done: Whether the run is complete, the checkpoint is removed then
+ */
+static void checkpoint_close(hl_bool done)
+{
+    if (checkpoint.out != NULL && fclose(checkpoint.out) != 0)
+        jlog(JLOG_SYSERR, "Cannot write checkpoint %s", checkpoint.path);
+    checkpoint.out = NULL;
+
+    if (done && checkpoint.path != NULL && unlink(checkpoint.path) != 0)
+        jlog(JLOG_SYSERR, "Cannot remove checkpoint %s", checkpoint.path);
+}
+
+/**
+ * walk_parent_put - Drop a reference to a parent directory
+ * @parent: The parent directory, or %NULL
+ *
+ * Must be called with the lock of the walker held.
+ */
+static void walk_parent_put(struct walk_parent *parent)
+{
+    if (parent != NULL && --parent->refs == 0) {
+        close(parent->fd);
+        free(parent);
+    }
+}
+
+/**
+ * walk_parent_get - Get the parent handle of a directory being read
+ * @parent: The handle, created on first use
+ * @fd:     The directory
+ *
+ * The handle holds a duplicate of @fd, which is closed once the directory
+ * has been read and all its subdirectories have been opened. If it cannot
+ * be created, such as when running out of file descriptors, %NULL is
+ * returned and the subdirectories are opened by their paths.
+ *
+ * Returns: The handle, or %NULL.
+ */
+static struct walk_parent *walk_parent_get(struct walk_parent **parent,
+                                           int fd)
+{
+    int dup_fd;
+
+    if (*parent != NULL)
+        return *parent;
+    if ((*parent = malloc(sizeof(**parent))) == NULL)
+        return NULL;
+    if ((dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        free(*parent);
+        return *parent = NULL;
+    }
+    (*parent)->fd = dup_fd;
+    (*parent)->refs = 1;        /* held until the directory is read */
+    return *parent;
+}
+
+/**
+ * walk_push - Queue a directory for reading
+ * @parent: The handle of @dir from walk_parent_get(), or %NULL
+ * @dir:    The path of the parent directory, or %NULL
+ * @name:   The name of the directory within @dir
+ */
+static int walk_push(struct walk_parent *parent, const char *dir,
+                     const char *name)
+{
+    size_t dirlen = dir ? strlen(dir) : 0;
+    size_t namelen = strlen(name);
+    struct walk_dir *d = malloc(sizeof(*d) + dirlen + namelen + 2);
+
+    if (d == NULL)
+        return jlog(JLOG_SYSFAT, "Cannot continue"), 1;
+
+    if (dirlen > 0)
+        memcpy(d->path, dir, dirlen);
+    if (dirlen > 0 && dir[dirlen - 1] != '/')
+        d->path[dirlen++] = '/';
+    memcpy(d->path + dirlen, name, namelen + 1);
+    d->parent = parent;
+    d->name = dirlen;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&walker.lock);
+#endif
+    if (parent != NULL)
+        parent->refs++;
+    d->next = walker.stack;
+    walker.stack = d;
+    walker.busy++;
+#ifdef HAVE_PTHREAD
+    pthread_cond_signal(&walker.cond);
+    pthread_mutex_unlock(&walker.lock);
+#endif
+    return 0;
+}
+
+/**
+ * walk_pop - Take a directory to read
+ *
+ * Waits until a directory is available or the walk is done.
+ *
+ * Returns: The directory, or %NULL if the walk is done or stopped.
+ */
+static struct walk_dir *walk_pop(void)
+{
+    struct walk_dir *d = NULL;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&walker.lock);
+#endif
+    for (;;) {
+        /* The first thread to notice pauses, the last one to pause writes */
+        if (!walker.stop && !walker.pause && checkpoint_due())
+            walker.pause = TRUE;
+        if (walker.pause && walker.reading == 0) {
+            checkpoint_walk();
+            walker.pause = FALSE;
+#ifdef HAVE_PTHREAD
+            pthread_cond_broadcast(&walker.cond);
+#endif
+        }
+        if (!walker.pause &&
+            (walker.stack != NULL || walker.busy == 0 || walker.stop))
+            break;
+#ifdef HAVE_PTHREAD
+        pthread_cond_wait(&walker.cond, &walker.lock);
+#endif
+    }
+    if (!walker.stop && (d = walker.stack) != NULL) {
+        walker.stack = d->next;
+        walker.reading++;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&walker.lock);
+#endif
+    return d;
+}
+
+/**
+ * walk_done - Finish reading a directory
+ * @d:    The directory returned by walk_pop()
+ * @stop: Whether to stop the walk
+ */
+static void walk_done(struct walk_dir *d, hl_bool stop)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&walker.lock);
+#endif
+    walk_parent_put(d->parent);
+    free(d);
+    walker.busy--;
+    walker.reading--;
+    if (stop)
+        walker.stop = TRUE;
+#ifdef HAVE_PTHREAD
+    if (walker.busy == 0 || walker.stop || walker.pause)
+        pthread_cond_broadcast(&walker.cond);
+    pthread_mutex_unlock(&walker.lock);
+#endif
+}
+
+#ifdef HAVE_STATX
+/*
+ * STATX_WALK - The fields of a file used after walking
+ *
+ * Leaving out the access and birth times spares file systems which have
+ * to fetch them separately, such as network file systems.
+ */
+#define STATX_WALK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | \
+                    STATX_GID | STATX_INO | STATX_SIZE | STATX_BLOCKS | \
+                    STATX_MTIME | STATX_CTIME)
+#endif
+
+/**
+ * walk_stat - Get the status of a directory entry
+ * @dirfd: The directory
+ * @name:  The name of the entry
+ * @st:    Set to the status, only the fields in STATX_WALK are valid
+ *
+ * Uses statx() asking for STATX_WALK where available, and fstatat()
+ * otherwise, or if the file system did not return all of STATX_WALK.
+ * Symbolic links are not followed.
+ *
+ * Returns: 0 on success, -1 with errno set on failure.
+ */
+static int walk_stat(int dirfd, const char *name, struct stat *st)
+{
+#ifdef HAVE_STATX
+    static hl_bool no_statx;
+    struct statx stx;
+
+    COUNT_CALL(CALL_STAT);
+    if (!no_statx) {
+        if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                  STATX_WALK, &stx) != 0) {
+            if (errno != ENOSYS)
+                return -1;
+            no_statx = TRUE;    /* older kernel, racing threads are fine */
+        } else if ((stx.stx_mask & STATX_WALK) == STATX_WALK) {
+            memset(st, 0, sizeof(*st));
+            st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            st->st_ino = stx.stx_ino;
+            st->st_mode = stx.stx_mode;
+            st->st_nlink = stx.stx_nlink;
+            st->st_uid = stx.stx_uid;
+            st->st_gid = stx.stx_gid;
+            st->st_size = stx.stx_size;
+            st->st_blocks = stx.stx_blocks;
+            st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+            st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+            st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+            st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+            return 0;
+        }
+        COUNT_CALL(CALL_STAT);  /* for fstatat() below */
+    }
+#else
+    COUNT_CALL(CALL_STAT);
+#endif
+    return fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+/**
+ * struct walk_entry - A directory entry to be stat()ed
+ * @ino:  The inode number from the directory
+ * @name: The offset of the name in the names of the directory
+ */
+struct walk_entry {
+    ino_t ino;
+    size_t name;
+};
+
+/**
+ * compare_walk_entries - Order directory entries by inode number
+ * @_a: The first #struct walk_entry
+ * @_b: The second #struct walk_entry
+ */
+static int compare_walk_entries(const void *_a, const void *_b)
+{
+    const struct walk_entry *a = _a;
+    const struct walk_entry *b = _b;
+
+    return CMP(a->ino, b->ino);
+}
+
+/**
+ * walk_file - Add a file queued instead of a directory
+ * @path: The path of the file
+ *
+ * Returns: 0 to continue, 1 to stop walking.
+ */
+static int walk_file(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    struct stat st;
+
+    COUNT_CALL(CALL_STAT);
+    if (lstat(path, &st) != 0) {
+        jlog(JLOG_SYSERR, "Cannot process %s", path);
+        return 0;
+    }
+    if (inserter(path, &st, base ? base - path + 1 : 0) == 0)
+        return 0;
+
+    /* Stopped before adding it, keep it for the checkpoint */
+    if (checkpoint.path != NULL)
+        walk_push(NULL, NULL, path);
+    return 1;
+}
+
+/**
+ * walk_read_dir - Read a directory
+ * @d: The directory
+ *
+ * The type of an entry is taken from the directory where the file system
+ * provides it, so subdirectories are queued and symbolic links, devices
+ * and the like are skipped without looking at their inodes. The remaining
+ * entries are stat()ed in the order of their inode numbers, which is
+ * about the order of the inodes on disk on most file systems, and passed
+ * to inserter(). Symbolic links are not followed. The directory is opened
+ * relative to its parent where possible, see struct walk_parent.
+ * Subdirectories whose files would all be excluded are not queued, see
+ * dir_excluded(). With
+ * --xdev, subdirectories are stat()ed too, and entries on another device
+ * than the directory are skipped.
+ *
+ * Returns: 0 to continue, 1 to stop walking.
+ */
+static int walk_read_dir(struct walk_dir *d)
+{
+    size_t dirlen = strlen(d->path);
+    size_t alloc = dirlen + 256;
+    char *path = malloc(alloc);
+    struct walk_entry *entries = NULL;
+    size_t count = 0;
+    size_t entries_alloc = 0;
+    char *names = NULL;
+    size_t names_len = 0;
+    size_t names_alloc = 0;
+    struct walk_parent *self = NULL;
+    struct dirent *ent;
+    DIR *dir = NULL;
+    dev_t dev = 0;
+    size_t i;
+    int fd;
+    int ret = 0;
+
+    if (path == NULL)
+        return jlog(JLOG_SYSFAT, "Cannot continue"), 1;
+
+    memcpy(path, d->path, dirlen);
+    if (dirlen > 0 && path[dirlen - 1] != '/')
+        path[dirlen++] = '/';
+
+    COUNT_CALL(CALL_OPEN);
+    if (d->parent != NULL)
+        fd = openat(d->parent->fd, d->path + d->name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    else
+        fd = open(d->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0 && (errno == ENOTDIR || errno == ELOOP)) {
+        /* A file queued by checkpoint_resume() */
+        free(path);
+        return walk_file(d->path);
+    }
+    if (fd < 0 || (dir = fdopendir(fd)) == NULL) {
+        jlog(JLOG_SYSERR, "Cannot read %s", d->path);
+        if (fd >= 0)
+            close(fd);
+        free(path);
+        return 0;
+    }
+
+    /* With --xdev, mount points are told apart by their device */
+    if (opts.xdev) {
+        struct stat st;
+
+        COUNT_CALL(CALL_STAT);
+        if (fstat(fd, &st) != 0) {
+            jlog(JLOG_SYSERR, "Cannot read %s", d->path);
+            closedir(dir);
+            free(path);
+            return 0;
+        }
+        dev = st.st_dev;
+    }
+
+#ifdef HAVE_INOTIFY
+    /* Watch before reading, so no file created meanwhile is missed */
+    if (watch.fd >= 0)
+        watch_add_dir(d->path);
+#endif
+
+    while (ret == 0 && (errno = 0, ent = readdir(dir)) != NULL) {
+        size_t namelen = strlen(ent->d_name);
+
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (ent->d_type == DT_DIR && !opts.xdev) {
+            if (!dir_excluded(d->path, ent->d_name))
+                ret = walk_push(walk_parent_get(&self, fd), d->path,
+                                ent->d_name);
+            continue;
+        }
+        if (ent->d_type != DT_REG && ent->d_type != DT_UNKNOWN &&
+            ent->d_type != DT_DIR)
+            continue;
+#endif
+
+        if (count == entries_alloc) {
+            size_t n = entries_alloc ? 2 * entries_alloc : 64;
+            struct walk_entry *tmp = realloc(entries, n * sizeof(*tmp));
+
+            if (tmp == NULL) {
+                ret = (jlog(JLOG_SYSFAT, "Cannot continue"), 1);
+                break;
+            }
+            entries = tmp;
+            entries_alloc = n;
+        }
+        if (names_len + namelen + 1 > names_alloc) {
+            size_t n = 2 * names_alloc + namelen + 1024;
+            char *tmp = realloc(names, n);
+
+            if (tmp == NULL) {
+                ret = (jlog(JLOG_SYSFAT, "Cannot continue"), 1);
+                break;
+            }
+            names = tmp;
+            names_alloc = n;
+        }
+
+        entries[count].ino = ent->d_ino;
+        entries[count++].name = names_len;
+        memcpy(names + names_len, ent->d_name, namelen + 1);
+        names_len += namelen + 1;
+    }
+
+    if (ret == 0 && errno != 0)
+        jlog(JLOG_SYSERR, "Cannot read %s", d->path);
+
+    if (entries != NULL)
+        qsort(entries, count, sizeof(*entries), compare_walk_entries);
+
+    for (i = 0; ret == 0 && i < count; i++) {
+        const char *name = names + entries[i].name;
+        size_t namelen = strlen(name);
+        struct stat st;
+
+        if (dirlen + namelen + 1 > alloc) {
+            char *new_path = realloc(path, (alloc = dirlen + namelen + 256));
+
+            if (new_path == NULL) {
+                ret = (jlog(JLOG_SYSFAT, "Cannot continue"), 1);
+                break;
+            }
+            path = new_path;
+        }
+        memcpy(path + dirlen, name, namelen + 1);
+
+        if (walk_stat(fd, name, &st) != 0)
+            jlog(JLOG_SYSERR, "Cannot read %s", path);
+        else if (opts.xdev && st.st_dev != dev)
+            jlog(JLOG_DEBUG1, "Skipped %s (on another file system)", path);
+        else if (S_ISDIR(st.st_mode))
+            ret = dir_excluded(d->path, name) ? 0 :
+                walk_push(walk_parent_get(&self, fd), d->path, name);
+        else
+            ret = inserter(path, &st, dirlen);
+        if (ret != 0)
+            break;
+    }
+
+    /* Queue the rest for the checkpoint, inserter() stopped at entry i */
+    for (; ret != 0 && checkpoint.path != NULL && i < count; i++)
+        if (walk_push(NULL, d->path, names + entries[i].name) != 0)
+            break;
+
+    if (self != NULL) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&walker.lock);
+#endif
+        walk_parent_put(self);
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&walker.lock);
+#endif
+    }
+    closedir(dir);
+    free(entries);
+    free(names);
+    free(path);
+    return ret;
+}
+
+/**
+ * walk_thread - Read directories until the walk is done
+ * @arg: Unused
+ */
+static void *walk_thread(void *arg)
+{
+    struct walk_dir *d;
+
+    (void) arg;
+
+    while ((d = walk_pop()) != NULL)
+        walk_done(d, walk_read_dir(d) != 0);
+
+    return NULL;
+}
+
+/**
+ * checkpoint_resume - Queue the paths of a checkpoint to be walked again
+ * @path: The checkpoint
+ *
+ * All paths except those of finished buckets are queued. They are stat()ed
+ * again by the walk, so files changed, removed or linked since are found
+ * as they are now. The options recorded by checkpoint_options() must
+ * match the ones given now.
+ *
+ * Returns: %FALSE if the checkpoint cannot be read or was written with
+ * other options.
+ */
+static hl_bool checkpoint_resume(const char *path)
+{
+    char magic[sizeof(CHECKPOINT_MAGIC) - 1];
+    struct checkpoint_record r;
+    char **paths = NULL;
+    uint32_t *owner = NULL;
+    unsigned char *finished = NULL;
+    size_t count = 0;
+    size_t alloc = 0;
+    uint32_t bucket = UINT32_MAX;
+    uint32_t buckets_seen = 0;
+    char *options;
+    hl_bool ok = TRUE;
+    size_t i;
+    FILE *in;
+
+    if ((in = fopen(path, "rb")) == NULL ||
+        fread(magic, sizeof(magic), 1, in) != 1 ||
+        memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 ||
+        fread(&r, sizeof(r), 1, in) != 1 || r.type != CHECKPOINT_OPTIONS) {
+        jlog(JLOG_SYSERR, "Cannot read checkpoint %s", path);
+        if (in != NULL)
+            fclose(in);
+        return FALSE;
+    }
+    if ((options = malloc(r.len + 1)) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    if (fread(options, 1, r.len, in) != r.len) {
+        jlog(JLOG_SYSERR, "Cannot read checkpoint %s", path);
+        free(options);
+        fclose(in);
+        return FALSE;
+    }
+    options[r.len] = '\0';
+    if (strcmp(options, checkpoint.options) != 0) {
+        jlog(JLOG_ERROR, "Checkpoint %s was written with other options, "
+             "give the same options again to resume it", path);
+        jlog(JLOG_ERROR, "Options of the checkpoint: %s", options);
+        jlog(JLOG_ERROR, "Options given now:         %s", checkpoint.options);
+        free(options);
+        fclose(in);
+        return FALSE;
+    }
+    free(options);
+
+    while (fread(&r, sizeof(r), 1, in) == 1) {
+        if (r.type == CHECKPOINT_BUCKET) {
+            bucket = buckets_seen++;
+        } else if (r.type == CHECKPOINT_FINISHED) {
+            if (r.len >= buckets_seen)
+                break;
+            if (finished == NULL &&
+                (finished = calloc(buckets_seen, 1)) == NULL) {
+                jlog(JLOG_SYSFAT, "Cannot allocate memory");
+                exit(1);
+            }
+            finished[r.len] = 1;
+        } else if (r.type == CHECKPOINT_PATH) {
+            if (count == alloc) {
+                alloc = alloc ? 2 * alloc : 1024;
+                paths = realloc(paths, alloc * sizeof(*paths));
+                owner = realloc(owner, alloc * sizeof(*owner));
+                if (paths == NULL || owner == NULL) {
+                    jlog(JLOG_SYSFAT, "Cannot allocate memory");
+                    exit(1);
+                }
+            }
+            if ((paths[count] = malloc(r.len + 1)) == NULL) {
+                jlog(JLOG_SYSFAT, "Cannot allocate memory");
+                exit(1);
+            }
+            if (fread(paths[count], 1, r.len, in) != r.len) {
+                free(paths[count]);
+                break;
+            }
+            paths[count][r.len] = '\0';
+            owner[count++] = bucket;
+        } else {
+            ok = FALSE;
+            break;
+        }
+    }
+
+    /* Records are appended while linking, so the last may be cut off */
+    if (!feof(in) || !ok)
+        jlog(JLOG_ERROR, "Checkpoint %s is damaged, resuming with %zu paths",
+             path, count);
+    fclose(in);
+
+    for (i = 0; i < count; i++) {
+        if (owner[i] == UINT32_MAX || finished == NULL || !finished[owner[i]])
+            if (walk_push(NULL, NULL, paths[i]) != 0)
+                exit(1);
+        free(paths[i]);
+    }
+
+    for (i = 0, bucket = 0; finished != NULL && i < buckets_seen; i++)
+        bucket += finished[i];
+    jlog(JLOG_INFO, "Resuming from %s, %u of %u buckets finished", path,
+         bucket, buckets_seen);
+
+    free(paths);
+    free(owner);
+    free(finished);
+    return TRUE;
+}
+
+/**
+ * walk_run - Read the queued directories until the walk is done
+ *
+ * If the walk is stopped, the directories left over stay queued for the
+ * checkpoint with --checkpoint, and are discarded otherwise.
+ *
+ * Returns: 0 on success, 1 if the walk was stopped.
+ */
+static int walk_run(void)
+{
+#ifdef HAVE_PTHREAD
+    if (opts.jobs > 1) {
+        pthread_t *threads = calloc(opts.jobs - 1, sizeof(*threads));
+        unsigned int started = 0;
+        unsigned int i;
+
+        for (i = 0; threads != NULL && i < opts.jobs - 1; i++) {
+            if (pthread_create(&threads[i], NULL, walk_thread, NULL) != 0) {
+                jlog(JLOG_SYSERR, "Cannot start thread");
+                break;
+            }
+            started++;
+        }
+        walk_thread(NULL);
+        for (i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+    } else
+#endif
+        walk_thread(NULL);
+
+    /* Discard what is left over if we stopped early */
+    while (checkpoint.path == NULL && walker.stack != NULL) {
+        struct walk_dir *d = walker.stack;
+
+        walker.stack = d->next;
+        walk_parent_put(d->parent);
+        free(d);
+        walker.busy--;
+    }
+
+    if (walker.stop) {
+        walker.stop = FALSE;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * walk - Find all files below the given path
+ * @root: A file or directory
+ *
+ * The directories are read by opts.jobs threads sharing one stack of
+ * pending directories, so that several directories are read and many
+ * entries are stat()ed at once.
+ *
+ * Returns: 0 on success, 1 if the walk was stopped.
+ */
+static int walk(const char *root)
+{
+    struct stat st;
+
+    if (lstat(root, &st) != 0) {
+        jlog(JLOG_SYSERR, "Cannot process %s", root);
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode))
+        return walk_file(root);
+    if (dir_excluded(NULL, root))
+        return 0;
+
+    if (walk_push(NULL, NULL, root) != 0)
+        return 1;
+
+    return walk_run();
+}
+
+/**
+ * walk_release - Free everything only needed while walking
+ *
+ * Must be called after the buckets have been collected by collect_buckets().
+ */
+static void walk_release(void)
+{
+    free(files.slots);
+    free(files_by_ino.slots);
+    memset(&files, 0, sizeof(files));
+    memset(&files_by_ino, 0, sizeof(files_by_ino));
+    arena_free(&walk_arena);
+    sketch_free();
+}
+
+#ifdef HAVE_FIDEDUPERANGE
+/*
+ * DEDUPE_MAX_DESTS - Maximum number of destinations per FIDEDUPERANGE call
+ * DEDUPE_CHUNK_SIZE - Maximum number of bytes per FIDEDUPERANGE call
+ *
+ * The kernel rejects requests larger than a page, and file systems may
+ * dedupe less than requested in one call, btrfs at most 16 MiB.
+ */
+#define DEDUPE_MAX_DESTS 64
+#define DEDUPE_CHUNK_SIZE (16 * 1024 * 1024)
+
+/*
+ * dedupe_unsupported
+ *
+ * The devices whose file systems cannot share extents, so that their files
+ * are not opened again for every bucket. Shared by the linker threads.
+ */
+static struct {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+    dev_t devs[64];
+    size_t count;
+} dedupe_unsupported = {
+#ifdef HAVE_PTHREAD
+    PTHREAD_MUTEX_INITIALIZER,
+#endif
+    {0}, 0
+};
+
+/**
+ * dedupe_supported - Check whether extents may be shared on a device
+ * @dev:  The device
+ * @path: A file on it, to be named in the warning if @mark is set
+ * @mark: Record that the device does not support it
+ *
+ * Warns once per device when it is recorded.
+ *
+ * Returns: %FALSE if the device is known not to support sharing extents.
+ */
+static hl_bool dedupe_supported(dev_t dev, const char *path, hl_bool mark)
+{
+    hl_bool supported = TRUE;
+    size_t i;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&dedupe_unsupported.lock);
+#endif
+    for (i = 0; supported && i < dedupe_unsupported.count; i++)
+        supported = dedupe_unsupported.devs[i] != dev;
+
+    if (supported && mark) {
+        jlog(JLOG_ERROR, "Cannot share extents on the file system of %s, "
+             "skipping its files", path);
+        if (dedupe_unsupported.count < sizeof(dedupe_unsupported.devs) /
+            sizeof(dedupe_unsupported.devs[0]))
+            dedupe_unsupported.devs[dedupe_unsupported.count++] = dev;
+        supported = FALSE;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&dedupe_unsupported.lock);
+#endif
+    return supported;
+}
+
+/**
+ * dedupe_files - Share the extents of a file with other files
+ * @src:   The file to share the extents of
+ * @dests: The files which may be equal to @src
+ * @count: The number of files in @dests, at most DEDUPE_MAX_DESTS
+ * @done:  Set to %TRUE for each file of @dests which now shares all extents
+ *
+ * The kernel compares the ranges and only shares them if they are equal,
+ * so the files are not read here. Destinations which differ are dropped
+ * from the following calls. EINVAL is about a single request, such as
+ * ranges the file system cannot handle, and only fails this call.
+ *
+ * Returns: 0 on success, -1 if the file system does not support sharing
+ * extents.
+ */
+static int dedupe_files(struct file *src, struct file **dests, size_t count,
+                        hl_bool *done)
+{
+    struct file_dedupe_range *range;
+    int fds[DEDUPE_MAX_DESTS];
+    int fsrc;
+    int ret = 0;
+    off_t off;
+    size_t i;
+
+    assert(count <= DEDUPE_MAX_DESTS);
+
+    range = calloc(1, sizeof(*range) + count * sizeof(range->info[0]));
+    if (range == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+
+    COUNT_CALL(CALL_OPEN);
+    if ((fsrc = open(src->links->path, O_RDONLY)) < 0) {
+        jlog(JLOG_SYSERR, "Cannot open %s", src->links->path);
+        memset(done, 0, count * sizeof(*done));
+        free(range);
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        /* Owners may dedupe into files they cannot write */
+        COUNT_CALL(CALL_OPEN);
+        fds[i] = open(dests[i]->links->path, O_RDWR);
+        if (fds[i] < 0 && (errno == EACCES || errno == EROFS))
+            fds[i] = open(dests[i]->links->path, O_RDONLY);
+        if (fds[i] < 0)
+            jlog(JLOG_SYSERR, "Cannot open %s", dests[i]->links->path);
+        done[i] = fds[i] >= 0;
+    }
+
+    for (off = 0; off < src->size; off += DEDUPE_CHUNK_SIZE) {
+        size_t active = 0;
+
+        if (handle_interrupt()) {
+            memset(done, 0, count * sizeof(*done));
+            break;
+        }
+
+        range->src_offset = off;
+        range->src_length = src->size - off < DEDUPE_CHUNK_SIZE ?
+            src->size - off : DEDUPE_CHUNK_SIZE;
+
+        for (i = 0; i < count; i++) {
+            if (!done[i])
+                continue;
+            memset(&range->info[active], 0, sizeof(range->info[0]));
+            range->info[active].dest_fd = fds[i];
+            range->info[active].dest_offset = off;
+            active++;
+        }
+        if (active == 0)
+            break;
+        range->dest_count = active;
+
+        COUNT_CALL(CALL_LINK);
+        if (ioctl(fsrc, FIDEDUPERANGE, range) != 0) {
+            if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV) {
+                ret = -1;
+            } else {
+                jlog(JLOG_SYSERR, "Cannot dedupe %s", src->links->path);
+            }
+            memset(done, 0, count * sizeof(*done));
+            break;
+        }
+
+        for (i = 0, active = 0; i < count; i++) {
+            const struct file_dedupe_range_info *info;
+
+            if (!done[i])
+                continue;
+            info = &range->info[active++];
+
+            if (info->status == FILE_DEDUPE_RANGE_SAME &&
+                info->bytes_deduped == range->src_length)
+                continue;
+
+            done[i] = FALSE;
+            if (info->status < 0) {
+                errno = -info->status;
+                jlog(JLOG_SYSERR, "Cannot dedupe %s to %s", src->links->path,
+                     dests[i]->links->path);
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    close(fsrc);
+    free(range);
+
+    return ret;
+}
+
+/**
+ * bucket_dedupe - Share the extents of the equal files in a bucket
+ * @bucket: The bucket
+ *
+ * Unlike links, shared extents leave every file with its own inode and
+ * metadata, so only the contents have to be equal. Larger buckets are
+ * split by the cheap edge digests first, the kernel compares the rest.
+ * Files on file systems which cannot share extents are skipped, they are
+ * never linked instead, see dedupe_supported().
+ *
+ * Returns: %FALSE if we were interrupted, %TRUE otherwise.
+ */
+static hl_bool bucket_dedupe(struct bucket *bucket)
+{
+    struct file *dests[DEDUPE_MAX_DESTS];
+    hl_bool done[DEDUPE_MAX_DESTS];
+    hl_bool *shared = calloc(bucket->count, sizeof(*shared));
+    size_t i, j, k;
+
+    if (shared == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+
+    for (i = 0; i < bucket->count; i++) {
+        struct file *src = &bucket->files[i];
+        size_t count = 0;
+
+        if (handle_interrupt()) {
+            free(shared);
+            return FALSE;
+        }
+        if (shared[i] || src->size == 0 || src->links == NULL ||
+            (!opts.dry_run && !dedupe_supported(src->dev, NULL, FALSE)))
+            continue;
+
+        for (j = i + 1; j <= bucket->count; j++) {
+            struct file *dest = &bucket->files[j];
+
+            /* Submit a full batch, or the last one */
+            if (count == DEDUPE_MAX_DESTS || (j == bucket->count && count)) {
+                if (opts.dry_run) {
+                    for (k = 0; k < count; k++)
+                        done[k] = file_contents_equal(src, dests[k]);
+                } else if (dedupe_files(src, dests, count, done) != 0) {
+                    dedupe_supported(src->dev, src->links->path, TRUE);
+                    break;
+                }
+
+                for (k = 0; k < count; k++) {
+                    if (!done[k])
+                        continue;
+                    jlog(JLOG_INFO, "%sDeduped %s to %s (-%s)",
+                         opts.dry_run ? "[DryRun] " : "", src->links->path,
+                         dests[k]->links->path, format(src->size));
+                    shared[dests[k] - bucket->files] = TRUE;
+                    STATS_ADD(deduped, 1);
+                    STATS_ADD(saved, (unsigned long long) dests[k]->blocks * 512);
+                }
+                count = 0;
+            }
+            if (j == bucket->count)
+                break;
+
+            if (shared[j] || dest->links == NULL || dest->dev != src->dev ||
+                (bucket->count > 2 &&
+                 (!file_digest(src, DIGEST_EDGES) ||
+                  !file_digest(dest, DIGEST_EDGES) ||
+                  src->digests->digest[DIGEST_EDGES] !=
+                  dest->digests->digest[DIGEST_EDGES])))
+                continue;
+
+            dests[count++] = dest;
+        }
+    }
+
+    free(shared);
+    return TRUE;
+}
+#endif
+
+/*
+ * physical_order_of
+ *
+ * The bucket being sorted by compare_physical(), qsort() has no argument
+ * for it.
+ */
+static THREAD_LOCAL const struct bucket *physical_order_of;
+
+/**
+ * compare_physical - Order files by their physical offset
+ * @_a: Pointer to a pointer to the first file
+ * @_b: Pointer to a pointer to the second file
+ */
+static int compare_physical(const void *_a, const void *_b)
+{
+    const struct file *a = *(const struct file *const *) _a;
+    const struct file *b = *(const struct file *const *) _b;
+    const struct bucket *bucket = physical_order_of;
+
+    return CMP(bucket->physical[a - bucket->files],
+               bucket->physical[b - bucket->files]);
+}
+
+/**
+ * compare_edges - Order files by their edge digest
+ * @_a: Pointer to a pointer to the first file
+ * @_b: Pointer to a pointer to the second file
+ */
+static int compare_edges(const void *_a, const void *_b)
+{
+    const struct file *a = *(const struct file *const *) _a;
+    const struct file *b = *(const struct file *const *) _b;
+
+    return CMP(a->digests->digest[DIGEST_EDGES],
+               b->digests->digest[DIGEST_EDGES]);
+}
+
+/**
+ * bucket_digest_physical - Digest the files of a bucket in physical order
+ * @bucket: The bucket, with @bucket->physical set
+ *
+ * Compute the digests the comparisons in bucket_link() need anyway, but
+ * read the files in the order of their offsets on the disk: first the
+ * edges of all files, then the full contents of each file whose edges
+ * equal those of another file.
+ */
+static void bucket_digest_physical(struct bucket *bucket)
+{
+    size_t count = bucket->count;
+    struct file **order = malloc(2 * count * sizeof(*order));
+    struct file **by_edges = order + count;
+    size_t i, j, k;
+
+    if (order == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+
+    for (i = 0; i < count; i++)
+        order[i] = by_edges[i] = &bucket->files[i];
+
+    physical_order_of = bucket;
+    qsort(order, count, sizeof(*order), compare_physical);
+
+    for (i = 0; i < count && !handle_interrupt(); i++)
+        file_digest(order[i], DIGEST_EDGES);
+
+    /* Mark the files which need a full digest in their group */
+    qsort(by_edges, count, sizeof(*by_edges), compare_edges);
+    for (i = 0; i < count; i = j) {
+        for (j = i + 1; j < count &&
+             by_edges[j]->digests->digest[DIGEST_EDGES] ==
+             by_edges[i]->digests->digest[DIGEST_EDGES]; j++);
+        if (j - i > 1)
+            for (k = i; k < j; k++)
+                by_edges[k]->digests->group = 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (order[i]->digests->group != 0 && !handle_interrupt())
+            file_digest(order[i], DIGEST_FULL);
+        order[i]->digests->group = 0;
+    }
+
+    free(order);
+}
+
+/**
+ * bucket_link - Link the equal files in a bucket
+ * @bucket: The bucket
+ *
+ * For each file in @bucket, replace all following files considered equal
+ * with links to it.
+ *
+ * Buckets of more than two files are compared in stages (see
+ * file_digests_equal()), so that each file is read at most once for its
+ * digest and once for the final comparison, instead of once per pair.
+ * With --compare=lockstep, the bucket is classified by bucket_lockstep()
+ * up front instead, if it fits into the file descriptor budget. With
+ * --reflink, the files share extents by bucket_dedupe() instead, and are
+ * never linked. On rotating disks, the digests are computed up front by
+ * bucket_digest_physical().
+ *
+ * Returns: %FALSE if we were interrupted, %TRUE otherwise.
+ */
+static hl_bool bucket_link(struct bucket *bucket)
+{
+    struct file *files = bucket->files;
+    size_t count = bucket->count;
+    size_t i, j;
+
+#ifdef HAVE_FIDEDUPERANGE
+    if (opts.dedupe)
+        return count > 1 ? bucket_dedupe(bucket) : TRUE;
+#endif
+
+    if (bucket->physical != NULL && count > 2 &&
+        opts.compare != COMPARE_LOCKSTEP)
+        bucket_digest_physical(bucket);
+
+    if (opts.compare == COMPARE_LOCKSTEP && count > 1 &&
+        !bucket_lockstep(files, count) && !handle_interrupt())
+        jlog(JLOG_DEBUG1, "Bucket of %zu files too large for lockstep, "
+             "using digests", count);
+
+    for (i = 0; i < count; i++) {
+        if (handle_interrupt())
+            return FALSE;
+        if (files[i].links == NULL)
+            continue;
+
+        for (j = i + 1; j < count; j++) {
+            if (handle_interrupt())
+                return FALSE;
+
+            assert(files[j].size == files[i].size);
+
+            if (files[j].links == NULL
+                || !file_may_link_to(&files[i], &files[j], count > 2))
+                continue;
+
+            if (!file_link(&files[i], &files[j]) && errno == EMLINK)
+                i = j;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * bucket_run - Run bucket_link() and account for its time
+ * @bucket: The bucket
+ *
+ * The time not spent in file_link() is accounted to comparing. While
+ * checkpointing, the bucket is recorded as finished by whoever is last:
+ * this function, or link_ops() making the last link queued for it.
+ */
+static hl_bool bucket_run(struct bucket *bucket)
+{
+    unsigned long long wall = clock_ns(CLOCK_MONOTONIC) - link_time.wall;
+    unsigned long long cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - link_time.cpu;
+    hl_bool ret;
+
+    if (checkpoint.out != NULL) {
+        bucket->unlinked = 1;
+        checkpoint_bucket = bucket;
+    }
+    ret = bucket_link(bucket);
+    checkpoint_bucket = NULL;
+
+    if (ret && checkpoint.out != NULL && ATOMIC_DEC(bucket->unlinked) == 0)
+        checkpoint_finished(bucket);
+
+    STATS_ADD(wall_ns[PHASE_COMPARING],
+              clock_ns(CLOCK_MONOTONIC) - link_time.wall - wall);
+    STATS_ADD(cpu_ns[PHASE_COMPARING],
+              clock_ns(CLOCK_THREAD_CPUTIME_ID) - link_time.cpu - cpu);
+
+    return ret;
+}
 
 /**
- * file_xattrs_equal - Compare the extended attributes of two files
- * @a: The first file
- * @b: The second file
- *
- * @Returns: %TRUE if and only if extended attributes are equal
+ * compare_masters - Order files by decreasing file_compare()
+ * @_a: Pointer to a pointer to the first file
+ * @_b: Pointer to a pointer to the second file
  */
-static hl_bool file_xattrs_equal(const struct file *a, const struct file *b)
-{
-    ssize_t len_a;
-    ssize_t len_b;
-    char *names_a = NULL;
-    char *names_b = NULL;
-    int n_a;
-    int n_b;
-    const char **name_ptrs_a = NULL;
-    const char **name_ptrs_b = NULL;
-    void *value_a = NULL;
-    void *value_b = NULL;
-    hl_bool ret = FALSE;
-    int i;
+static int compare_masters(const void *_a, const void *_b)
+{
+    const struct file *const *a = _a;
+    const struct file *const *b = _b;
 
-    assert(a->links != NULL);
-    assert(b->links != NULL);
+    return file_compare(*b, *a);
+}
 
-    jlog(JLOG_DEBUG1, "Comparing xattrs of %s to %s", a->links->path,
-         b->links->path);
+/**
+ * histogram_bin - The bin of a value in the bucket histograms
+ * @value: The value
+ *
+ * Returns: The smallest i with @value <= 2^i.
+ */
+static int histogram_bin(unsigned long long value)
+{
+    int bin = 0;
 
-    stats.xattr_comparisons++;
+    while (bin < STATS_HISTOGRAM - 1 && (1ULL << bin) < value)
+        bin++;
+    return bin;
+}
 
-    len_a = llistxattr_or_die(a->links->path, NULL, 0);
-    len_b = llistxattr_or_die(b->links->path, NULL, 0);
+/**
+ * collect_bucket - Add a list of files with equal size to buckets
+ * @first: The first file of the list
+ *
+ * Lists with at least two files are added to buckets. Every file in a
+ * bucket is read about once, so the cost of a bucket is estimated as the
+ * number of files times their size.
+ *
+ * The files are sorted once here, so that the master comes first, and
+ * copied out of walk_arena into one array, so that the files of a bucket
+ * are next to each other and walk_arena can be freed. Their digests are
+ * allocated next to them, with those watch_learn() kept, if any.
+ *
+ * On rotating disks, the physical offset of every file is looked up, see
+ * bucket_digest_physical().
+ */
+static void collect_bucket(const struct file *first)
+{
+    static const struct file **sorted;
+    static size_t sorted_alloc;
+    const struct file *f;
+    struct file *files;
+    struct digests *digests;
+    struct bucket *bucket;
+    size_t count = 0;
+    size_t i;
+
+    if (first->next == NULL)
+        return;
 
-    if (len_a <= 0 && len_b <= 0)
-        return TRUE;            // xattrs not supported or neither file has any
+    for (f = first; f != NULL; f = f->next)
+        count++;
 
-    if (len_a != len_b)
-        return FALSE;           // total lengths of xattr names differ
+    if (count > sorted_alloc) {
+        const struct file **tmp = realloc(sorted, count * sizeof(*tmp));
 
-    names_a = malloc_or_die(len_a);
-    names_b = malloc_or_die(len_b);
+        if (tmp == NULL) {
+            jlog(JLOG_SYSFAT, "Cannot allocate memory");
+            exit(1);
+        }
+        sorted = tmp;
+        sorted_alloc = count;
+    }
 
-    len_a = llistxattr_or_die(a->links->path, names_a, len_a);
-    len_b = llistxattr_or_die(b->links->path, names_b, len_b);
-    assert((len_a > 0) && (len_a == len_b));
+    for (i = 0, f = first; f != NULL; f = f->next)
+        sorted[i++] = f;
 
-    n_a = get_xattr_name_count(names_a, len_a);
-    n_b = get_xattr_name_count(names_b, len_b);
+    qsort(sorted, count, sizeof(*sorted), compare_masters);
 
-    if (n_a != n_b)
-        goto exit;              // numbers of xattrs differ
+    files = arena_alloc(&bucket_files, count * sizeof(*files));
+    digests = arena_alloc(&bucket_files, count * sizeof(*digests));
 
-    name_ptrs_a = get_sorted_xattr_name_table(names_a, n_a);
-    name_ptrs_b = get_sorted_xattr_name_table(names_b, n_b);
+    for (i = 0; i < count; i++) {
+        struct link **link_tail = &files[i].links;
+        struct link *link;
 
-    // We now have two sorted tables of xattr names.
+        files[i] = *sorted[i];
+        files[i].next = NULL;
+        files[i].links = NULL;
+        files[i].digests = &digests[i];
+        if (sorted[i]->digests != NULL)
+            digests[i] = *sorted[i]->digests;
 
-    for (i = 0; i < n_a; i++) {
-        if (handle_interrupt())
-            goto exit;          // user wants to quit
+        for (link = sorted[i]->links; link != NULL; link = link->next) {
+            size_t len = sizeof(*link) + strlen(link->path) + 1;
 
-        if (strcmp(name_ptrs_a[i], name_ptrs_b[i]) != 0)
-            goto exit;          // names at same slot differ
+            *link_tail = arena_alloc(&bucket_links, len);
+            memcpy(*link_tail, link, len);
+            (*link_tail)->next = NULL;
+            link_tail = &(*link_tail)->next;
+        }
+    }
 
-        len_a = lgetxattr_or_die(a->links->path, name_ptrs_a[i], NULL, 0);
-        len_b = lgetxattr_or_die(b->links->path, name_ptrs_b[i], NULL, 0);
+    if (buckets.count == buckets.alloc) {
+        size_t alloc = buckets.alloc ? buckets.alloc * 2 : 1024;
+        struct bucket *items = realloc(buckets.items, alloc * sizeof(*items));
 
-        if (len_a != len_b)
-            goto exit;          // xattrs with same name, different value lengths
+        if (items == NULL) {
+            jlog(JLOG_SYSFAT, "Cannot allocate memory");
+            exit(1);
+        }
+        buckets.items = items;
+        buckets.alloc = alloc;
+    }
 
-        value_a = malloc_or_die(len_a);
-        value_b = malloc_or_die(len_b);
+    bucket = &buckets.items[buckets.count++];
+    bucket->files = files;
+    bucket->count = count;
+    bucket->cost = (double) count * files->size;
+    bucket->physical = NULL;
+    bucket->start = UINT64_MAX;
+
+    if (device_rotational(files->dev)) {
+        bucket->physical = arena_alloc(&bucket_files,
+                                       count * sizeof(*bucket->physical));
+        for (i = 0; i < count; i++) {
+            bucket->physical[i] = file_physical(&files[i]);
+            if (bucket->physical[i] < bucket->start)
+                bucket->start = bucket->physical[i];
+        }
+    }
 
-        len_a = lgetxattr_or_die(a->links->path, name_ptrs_a[i],
-                                 value_a, len_a);
-        len_b = lgetxattr_or_die(b->links->path, name_ptrs_b[i],
-                                 value_b, len_b);
-        assert((len_a >= 0) && (len_a == len_b));
+    stats.buckets++;
+    stats.bucket_sizes[histogram_bin(count)]++;
+    stats.bucket_costs[histogram_bin((unsigned long long) count * files->size)]++;
+}
 
-        if (memcmp(value_a, value_b, len_a) != 0)
-            goto exit;          // xattrs with same name, different values
+/**
+ * compare_buckets - Order buckets by decreasing cost
+ * @_a: Pointer to the first bucket
+ * @_b: Pointer to the second bucket
+ *
+ * Buckets on rotating disks come first, ordered by where their files
+ * start on the disk, so that it is swept once instead of seeking back and
+ * forth. Ties are broken by device and size to keep the order
+ * deterministic.
+ */
+static int compare_buckets(const void *_a, const void *_b)
+{
+    const struct bucket *a = _a;
+    const struct bucket *b = _b;
+    int diff = CMP(a->start, b->start);
 
-        free(value_a);
-        free(value_b);
-        value_a = NULL;
-        value_b = NULL;
-    }
+    if (diff == 0)
+        diff = CMP(b->cost, a->cost);
 
-    ret = TRUE;
+    if (diff == 0)
+        diff = compare_nodes(a->files, b->files);
 
-  exit:
-    free(names_a);
-    free(names_b);
-    free(name_ptrs_a);
-    free(name_ptrs_b);
-    free(value_a);
-    free(value_b);
-    return ret;
+    return diff;
 }
-#else
-static hl_bool file_xattrs_equal(const struct file *a, const struct file *b)
+
+/**
+ * collect_buckets - Collect the buckets from the files table
+ *
+ * The buckets are ordered by compare_buckets() afterwards.
+ */
+static void collect_buckets(void)
 {
-    return TRUE;
+    size_t i;
+
+    for (i = 0; files.slots != NULL && i <= files.mask; i++)
+        if (files.slots[i] != NULL)
+            collect_bucket(files.slots[i]);
+
+    qsort(buckets.items, buckets.count, sizeof(*buckets.items),
+          compare_buckets);
 }
-#endif
 
+#ifdef HAVE_PTHREAD
 /**
- * file_contents_equal - Compare contents of two files for equality
- * @a: The first file
- * @b: The second file
+ * struct worker - A thread comparing and linking buckets
+ * @thread: The thread
+ * @lock:   Protects @head and @tail
+ * @queue:  The buckets assigned to this worker, most expensive first
+ * @head:   Index of the next bucket to take from @queue
+ * @tail:   Index after the last bucket in @queue
+ * @pool:   All workers, to steal work from
+ * @jobs:   The number of workers in @pool
+ */
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct bucket **queue;
+    size_t head;
+    size_t tail;
+    struct worker *pool;
+    unsigned int jobs;
+};
+
+/**
+ * worker_take - Take the most expensive pending bucket of a worker
+ * @w: The worker
  *
- * Compare the contents of the files for equality
+ * Returns: The bucket, or %NULL if the worker has nothing left.
  */
-static hl_bool file_contents_equal(const struct file *a, const struct file *b)
+static struct bucket *worker_take(struct worker *w)
 {
-    FILE *fa = NULL;
-    FILE *fb = NULL;
-    char buf_a[8192];
-    char buf_b[8192];
-    int cmp = 0;                /* zero => equal */
-    off_t off = 0;              /* current offset */
+    struct bucket *bucket = NULL;
 
-    assert(a->links != NULL);
-    assert(b->links != NULL);
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail)
+        bucket = w->queue[w->head++];
+    pthread_mutex_unlock(&w->lock);
 
-    jlog(JLOG_DEBUG1, "Comparing %s to %s", a->links->path, b->links->path);
+    return bucket;
+}
 
-    stats.comparisons++;
+/**
+ * worker_run - Main function of a worker thread
+ * @arg: The #struct worker
+ *
+ * Work through the own queue, then steal from the other workers until all
+ * queues are empty. No new work appears while the workers run, so a worker
+ * which finds all queues empty is done.
+ */
+static void *worker_run(void *arg)
+{
+    struct worker *self = arg;
+    unsigned int i = 0;
+    struct bucket *bucket;
 
-    if ((fa = fopen(a->links->path, "rb")) == NULL)
-        goto err;
-    if ((fb = fopen(b->links->path, "rb")) == NULL)
-        goto err;
+    while (i < self->jobs) {
+        struct worker *victim = &self->pool[(self - self->pool + i) % self->jobs];
 
-    posix_fadvise(fileno(fa), 0, 0, POSIX_FADV_SEQUENTIAL);
-    posix_fadvise(fileno(fb), 0, 0, POSIX_FADV_SEQUENTIAL);
+        if ((bucket = worker_take(victim)) == NULL) {
+            i++;                /* empty, try the next one */
+            continue;
+        }
+        if (!bucket_run(bucket))
+            break;
+        i = 0;                  /* back to our own queue */
+    }
 
-    while (!handle_interrupt() && cmp == 0) {
-        size_t ca;
-        size_t cb;
+    dir_release();
+    uring_release();
+    return NULL;
+}
 
-        ca = fread(buf_a, 1, sizeof(buf_a), fa);
-        if (ca < sizeof(buf_a) && ferror(fa))
-            goto err;
+/**
+ * link_buckets_parallel - Process the buckets with a pool of threads
+ *
+ * The buckets are dealt out round-robin in order of decreasing cost, so
+ * every worker starts on an expensive one, and idle workers steal from
+ * the others.
+ *
+ * Returns: %FALSE if a thread could not be started.
+ */
+static hl_bool link_buckets_parallel(void)
+{
+    unsigned int jobs = opts.jobs;
+    struct worker *pool = calloc(jobs, sizeof(*pool));
+    struct bucket **queues = malloc(buckets.count * sizeof(*queues));
+    unsigned int started = 0;
+    unsigned int j;
+    size_t i;
+
+    if (pool == NULL || queues == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
 
-        cb = fread(buf_b, 1, sizeof(buf_b), fb);
-        if (cb < sizeof(buf_b) && ferror(fb))
-            goto err;
+    for (j = 0; j < jobs; j++) {
+        pool[j].queue = queues + (buckets.count / jobs) * j +
+            (j < buckets.count % jobs ? j : buckets.count % jobs);
+        pool[j].pool = pool;
+        pool[j].jobs = jobs;
+        pthread_mutex_init(&pool[j].lock, NULL);
+    }
+    for (i = 0; i < buckets.count; i++) {
+        struct worker *w = &pool[i % jobs];
 
-        off += ca;
+        w->queue[w->tail++] = &buckets.items[i];
+    }
 
-        if ((ca != cb || ca == 0)) {
-            cmp = CMP(ca, cb);
+    for (j = 0; j < jobs; j++) {
+        if (pthread_create(&pool[j].thread, NULL, worker_run, &pool[j]) != 0) {
+            jlog(JLOG_SYSERR, "Cannot start thread");
             break;
         }
-        cmp = memcmp(buf_a, buf_b, ca);
+        started++;
     }
-  out:
-    if (fa != NULL)
-        fclose(fa);
-    if (fb != NULL)
-        fclose(fb);
-    return !handle_interrupt() && cmp == 0;
-  err:
-    if (fa == NULL || fb == NULL)
-        jlog(JLOG_SYSERR, "Cannot open %s",
-             fa ? b->links->path : a->links->path);
-    else
-        jlog(JLOG_SYSERR, "Cannot read %s",
-             ferror(fa) ? a->links->path : b->links->path);
-    cmp = 1;
-    goto out;
+
+    /* Workers steal from each other, so started ones finish everything */
+    for (j = 0; j < started; j++)
+        pthread_join(pool[j].thread, NULL);
+    for (j = 0; j < jobs; j++)
+        pthread_mutex_destroy(&pool[j].lock);
+
+    free(queues);
+    free(pool);
+    return started > 0;
 }
+#endif
 
 /**
- * file_may_link_to - Check whether a file may replace another one
- * @a: The first file
- * @b: The second file
+ * link_buckets - Compare and link the files in all buckets
  *
- * Check whether the two fies are considered equal and can be linked
- * together. If the two files are identical, the result will be FALSE,
- * as replacing a link with an identical one is stupid.
+ * Buckets never share inodes, so they can be processed independently, by
+ * several threads if --jobs is given. The links within a bucket are always
+ * made in the same order by a single thread.
+ *
+ * Returns: %FALSE if we were interrupted.
  */
-static hl_bool file_may_link_to(const struct file *a, const struct file *b)
+static hl_bool link_buckets(void)
 {
-    return (a->st.st_size != 0 &&
-            a->st.st_size == b->st.st_size &&
-            a->links != NULL && b->links != NULL &&
-            a->st.st_dev == b->st.st_dev &&
-            a->st.st_ino != b->st.st_ino &&
-            (!opts.respect_mode || a->st.st_mode == b->st.st_mode) &&
-            (!opts.respect_owner || a->st.st_uid == b->st.st_uid) &&
-            (!opts.respect_owner || a->st.st_gid == b->st.st_gid) &&
-            (!opts.respect_time || a->st.st_mtime == b->st.st_mtime) &&
-            (!opts.respect_name
-             || strcmp(a->links->path + a->links->basename,
-                       b->links->path + b->links->basename) == 0) &&
-            (!opts.respect_xattrs || file_xattrs_equal(a, b)) &&
-            file_contents_equal(a, b));
+    size_t i;
+
+#ifdef HAVE_PTHREAD
+    if (opts.jobs > 1 && buckets.count > 1 && link_buckets_parallel())
+        return !handle_interrupt();
+#endif
+
+    for (i = 0; i < buckets.count; i++)
+        if (!bucket_run(&buckets.items[i]))
+            break;
+
+    dir_release();
+    return i == buckets.count;
 }
 
 /**
- * file_compare - Compare two files to decide which should be master
- * @a: The first file
- * @b: The second file
+ * buckets_release - Free the buckets
  *
- * Check which of the files should be considered greater and thus serve
- * as the master when linking (the master is the file that all equal files
- * will be replaced with).
+ * The links must have been made and the digests taken before, see
+ * linker_wait() and cache_collect(), since both point into the buckets.
  */
-static int file_compare(const struct file *a, const struct file *b)
+static void buckets_release(void)
 {
-    int res = 0;
-    if (a->st.st_dev == b->st.st_dev && a->st.st_ino == b->st.st_ino)
-        return 0;
+    buckets.count = 0;
+    arena_free(&bucket_files);
+    arena_free(&bucket_links);
+}
 
-    if (res == 0 && opts.maximise)
-        res = CMP(a->st.st_nlink, b->st.st_nlink);
-    if (res == 0 && opts.minimise)
-        res = CMP(b->st.st_nlink, a->st.st_nlink);
-    if (res == 0)
-        res = opts.keep_oldest ? CMP(b->st.st_mtime, a->st.st_mtime)
-            : CMP(a->st.st_mtime, b->st.st_mtime);
-    if (res == 0)
-        res = CMP(b->st.st_ino, a->st.st_ino);
+/*
+ * spill_group
+ *
+ * The files of the device and size currently being merged by spill_add().
+ * The files and links are allocated from walk_arena.
+ */
+static struct {
+    struct file *first;
+} spill_group;
 
-    return res;
+/**
+ * spill_batch - Compare and link the buckets collected so far
+ *
+ * All links are made before the buckets are freed, since queued links
+ * point into them.
+ *
+ * Returns: %FALSE if we were interrupted.
+ */
+static hl_bool spill_batch(void)
+{
+    hl_bool done;
+
+    qsort(buckets.items, buckets.count, sizeof(*buckets.items),
+          compare_buckets);
+
+    done = link_buckets();
+    linker_wait();
+    cache_collect();
+    buckets_release();
+    arena_free(&walk_arena);
+
+    return done;
 }
 
 /**
- * file_link - Replace b with a link to a
- * @a: The first file
- * @b: The second file
+ * spill_group_end - Move the current group of files into a bucket
  *
- * Link the file, replacing @b with the current one. The file is first
- * linked to a temporary name, and then renamed to the name of @b, making
- * the replace atomic (@b will always exist).
+ * The buckets are compared and linked once they take more memory than
+ * --max-memory.
+ *
+ * Returns: %FALSE if we were interrupted.
  */
-static hl_bool file_link(struct file *a, struct file *b)
+static hl_bool spill_group_end(void)
 {
-  file_link:
-    assert(a->links != NULL);
-    assert(b->links != NULL);
+    if (spill_group.first == NULL)
+        return TRUE;
 
-    jlog(JLOG_INFO, "%sLinking %s to %s (-%s)",
-         opts.dry_run ? "[DryRun] " : "", a->links->path, b->links->path,
-         format(a->st.st_size));
+    collect_bucket(spill_group.first);
+    spill_group.first = NULL;
 
-    if (!opts.dry_run) {
-        size_t len = strlen(b->links->path) + strlen(".hardlink-temporary") + 1;
-        char *new_path = malloc(len);
+    if (walk_arena.size + bucket_files.size + bucket_links.size +
+        buckets.alloc * sizeof(*buckets.items) > opts.max_memory)
+        return spill_batch();
 
-        if (new_path == NULL) {
-            jlog(JLOG_SYSFAT, "Cannot allocate memory");
-            exit(1);
-        }
+    return TRUE;
+}
 
-        snprintf(new_path, len, "%s.hardlink-temporary", b->links->path);
+/**
+ * spill_add - Add a merged link to the current group
+ * @rec:  The record of the link
+ * @path: The path of the link
+ * @arg:  Unused
+ *
+ * Records arrive ordered by spill_compare(), so a link belongs to the
+ * file before it if it has the same inode, and starts a new group if the
+ * device or size differ.
+ *
+ * Returns: %FALSE if we were interrupted.
+ */
+static hl_bool spill_add(const struct spill_record *rec, const char *path,
+                         void *arg)
+{
+    struct file *f = spill_group.first;
+    struct link *link;
 
-        if (link(a->links->path, new_path) != 0) {
-            jlog(JLOG_SYSERR, "Cannot link %s to %s", a->links->path, new_path);
-            free(new_path);
-            return FALSE;
-        } else if (rename(new_path, b->links->path) != 0) {
-            jlog(JLOG_SYSERR, "Cannot rename %s to %s", a->links->path,
-                 new_path);
-            unlink(new_path);   /* cleanup failed rename */
-            free(new_path);
+    (void) arg;
+
+    if (f != NULL && (f->dev != rec->dev || (uint64_t) f->size != rec->size)) {
+        if (!spill_group_end())
             return FALSE;
+        f = NULL;
+    }
+
+    link = arena_alloc(&walk_arena, sizeof(*link) + rec->len + 1);
+    link->basename = rec->basename;
+    memcpy(link->path, path, rec->len + 1);
+
+    if (f != NULL && f->ino == rec->ino &&
+        (!opts.respect_name ||
+         strcmp(f->links->path + f->links->basename,
+                path + rec->basename) == 0)) {
+        link->next = f->links;
+        f->links = link;
+        return TRUE;
+    }
+
+    f = arena_alloc(&walk_arena, sizeof(*f));
+    f->dev = rec->dev;
+    f->ino = rec->ino;
+    f->size = rec->size;
+    f->blocks = rec->blocks;
+    f->mtime = rec->mtime[0];
+    f->mtime_nsec = rec->mtime[1];
+    f->ctime = rec->ctime[0];
+    f->ctime_nsec = rec->ctime[1];
+    f->nlink = rec->nlink;
+    f->mode = rec->mode;
+    f->uid = rec->uid;
+    f->gid = rec->gid;
+    f->links = link;
+    f->next = spill_group.first;
+    spill_group.first = f;
+
+    return TRUE;
+}
+
+/**
+ * spill_merge - Compare and link the files written to runs
+ *
+ * The last runs are merged until at most SPILL_FAN_IN are left, then the
+ * last merge builds the buckets, which are processed in batches that
+ * fit into --max-memory. A file is only compared with files of the same
+ * size, so no bucket is ever split across batches.
+ *
+ * Returns: %FALSE if we were interrupted.
+ */
+static hl_bool spill_merge(void)
+{
+    while (spill.count > SPILL_FAN_IN) {
+        unsigned int level = spill.levels[spill.count - SPILL_FAN_IN] + 1;
+
+        spill_push(spill_compact(), level);
+    }
+
+    jlog(JLOG_DEBUG1, "Merging %zu temporary runs", spill.count);
+
+    if (!spill_merge_runs(spill.runs, spill.count, spill_add, NULL) ||
+        !spill_group_end())
+        return FALSE;
+
+    return spill_batch();
+}
+
+
+#ifdef HAVE_INOTIFY
+/**
+ * watch_learn - Keep what was learned about the files in the buckets
+ *
+ * The buckets hold copies of the files in the tables, see collect_bucket().
+ * Their digests are copied back, so that a file is not read again when
+ * the next file of its size arrives.
+ */
+static void watch_learn(void)
+{
+    size_t i;
+
+    for (i = 0; i < buckets.count; i++) {
+        size_t j;
+
+        for (j = 0; j < buckets.items[i].count; j++) {
+            const struct file *f = &buckets.items[i].files[j];
+            struct file **node;
+
+            /* Files linked away have no links left to look them up by */
+            if (f->links == NULL)
+                continue;
+
+            node = table_find_ino(&files_by_ino, f);
+            if (*node == NULL)
+                continue;
+
+            if ((*node)->digests == NULL)
+                (*node)->digests = walk_alloc(sizeof(struct digests));
+            *(*node)->digests = *f->digests;
+            (*node)->digests->group = 0;
+        }
+    }
+}
+
+/**
+ * watch_forget - Remove a file from the tables and free it
+ * @f: The file
+ *
+ * If the file is still waiting in watch.fresh, its entry is cleared.
+ */
+static void watch_forget(struct file *f)
+{
+    struct file **node = table_find_ino(&files_by_ino, f);
+    struct file **head;
+    struct file **p;
+    size_t i;
+
+    if (*node == f)
+        table_remove(&files_by_ino, node, hash_ino);
+
+    head = table_find_size(&files, f);
+    for (p = head; *p != NULL; p = &(*p)->next) {
+        if (*p == f) {
+            *p = f->next;
+            break;
+        }
+    }
+    if (*head == NULL)
+        table_remove(&files, head, hash_size);
+
+    for (i = 0; i < watch.fresh_count; i++)
+        if (watch.fresh[i] == f)
+            watch.fresh[i] = NULL;
+
+    while (f->links != NULL) {
+        struct link *next = f->links->next;
+
+        free(f->links);
+        f->links = next;
+    }
+    free(f->digests);
+    free(f);
+}
+
+/**
+ * watch_check - Drop the links of a file which are gone
+ * @f: The file
+ *
+ * Files in the tables may have been linked away, removed, or changed
+ * since they were found. Links which no longer lead to the file are
+ * dropped, and the link count and change time are updated.
+ *
+ * Returns: %FALSE if no link is left, or the file has changed.
+ */
+static hl_bool watch_check(struct file *f)
+{
+    struct link **p = &f->links;
+    struct stat st;
+
+    while (*p != NULL) {
+        COUNT_CALL(CALL_STAT);
+        if (lstat((*p)->path, &st) == 0 && st.st_dev == f->dev &&
+            st.st_ino == f->ino) {
+            if (!file_unchanged(f, &st))
+                return FALSE;
+            f->nlink = st.st_nlink;
+            f->ctime = st.st_ctim.tv_sec;
+            f->ctime_nsec = st.st_ctim.tv_nsec;
+            p = &(*p)->next;
+        } else {
+            struct link *gone = *p;
+
+            *p = gone->next;
+            free(gone);
+        }
+    }
+
+    return f->links != NULL;
+}
+
+/**
+ * watch_is_fresh - Check whether a file of a bucket is new
+ * @f: The copy of the file in the bucket
+ */
+static hl_bool watch_is_fresh(const struct file *f)
+{
+    size_t i;
+
+    for (i = 0; i < watch.fresh_count; i++)
+        if (watch.fresh[i] != NULL && watch.fresh[i]->dev == f->dev &&
+            watch.fresh[i]->ino == f->ino)
+            return TRUE;
+    return FALSE;
+}
+
+/**
+ * watch_order - Move the new files of a bucket behind the resident ones
+ * @bucket: The bucket
+ *
+ * The order among the resident files and among the new files is kept.
+ */
+static void watch_order(struct bucket *bucket)
+{
+    struct file *sorted = malloc(bucket->count * sizeof(*sorted));
+    uint64_t *physical = NULL;
+    size_t n = 0;
+    size_t pass;
+    size_t i;
+
+    if (sorted == NULL || (bucket->physical != NULL &&
+                          (physical = malloc(bucket->count *
+                                             sizeof(*physical))) == NULL)) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < bucket->count; i++) {
+            if (watch_is_fresh(&bucket->files[i]) != (pass == 1))
+                continue;
+            if (physical != NULL)
+                physical[n] = bucket->physical[i];
+            sorted[n++] = bucket->files[i];
         }
-        free(new_path);
     }
 
-    /* Update statistics */
-    stats.linked++;
+    memcpy(bucket->files, sorted, n * sizeof(*sorted));
+    if (physical != NULL)
+        memcpy(bucket->physical, physical, n * sizeof(*physical));
+    free(sorted);
+    free(physical);
+}
+
+/**
+ * watch_link - Link a new file to the files of its size
+ * @fresh: The file
+ *
+ * The files of the size are checked first, and those which are gone are
+ * forgotten. The rest is compared and linked as a bucket like in the
+ * first run, except that all new files are moved behind the resident ones
+ * by watch_order(), so that they are linked to a resident file instead of
+ * one of them becoming the master that the resident files are replaced
+ * with.
+ *
+ * Returns: %FALSE if we were interrupted.
+ */
+static hl_bool watch_link(const struct file *fresh)
+{
+    static struct file **stale;
+    static size_t stale_alloc;
+    size_t stale_count = 0;
+    struct file key = *fresh;   /* @fresh itself may be forgotten */
+    struct file **head;
+    struct file *f;
+    hl_bool done;
+
+    head = table_find_size(&files, &key);
+
+    for (f = *head; f != NULL; f = f->next) {
+        if (watch_check(f))
+            continue;
+
+        if (stale_count == stale_alloc) {
+            size_t alloc = stale_alloc ? 2 * stale_alloc : 64;
+            struct file **tmp = realloc(stale, alloc * sizeof(*tmp));
 
-    /* Increase the link count of this file, and set stat() of other file */
-    a->st.st_nlink++;
-    b->st.st_nlink--;
+            if (tmp == NULL) {
+                jlog(JLOG_SYSFAT, "Cannot allocate memory");
+                exit(1);
+            }
+            stale = tmp;
+            stale_alloc = alloc;
+        }
+        stale[stale_count++] = f;
+    }
 
-    if (b->st.st_nlink == 0)
-        stats.saved += a->st.st_size;
+    /* Forgetting moves slots around, so look the list up again after */
+    while (stale_count > 0)
+        watch_forget(stale[--stale_count]);
 
-    /* Move the link from file b to a */
-    {
-        struct link *new_link = b->links;
+    head = table_find_size(&files, &key);
+    if (*head == NULL || (*head)->next == NULL)
+        return TRUE;
 
-        b->links = b->links->next;
-        new_link->next = a->links->next;
-        a->links->next = new_link;
-    }
+    collect_bucket(*head);
+    watch_order(&buckets.items[buckets.count - 1]);
 
-    // Do it again
-    if (b->links)
-        goto file_link;
+    done = link_buckets();
+    linker_wait();
+    cache_collect();
+    watch_learn();
+    buckets_release();
 
-    return TRUE;
+    return done;
 }
 
 /**
- * inserter - Callback function for nftw()
- * @fpath: The path of the file being visited
- * @sb:    The stat information of the file
- * @typeflag: The type flag
- * @ftwbuf:   Contains current level of nesting and offset of basename
+ * watch_file - Add a file which was written or moved into the tree
+ * @path: The path of the file
+ * @base: The offset of the basename in @path
+ *
+ * A changed file is forgotten and found again, a new link to a known
+ * inode is only added to its links.
  *
- * Called by nftw() for the files. See the manual page for nftw() for
- * further information.
+ * Returns: 0 to continue, 1 to stop.
  */
-static int inserter(const char *fpath, const struct stat *sb, int typeflag,
-                    struct FTW *ftwbuf)
+static int watch_file(const char *path, int base)
 {
-    struct file *fil;
+    struct file key;
     struct file **node;
-    size_t pathlen;
-    hl_bool included;
-    hl_bool excluded;
-
-    if (handle_interrupt())
-        return 1;
-    if (typeflag == FTW_DNR || typeflag == FTW_NS)
-        jlog(JLOG_SYSERR, "Cannot read %s", fpath);
-    if (typeflag != FTW_F || !S_ISREG(sb->st_mode))
-        return 0;
-
-    included = regexec_any(opts.include, fpath);
-    excluded = regexec_any(opts.exclude, fpath);
-
-    if ((opts.exclude && excluded && !included) ||
-        (!opts.exclude && opts.include && !included))
-        return 0;
+    struct link *link;
+    struct stat st;
+    size_t pathlen = strlen(path) + 1;
 
-    stats.files++;
+    COUNT_CALL(CALL_STAT);
+    if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return 0;               /* gone again, or not a file */
 
-    if (sb->st_size < opts.min_size) {
-        jlog(JLOG_DEBUG1, "Skipped %s (smaller than configured size)", fpath);
+    if ((link = malloc(sizeof(*link) + pathlen)) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    link->next = NULL;
+    link->basename = base;
+    memcpy(link->path, path, pathlen);
+
+    memset(&key, 0, sizeof(key));
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.links = link;
+
+    node = table_find_ino(&files_by_ino, &key);
+    if (*node != NULL && !file_unchanged(*node, &st)) {
+        watch_forget(*node);
+    } else if (*node != NULL) {
+        struct link **l;
+
+        /* Seen by the walk already, or our own rename after linking, which
+         * is not a new file to be counted */
+        for (l = &(*node)->links; *l != NULL; l = &(*l)->next) {
+            if (strcmp((*l)->path, path) == 0) {
+                free(link);
+                return 0;
+            }
+        }
+        lock_files();
+        *l = link;
+        (*node)->nlink = st.st_nlink;
+        unlock_files();
         return 0;
     }
+    free(link);
 
-    jlog(JLOG_DEBUG2, "Visiting %s (file %zu)", fpath, stats.files);
-
-    pathlen = strlen(fpath) + 1;
-
-    fil = calloc(1, sizeof(*fil));
-
-    if (fil == NULL)
-        return jlog(JLOG_SYSFAT, "Cannot continue"), 1;
-
-    fil->links = calloc(1, sizeof(struct link) + pathlen);
-
-    if (fil->links == NULL)
-        return jlog(JLOG_SYSFAT, "Cannot continue"), 1;
-
-    fil->st = *sb;
-    fil->links->basename = ftwbuf->base;
-    fil->links->next = NULL;
-
-    memcpy(fil->links->path, fpath, pathlen);
+    return inserter(path, &st, base);
+}
 
-    node = tsearch(fil, &files_by_ino, compare_nodes_ino);
+/**
+ * watch_event - Handle an event in a watched directory
+ * @ev: The event
+ *
+ * Returns: 0 to continue, 1 to stop.
+ */
+static int watch_event(const struct inotify_event *ev)
+{
+    const char *dir;
+    char *path;
+    size_t dirlen;
+    int ret;
 
-    if (node == NULL)
-        return jlog(JLOG_SYSFAT, "Cannot continue"), 1;
+    if (ev->mask & IN_Q_OVERFLOW) {
+        jlog(JLOG_ERROR, "Missed events, some new files are not linked");
+        return 0;
+    }
+    if (ev->mask & IN_IGNORED) {
+        if ((size_t) ev->wd < watch.dirs_alloc) {
+            free(watch.dirs[ev->wd]);
+            watch.dirs[ev->wd] = NULL;
+        }
+        return 0;
+    }
+    if (ev->len == 0 || (size_t) ev->wd >= watch.dirs_alloc ||
+        (dir = watch.dirs[ev->wd]) == NULL)
+        return 0;
 
-    if (*node != fil) {
-        /* Already known inode, add link to inode information */
-        assert((*node)->st.st_dev == sb->st_dev);
-        assert((*node)->st.st_ino == sb->st_ino);
+    /* Files announce themselves when written, only directories here */
+    if ((ev->mask & IN_CREATE) && !(ev->mask & IN_ISDIR))
+        return 0;
 
-        fil->links->next = (*node)->links;
-        (*node)->links = fil->links;
+    dirlen = strlen(dir);
+    if ((path = malloc(dirlen + strlen(ev->name) + 2)) == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+    memcpy(path, dir, dirlen);
+    if (dirlen > 0 && path[dirlen - 1] != '/')
+        path[dirlen++] = '/';
+    strcpy(path + dirlen, ev->name);
 
-        free(fil);
-    } else {
-        /* New inode, insert into by-size table */
-        node = tsearch(fil, &files, compare_nodes);
+    jlog(JLOG_DEBUG1, "Event 0x%x for %s", (unsigned int) ev->mask, path);
 
-        if (node == NULL)
-            return jlog(JLOG_SYSFAT, "Cannot continue"), 1;
+    if (ev->mask & IN_ISDIR)
+        ret = walk(path);
+    else
+        ret = watch_file(path, dirlen);
 
-        if (*node != fil) {
-            struct file *l;
+    free(path);
+    return ret;
+}
 
-            if (file_compare(fil, *node) >= 0) {
-                fil->next = *node;
-                *node = fil;
-            } else {
-                for (l = *node; l != NULL; l = l->next) {
-                    if (l->next != NULL && file_compare(fil, l->next) < 0)
-                        continue;
+/**
+ * watch_settled - Link the new files which have settled
+ *
+ * Files modified within the last WATCH_SETTLE seconds are kept for later.
+ * Files changed again meanwhile have been forgotten by watch_file() and
+ * found anew, so only the new entry is linked. The digests computed are
+ * saved to the cache right away, instead of piling up until the end.
+ *
+ * Returns: %FALSE if we were interrupted.
+ */
+static hl_bool watch_settled(void)
+{
+    time_t now = time(NULL);
+    size_t kept = 0;
+    size_t i;
 
-                    fil->next = l->next;
-                    l->next = fil;
+    for (i = 0; i < watch.fresh_count; i++) {
+        struct file *f = watch.fresh[i];
 
-                    break;
-                }
-            }
+        if (f == NULL)
+            continue;           /* forgotten meanwhile */
+        if (now - f->mtime < WATCH_SETTLE) {
+            watch.fresh[kept++] = f;
+            continue;
+        }
+        if (!watch_link(f)) {
+            watch.fresh_count = 0;
+            return FALSE;
         }
     }
 
-    return 0;
+    watch.fresh_count = kept;
+    if (cache.pending_count > 0)
+        cache_save();
+    return TRUE;
 }
 
 /**
- * visitor - Callback for twalk()
- * @nodep: Pointer to a pointer to a #struct file
- * @which: At which point this visit is (preorder, postorder, endorder)
- * @depth: The depth of the node in the tree
+ * watch_run - Link new files until interrupted
+ *
+ * The tables of the first run are kept, and every directory walked is
+ * watched with inotify. For each batch of events, the new files are
+ * added to the tables by inserter(), and once settled linked to the files
+ * of their size by watch_link(). The buckets of the first run must have been
+ * released before.
  *
- * Visit the nodes in the binary tree. For each node, call hardlinker()
- * on each #struct file in the linked list of #struct file instances located
- * at that node.
+ * Returns: %FALSE on errors, %TRUE once interrupted by SIGINT or SIGTERM.
  */
-static void visitor(const void *nodep, const VISIT which, const int depth)
+static hl_bool watch_run(void)
 {
-    struct file *master = *(struct file **) nodep;
-    struct file *other;
+    static char buf[65536]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd;
 
-    (void) depth;
+    pfd.fd = watch.fd;
+    pfd.events = POLLIN;
+    watch.collect = TRUE;
 
-    if (which != leaf && which != endorder)
-        return;
-
-    for (; master != NULL; master = master->next) {
-        if (handle_interrupt())
-            exit(1);
-        if (master->links == NULL)
-            continue;
-
-        for (other = master->next; other != NULL; other = other->next) {
-            if (handle_interrupt())
-                exit(1);
+    jlog(JLOG_INFO, "Watching for new files");
 
-            assert(other != other->next);
-            assert(other->st.st_size == master->st.st_size);
+    while (!handle_interrupt()) {
+        ssize_t len;
+        ssize_t off;
+        int ret;
 
-            if (other->links == NULL || !file_may_link_to(master, other))
+        /* Unlike read(), poll() is interrupted even with SA_RESTART */
+        if ((ret = poll(&pfd, 1, watch.fresh_count > 0 ? 1000 : -1)) < 0) {
+            if (errno == EINTR)
                 continue;
-
-            if (!file_link(master, other) && errno == EMLINK)
-                master = other;
+            jlog(JLOG_SYSERR, "Cannot wait for events");
+            return FALSE;
+        }
+        if (ret == 0)
+            len = 0;
+        else if ((len = read(watch.fd, buf, sizeof(buf))) < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            jlog(JLOG_SYSERR, "Cannot read events");
+            return FALSE;
         }
+
+        for (off = 0; off < len; off += sizeof(struct inotify_event) +
+             ((struct inotify_event *) (buf + off))->len)
+            if (watch_event((struct inotify_event *) (buf + off)) != 0)
+                return TRUE;
+
+        if (!watch_settled())
+            return TRUE;
     }
+
+    return TRUE;
 }
+#endif
 
 /**
  * version - Print the program version and exit
@@ -966,9 +7546,43 @@ static int help(const char *name)
     puts("                        Regular expression to exclude files");
     puts("  -i REGEXP, --include=REGEXP");
     puts("                        Regular expression to include files/dirs");
+    puts("  --xdev, --one-file-system");
+    puts("                        Do not descend into other file systems");
     puts("  -s <num>[K,M,G], --minimum-size=<num>[K,M,G]");
     puts("                        Minimum size for files. Optional suffix");
     puts("                        allows for using KiB, MiB, or GiB");
+#ifdef HAVE_PTHREAD
+    puts("  -j N, --jobs=N        Search directories and compare files of");
+    puts("                        different sizes in N threads");
+#endif
+    puts("  --cache=FILE          Keep digests of unchanged files in FILE");
+    puts("                        between runs");
+    puts("  --prescan             Count file sizes in a first pass and only");
+    puts("                        keep files of shared sizes in the second");
+    puts("  --stats=FORMAT        Print statistics as text (default) or json");
+    puts("  --stats-file=FILE     Write statistics to FILE instead of stdout,");
+    puts("                        also on SIGUSR1");
+    puts("  --plan-out=FILE       Write the links to make to FILE instead of");
+    puts("                        making them");
+    puts("  --apply=FILE          Make the links written by --plan-out to FILE");
+    puts("  --reflink, --dedupe-range");
+    puts("                        Let equal files share their extents instead");
+    puts("                        of linking them, where supported");
+    puts("  --physical-order=WHEN Read files in the order of their blocks on");
+    puts("                        disk: auto (on rotating disks), always, never");
+    puts("  --max-memory=SIZE     Sort files through temporary files in");
+    puts("                        $TMPDIR to use only about SIZE of memory");
+    puts("  --checkpoint=FILE     Save progress to FILE now and then, and when");
+    puts("                        interrupted by SIGINT or SIGTERM");
+    puts("  --resume=FILE         Continue the run saved to FILE");
+    puts("  --watch               Keep running and link new files as they are");
+    puts("                        written or moved into the tree");
+    puts("  --uncached            Read files without updating their access time");
+    puts("                        and drop them from the page cache afterwards");
+    puts("  --direct-io           Like --uncached, and read with O_DIRECT");
+    puts("  -C METHOD, --compare=METHOD");
+    puts("                        How to compare file contents: digest");
+    puts("                        (default), lockstep, or mmap");
     puts("");
     puts("Compatibility options to Jakub Jelinek's hardlink:");
     puts("  -c                    Compare only file contents, same as -pot");
@@ -980,6 +7594,69 @@ static int help(const char *name)
     exit(0);
 }
 
+/**
+ * regex_combinable - Check whether a regular expression can be combined
+ * @regex: The extended regular expression
+ *
+ * An expression can be put into an alternation with others if its
+ * parentheses are balanced, so that it stays within its own group, and it
+ * has no back-references, whose numbers would change.
+ */
+static hl_bool regex_combinable(const char *regex)
+{
+    const char *p;
+    int depth = 0;
+
+    for (p = regex; *p != '\0'; p++) {
+        if (*p == '\\') {
+            if (p[1] == '\0' || (p[1] >= '1' && p[1] <= '9'))
+                return FALSE;
+            p++;
+        } else if (*p == '[') {
+            /* Skip the bracket expression, ']' first is a member */
+            p += (p[1] == '^') ? 2 : 1;
+            if (*p == ']')
+                p++;
+            for (; *p != '\0' && *p != ']'; p++) {
+                if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+                    char end = p[1];
+
+                    for (p += 2; *p != '\0' && (p[0] != end || p[1] != ']');)
+                        p++;
+                    if (*p == '\0')
+                        return FALSE;
+                    p++;
+                }
+            }
+            if (*p == '\0')
+                return FALSE;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth < 0) {
+            return FALSE;
+        }
+    }
+
+    return depth == 0;
+}
+
+/**
+ * regex_prunable - Check whether a regular expression may prune directories
+ * @regex: The extended regular expression
+ *
+ * See dir_excluded(). The GNU extensions \B and \' can match at the end of
+ * the path of a directory, but not within the path of a file below it.
+ */
+static hl_bool regex_prunable(const char *regex)
+{
+    const char *p;
+
+    for (p = regex; (p = strchr(p, '\\')) != NULL && p[1] != '\0'; p += 2)
+        if (p[1] == 'B' || p[1] == '\'')
+            return FALSE;
+    return TRUE;
+}
+
 /**
  * register_regex - Compile and insert a regular expression into list
  * @pregs: Pointer to a linked list of regular expressions
@@ -1015,11 +7692,138 @@ static int register_regex(struct regex_link **pregs, const char *regex)
         return 1;
     }
 
+    link->source = regex;
+    link->prune = regex_prunable(regex);
     link->next = *pregs;
     *pregs = link;
     return 0;
 }
 
+/**
+ * combine_regex - Merge a list of regular expressions into one
+ * @pregs: Pointer to a linked list of regular expressions
+ *
+ * The expressions which regex_combinable() accepts are replaced by a single
+ * alternation of all of them, so that a path is matched in one pass of the
+ * matcher instead of one per pattern. The others are kept as they are, as
+ * are all of them if the alternation cannot be compiled.
+ */
+static void combine_regex(struct regex_link **pregs)
+{
+    struct regex_link *combined;
+    struct regex_link *link;
+    struct regex_link **p;
+    size_t count = 0;
+    size_t len = 0;
+    char *regex;
+
+    for (link = *pregs; link != NULL; link = link->next) {
+        if (link->source != NULL && regex_combinable(link->source)) {
+            len += strlen(link->source) + 3;
+            count++;
+        }
+    }
+    if (count < 2)
+        return;
+
+    combined = malloc(sizeof(*combined));
+    regex = malloc(len);
+    if (combined == NULL || regex == NULL) {
+        jlog(JLOG_SYSFAT, "Cannot allocate memory");
+        exit(1);
+    }
+
+    len = 0;
+    combined->prune = TRUE;
+    for (link = *pregs; link != NULL; link = link->next) {
+        if (link->source != NULL && regex_combinable(link->source)) {
+            len += sprintf(regex + len, "%s(%s)", len ? "|" : "",
+                           link->source);
+            combined->prune = combined->prune && link->prune;
+        }
+    }
+
+    if (regcomp(&combined->preg, regex, REG_NOSUB | REG_EXTENDED) != 0) {
+        jlog(JLOG_DEBUG1, "Could not combine regular expressions %s", regex);
+        free(combined);
+        free(regex);
+        return;
+    }
+    free(regex);
+
+    for (p = pregs; (link = *p) != NULL;) {
+        if (link->source != NULL && regex_combinable(link->source)) {
+            *p = link->next;
+            regfree(&link->preg);
+            free(link);
+        } else {
+            p = &link->next;
+        }
+    }
+
+    combined->source = NULL;
+    combined->next = *pregs;
+    *pregs = combined;
+}
+
+/* Values of the long options without a short option */
+enum {
+    OPT_CACHE = 256,
+    OPT_PRESCAN,
+    OPT_REFLINK,
+    OPT_STATS,
+    OPT_STATS_FILE,
+    OPT_PLAN_OUT,
+    OPT_APPLY,
+    OPT_PHYSICAL_ORDER,
+    OPT_MAX_MEMORY,
+    OPT_WATCH,
+    OPT_CHECKPOINT,
+    OPT_RESUME,
+    OPT_XDEV,
+    OPT_UNCACHED,
+    OPT_DIRECT_IO
+};
+
+/**
+ * MAX_JOBS - The largest number of threads accepted by --jobs
+ */
+#define MAX_JOBS 1024
+
+/**
+ * parse_size - Parse a size with an optional unit
+ * @arg:  The argument, such as 512, 64K or 2G
+ * @size: Set to the size in bytes
+ *
+ * Returns: 0 on success, 1 after logging an error.
+ */
+static int parse_size(const char *arg, unsigned long long *size)
+{
+    char unit = '\0';
+
+    if (sscanf(arg, "%llu%c", size, &unit) < 1) {
+        jlog(JLOG_ERROR, "Invalid size: %s", arg);
+        return 1;
+    }
+    switch (tolower(unit)) {
+    case '\0':
+        break;
+    case 't':
+        *size *= 1024;
+    case 'g':
+        *size *= 1024;
+    case 'm':
+        *size *= 1024;
+    case 'k':
+        *size *= 1024;
+        break;
+    default:
+        jlog(JLOG_ERROR, "Unknown unit indicator %c.", unit);
+        return 1;
+    }
+    return 0;
+}
+
 /**
  * parse_options - Parse the command line options
  * @argc: Number of options
@@ -1027,7 +7831,7 @@ static int register_regex(struct regex_link **pregs, const char *regex)
  */
 static int parse_options(int argc, char *argv[])
 {
-    static const char optstr[] = "VhvnfpotXcmMOx:i:s:";
+    static const char optstr[] = "VhvnfpotXcmMOx:i:s:C:j:";
 #ifdef HAVE_GETOPT_LONG
     static const struct option long_options[] = {
         {"version", no_argument, NULL, 'V'},
@@ -1045,12 +7849,32 @@ static int parse_options(int argc, char *argv[])
         {"exclude", required_argument, NULL, 'x'},
         {"include", required_argument, NULL, 'i'},
         {"minimum-size", required_argument, NULL, 's'},
+        {"compare", required_argument, NULL, 'C'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"cache", required_argument, NULL, OPT_CACHE},
+        {"prescan", no_argument, NULL, OPT_PRESCAN},
+        {"reflink", no_argument, NULL, OPT_REFLINK},
+        {"dedupe-range", no_argument, NULL, OPT_REFLINK},
+        {"stats", required_argument, NULL, OPT_STATS},
+        {"stats-file", required_argument, NULL, OPT_STATS_FILE},
+        {"plan-out", required_argument, NULL, OPT_PLAN_OUT},
+        {"apply", required_argument, NULL, OPT_APPLY},
+        {"physical-order", required_argument, NULL, OPT_PHYSICAL_ORDER},
+        {"max-memory", required_argument, NULL, OPT_MAX_MEMORY},
+        {"watch", no_argument, NULL, OPT_WATCH},
+        {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+        {"resume", required_argument, NULL, OPT_RESUME},
+        {"xdev", no_argument, NULL, OPT_XDEV},
+        {"one-file-system", no_argument, NULL, OPT_XDEV},
+        {"uncached", no_argument, NULL, OPT_UNCACHED},
+        {"direct-io", no_argument, NULL, OPT_DIRECT_IO},
         {NULL, 0, NULL, 0}
     };
 #endif
 
     int opt;
-    char unit = '\0';
+    unsigned long jobs;
+    char *end;
 
     opts.respect_mode = TRUE;
     opts.respect_owner = TRUE;
@@ -1058,6 +7882,8 @@ static int parse_options(int argc, char *argv[])
     opts.respect_xattrs = FALSE;
     opts.keep_oldest = FALSE;
     opts.min_size = 1;
+    opts.compare = COMPARE_DIGEST;
+    opts.jobs = 1;
 
     while ((opt = getopt_long(argc, argv, optstr, long_options, NULL)) != -1) {
         switch (opt) {
@@ -1111,28 +7937,124 @@ static int parse_options(int argc, char *argv[])
                 return 1;
             break;
         case 's':
-            if (sscanf(optarg, "%llu%c", &opts.min_size, &unit) < 1) {
-                jlog(JLOG_ERROR, "Invalid option given to -s: %s", optarg);
+            if (parse_size(optarg, &opts.min_size) != 0)
+                return 1;
+            jlog(JLOG_DEBUG1, "Using minimum size of %lld bytes.",
+                 opts.min_size);
+            break;
+        case 'C':
+            if (strcmp(optarg, "digest") == 0) {
+                opts.compare = COMPARE_DIGEST;
+            } else if (strcmp(optarg, "lockstep") == 0) {
+                opts.compare = COMPARE_LOCKSTEP;
+            } else if (strcmp(optarg, "mmap") == 0) {
+                opts.compare = COMPARE_MMAP;
+            } else {
+                jlog(JLOG_ERROR, "Unknown comparison method: %s", optarg);
                 return 1;
             }
-            switch (tolower(unit)) {
-            case '\0':
-                break;
-            case 't':
-                opts.min_size *= 1024;
-            case 'g':
-                opts.min_size *= 1024;
-            case 'm':
-                opts.min_size *= 1024;
-            case 'k':
-                opts.min_size *= 1024;
-                break;
-            default:
-                jlog(JLOG_ERROR, "Unknown unit indicator %c.", unit);
+            break;
+        case OPT_CACHE:
+            cache_open(optarg);
+            break;
+        case OPT_PRESCAN:
+            opts.prescan = TRUE;
+            break;
+        case OPT_STATS:
+            if (strcmp(optarg, "text") == 0) {
+                opts.stats_json = FALSE;
+            } else if (strcmp(optarg, "json") == 0) {
+                opts.stats_json = TRUE;
+            } else {
+                jlog(JLOG_ERROR, "Unknown statistics format: %s", optarg);
                 return 1;
             }
-            jlog(JLOG_DEBUG1, "Using minimum size of %lld bytes.",
-                 opts.min_size);
+            break;
+        case OPT_STATS_FILE:
+            if (stats_fd >= 0)
+                close(stats_fd);
+            stats_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (stats_fd < 0) {
+                jlog(JLOG_SYSERR, "Cannot open %s", optarg);
+                return 1;
+            }
+            break;
+        case OPT_PLAN_OUT:
+            if (plan.out != NULL || !plan_open(optarg))
+                return 1;
+            opts.dry_run = TRUE;        /* nothing is changed while planning */
+            break;
+        case OPT_APPLY:
+            opts.apply = optarg;
+            break;
+        case OPT_PHYSICAL_ORDER:
+            if (strcmp(optarg, "auto") == 0) {
+                opts.physical_order = ORDER_AUTO;
+            } else if (strcmp(optarg, "always") == 0) {
+                opts.physical_order = ORDER_ALWAYS;
+            } else if (strcmp(optarg, "never") == 0) {
+                opts.physical_order = ORDER_NEVER;
+            } else {
+                jlog(JLOG_ERROR, "Unknown value for --physical-order: %s",
+                     optarg);
+                return 1;
+            }
+            break;
+        case OPT_MAX_MEMORY:
+            if (parse_size(optarg, &opts.max_memory) != 0)
+                return 1;
+            break;
+        case OPT_CHECKPOINT:
+            checkpoint.path = optarg;
+            break;
+        case OPT_RESUME:
+            opts.resume = optarg;
+            break;
+        case OPT_XDEV:
+            opts.xdev = TRUE;
+            break;
+        case OPT_DIRECT_IO:
+#ifdef O_DIRECT
+            opts.direct = TRUE;
+#else
+            jlog(JLOG_ERROR, "Built without O_DIRECT, ignoring %s",
+                 argv[optind - 1]);
+#endif
+            /* fall through */
+        case OPT_UNCACHED:
+            opts.uncached = TRUE;
+            break;
+        case OPT_WATCH:
+#ifdef HAVE_INOTIFY
+            opts.watch = TRUE;
+#else
+            jlog(JLOG_ERROR, "Built without inotify, cannot watch");
+            return 1;
+#endif
+            break;
+        case OPT_REFLINK:
+#ifdef HAVE_FIDEDUPERANGE
+            opts.dedupe = TRUE;
+#else
+            jlog(JLOG_ERROR, "Built without FIDEDUPERANGE, ignoring %s",
+                 argv[optind - 1]);
+#endif
+            break;
+        case 'j':
+            errno = 0;
+            jobs = strtoul(optarg, &end, 10);
+            if (!isdigit((unsigned char) optarg[0]) || *end != '\0' ||
+                errno != 0 || jobs == 0 || jobs > MAX_JOBS) {
+                jlog(JLOG_ERROR, "Invalid option given to -j: %s, expected "
+                     "1 to %d", optarg, MAX_JOBS);
+                return 1;
+            }
+            opts.jobs = jobs;
+#ifndef HAVE_PTHREAD
+            if (opts.jobs > 1)
+                jlog(JLOG_ERROR, "Built without threads, ignoring -j %u",
+                     opts.jobs);
+#endif
             break;
         case '?':
             return 1;
@@ -1141,6 +8063,35 @@ static int parse_options(int argc, char *argv[])
             return 1;
         }
     }
+
+    if (checkpoint.path != NULL || opts.resume != NULL)
+        checkpoint_options();
+    combine_regex(&opts.exclude);
+    combine_regex(&opts.include);
+
+    if (plan.out != NULL && (opts.apply != NULL || opts.dedupe)) {
+        jlog(JLOG_ERROR, "--plan-out cannot be combined with %s",
+             opts.apply != NULL ? "--apply" : "--reflink");
+        return 1;
+    }
+    /* A checkpoint describes one walk over all files and then the links */
+    if ((checkpoint.path != NULL || opts.resume != NULL) &&
+        (plan.out != NULL || opts.apply != NULL || opts.prescan ||
+         opts.max_memory != 0 || opts.watch)) {
+        jlog(JLOG_ERROR, "--checkpoint and --resume cannot be combined with "
+             "%s", plan.out != NULL ? "--plan-out" : opts.apply != NULL ?
+             "--apply" : opts.prescan ? "--prescan" : opts.max_memory != 0 ?
+             "--max-memory" : "--watch");
+        return 1;
+    }
+    /* Watching needs all files in the tables, and makes the links */
+    if (opts.watch && (plan.out != NULL || opts.apply != NULL ||
+                       opts.prescan || opts.max_memory != 0)) {
+        jlog(JLOG_ERROR, "--watch cannot be combined with %s",
+             plan.out != NULL ? "--plan-out" : opts.apply != NULL ?
+             "--apply" : opts.prescan ? "--prescan" : "--max-memory");
+        return 1;
+    }
     return 0;
 }
 
@@ -1154,20 +8105,26 @@ static void to_be_called_atexit(void)
 }
 
 /**
- * sighandler - Signal handler, sets the global last_signal variable
+ * sighandler - Signal handler, sets last_signal or stats_requested
  * @i: The signal number
  */
 static void sighandler(int i)
 {
+    if (i == SIGUSR1) {
+        stats_requested = 1;
+        return;
+    }
     if (last_signal != SIGINT)
         last_signal = i;
-    if (i == SIGINT)
-        putchar('\n');
+    if (i == SIGINT && write(STDOUT_FILENO, "\n", 1) < 0)
+        return;                 /* nothing we can do about it here */
 }
 
 int main(int argc, char *argv[])
 {
     struct sigaction sa;
+    unsigned long long hint;
+    int stopped;
 
     sa.sa_handler = sighandler;
     sa.sa_flags = SA_RESTART;
@@ -1189,18 +8146,142 @@ int main(int argc, char *argv[])
     if (parse_options(argc, argv) != 0)
         return 1;
 
-    if (optind == argc) {
+    if (opts.apply != NULL) {
+        if (optind != argc) {
+            jlog(JLOG_FATAL, "Expected no file or directory names with --apply");
+            return 1;
+        }
+        stats.started = TRUE;
+        return plan_apply(opts.apply) ? 0 : 1;
+    }
+
+    if (opts.resume != NULL && optind != argc) {
+        jlog(JLOG_FATAL, "Expected no file or directory names with --resume");
+        return 1;
+    } else if (opts.resume == NULL && optind == argc) {
         jlog(JLOG_FATAL, "Expected file or directory names");
         return 1;
     }
 
+    /* A mapped file may be truncated under us */
+    if (opts.compare == COMPARE_MMAP) {
+        sa.sa_handler = sigbus_handler;
+        sa.sa_flags = 0;
+        sigaction(SIGBUS, &sa, NULL);
+    }
+
+    /* Every worker may run a lockstep comparison of its own */
+    opts.lockstep_files = lockstep_budget() / opts.jobs;
+    if (opts.lockstep_files < 2)
+        opts.lockstep_files = 2;
+
     stats.started = TRUE;
+    phase_enter(PHASE_TRAVERSAL);
+
+    if (opts.prescan) {
+        int i;
+
+        sketch_init(files_hint(argv + optind, argc - optind, TRUE));
+        for (i = optind; i < argc; i++)
+            if (walk(argv[i]) != 0)
+                exit(1);
+
+        jlog(JLOG_DEBUG1, "Prescan found up to %llu candidates",
+             sketch.candidates);
+        sketch.filter = TRUE;
+        hint = sketch.candidates < TABLE_MAX_HINT ? sketch.candidates
+            : TABLE_MAX_HINT;
+    } else {
+        hint = files_hint(argv + optind, argc - optind, FALSE);
+    }
+
+    /* Do not size the tables beyond what --max-memory allows */
+    if (opts.max_memory != 0 && hint > opts.max_memory / 256)
+        hint = opts.max_memory / 256;
+
+    table_hint(hint);
+
+#ifdef HAVE_INOTIFY
+    if (opts.watch) {
+        if ((watch.fd = inotify_init1(IN_CLOEXEC)) < 0) {
+            jlog(JLOG_SYSFAT, "Cannot watch for new files");
+            return 1;
+        }
+        sigaction(SIGTERM, &sa, NULL);
+    }
+#endif
+
+    /* Keep checkpointing to the checkpoint we resume from */
+    if (opts.resume != NULL && checkpoint.path == NULL)
+        checkpoint.path = opts.resume;
+    if (checkpoint.path != NULL) {
+        sigaction(SIGTERM, &sa, NULL);
+        checkpoint.next = gettime() + CHECKPOINT_INTERVAL;
+    }
+    if (opts.resume != NULL && !checkpoint_resume(opts.resume))
+        return 1;
+
+    stopped = opts.resume != NULL ? walk_run() : 0;
+    for (; !stopped && optind < argc; optind++)
+        stopped = walk(argv[optind]);
+
+    if (stopped && checkpoint.path != NULL) {
+        /* The paths not walked yet belong to the frontier, too */
+        for (; optind < argc; optind++)
+            walk_push(NULL, NULL, argv[optind]);
+        checkpoint_walk();
+        phase_enter(PHASES);
+        exit(1);
+    }
+
+    phase_enter(PHASE_GROUPING);
+    /* Once spilled, the rest goes to a run too, and the runs are merged */
+    if (spill.count > 0)
+        spill_run();
+    else
+        collect_buckets();
+    /* --watch keeps the tables to add new files to */
+    if (!opts.watch)
+        walk_release();
+    if (checkpoint.path != NULL)
+        checkpoint_buckets();
+
+    phase_enter(PHASE_COMPARING);
+    if (!opts.dry_run)
+        linker_start();
+    if (!(spill.count > 0 ? spill_merge() : link_buckets())) {
+        linker_finish();
+        phase_enter(PHASES);
+        if (plan.out != NULL)
+            plan_close();
+        checkpoint_close(FALSE);
+        cache_save();
+        exit(1);
+    }
+#ifdef HAVE_INOTIFY
+    if (opts.watch) {
+        linker_wait();
+        cache_collect();
+        watch_learn();
+        buckets_release();
+        if (!watch_run()) {
+            linker_finish();
+            phase_enter(PHASES);
+            cache_save();
+            exit(1);
+        }
+    }
+#endif
+    linker_finish();
+    phase_enter(PHASES);
+    checkpoint_close(TRUE);
 
-    for (; optind < argc; optind++)
-        if (nftw(argv[optind], inserter, 20, FTW_PHYS) == -1)
-            jlog(JLOG_SYSERR, "Cannot process %s", argv[optind]);
+    if (plan.out != NULL && !plan_close()) {
+        cache_save();
+        exit(1);
+    }
 
-    twalk(files, visitor);
+    cache_save();
 
     return 0;
 }
@@ -0,0 +1,112 @@
+#! /bin/bash
+
+# Benchmarks hardlink on generated trees. Each scenario describes a tree for
+# bench_tree, which is generated once into $BENCH_DIR and reused by later
+# runs with the same parameters. hardlink is run on it in --dry-run mode by
+# bench_run, and one line of JSON per run is appended to $BENCH_OUT, so that
+# results can be compared across commits. Run it with "make bench".
+#
+# Environment:
+#   HARDLINK     the binary to benchmark (./hardlink)
+#   BENCH_DIR    where the trees are kept (/tmp/hardlink-bench)
+#   BENCH_OUT    the file the results are appended to (bench-results.jsonl)
+#   BENCH_RUNS   runs per scenario, the first one also warms the cache (3)
+#   BENCH_SCALE  factor for the number of files in every scenario (1)
+#   BENCH_ARGS   extra arguments for hardlink
+#   BENCH_ONLY   run only the scenarios whose names match this regex
+
+HARDLINK=${HARDLINK:-./hardlink}
+BENCH_DIR=${BENCH_DIR:-/tmp/hardlink-bench}
+BENCH_OUT=${BENCH_OUT:-bench-results.jsonl}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_SCALE=${BENCH_SCALE:-1}
+BENCH_ONLY=${BENCH_ONLY:-.}
+TESTDIR=$(dirname "$0")
+
+# name, files, bench_tree options, hardlink options
+SCENARIOS=(
+    "unique     20000 -s 1:1048576 -d 0.02 -c 0.05 -D 4 -f 6 |"
+    "dups       20000 -s 1:262144 -d 0.5 -k 1.0 -D 3 -f 8 |"
+    "skewed     10000 -s 4096:65536 -d 0.8 -k 2.0 -D 2 -f 16 |"
+    "collisions 10000 -s 65536:131072 -d 0.2 -c 0.9 -k 1.5 -D 3 -f 4 |"
+    "large      400 -s 1048576:16777216 -d 0.5 -c 0.3 -D 1 -f 4 |"
+    "large-mmap 400 -s 1048576:16777216 -d 0.5 -c 0.3 -D 1 -f 4 | -C mmap"
+    "xattrs     10000 -s 1:65536 -d 0.5 -x 0.5 -D 3 -f 8 | --respect-xattrs"
+)
+
+# Print the value after a label in the summary of hardlink
+summary() {
+    sed -n "s/^$1 *\([0-9][0-9]*\).*/\1/p" "$2" | tail -n 1
+}
+
+# Print the value of a key=value line written by bench_run
+measure() {
+    sed -n "s/^$1=//p" "$2" | tail -n 1
+}
+
+# Count the system calls of a run, if strace is available
+syscalls() {
+    local trace=$WORKDIR/strace
+    if ! command -v strace > /dev/null; then
+        echo null
+        return
+    fi
+    strace -f -c -o "$trace" "$HARDLINK" "$@" > /dev/null 2>&1
+    awk '$NF == "total" { print $4 }' "$trace" | grep . || echo null
+}
+
+COMMIT=$(git -C "$TESTDIR" describe --always --dirty 2>/dev/null || echo unknown)
+DATE=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+WORKDIR=$(mktemp -d /tmp/hardlink-bench-XXXXXX)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+mkdir -p "$BENCH_DIR" || exit 1
+
+for scenario in "${SCENARIOS[@]}"; do
+    read -r name count options <<< "${scenario%%|*}"
+    args="${scenario#*|} $BENCH_ARGS"
+    files=$(( count * BENCH_SCALE ))
+    tree=$BENCH_DIR/$name
+    params="-n $files $options"
+
+    [[ $name =~ $BENCH_ONLY ]] || continue
+
+    if [[ "$(cat "$tree.params" 2>/dev/null)" != "$params" ]]; then
+        echo "Generating $name: $params" >&2
+        rm -rf "$tree" "$tree.params"
+        "$TESTDIR/bench_tree" $params "$tree" > /dev/null || exit 1
+        echo "$params" > "$tree.params"
+    fi
+
+    calls=$(syscalls --dry-run $args "$tree")
+
+    for run in $(seq 1 "$BENCH_RUNS"); do
+        "$TESTDIR/bench_run" "$HARDLINK" --dry-run $args "$tree" \
+            > "$WORKDIR/out" 2> "$WORKDIR/usage"
+        status=$?
+
+        seen=$(summary "Files:" "$WORKDIR/out")
+        wall=$(measure wall_seconds "$WORKDIR/usage")
+        rate=$(awk -v n="${seen:-0}" -v t="$wall" \
+                   'BEGIN { printf "%.1f", (t > 0 ? n / t : 0) }')
+
+        printf '{"date":"%s","commit":"%s","scenario":"%s","run":%d,' \
+            "$DATE" "$COMMIT" "$name" "$run"
+        printf '"generator":"%s","args":"%s","exit_status":%d,' \
+            "$params" "$(echo $args)" "$status"
+        printf '"files":%s,"files_per_second":%s,"wall_seconds":%s,' \
+            "${seen:-null}" "$rate" "$wall"
+        printf '"user_seconds":%s,"system_seconds":%s,"max_rss_kib":%s,' \
+            "$(measure user_seconds "$WORKDIR/usage")" \
+            "$(measure system_seconds "$WORKDIR/usage")" \
+            "$(measure max_rss_kib "$WORKDIR/usage")"
+        printf '"bytes_read":%s,"storage_bytes_read":%s,' \
+            "$(measure rchar "$WORKDIR/usage")" \
+            "$(measure read_bytes "$WORKDIR/usage")"
+        printf '"comparisons":%s,"digests":%s,"linked":%s,"syscalls":%s}\n' \
+            "$(summary "Compared:" "$WORKDIR/out")" \
+            "$(summary "Digested:" "$WORKDIR/out")" \
+            "$(summary "Linked:" "$WORKDIR/out")" \
+            "$calls"
+    done
+done | tee -a "$BENCH_OUT"
@@ -0,0 +1,125 @@
+/* bench_run.c - Run a command and report its resource usage
+ *
+ * Copyright (C) 2008 - 2014 Julian Andres Klode <jak@jak-linux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE             /* wait4() */
+#define _POSIX_C_SOURCE 200809L /* POSIX functions */
+#define _XOPEN_SOURCE      700  /* waitid() */
+
+#include <sys/types.h>          /* pid_t */
+#include <sys/resource.h>       /* struct rusage */
+#include <sys/time.h>           /* struct timeval */
+#include <sys/wait.h>           /* waitid(), wait4() */
+#include <errno.h>              /* errno */
+#include <stdio.h>              /* printf() */
+#include <string.h>             /* strerror() */
+#include <time.h>               /* clock_gettime() */
+#include <unistd.h>             /* fork(), execvp() */
+
+/**
+ * read_io - Read the I/O counters of a process from /proc
+ * @pid:        The process, which must not have been reaped yet
+ * @rchar:      Set to the bytes read by system calls
+ * @read_bytes: Set to the bytes read from storage
+ *
+ * Both are left at -1 if /proc is not available.
+ */
+static void read_io(pid_t pid, long long *rchar, long long *read_bytes)
+{
+    char path[64];
+    char line[128];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%ld/io", (long) pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        sscanf(line, "rchar: %lld", rchar);
+        sscanf(line, "read_bytes: %lld", read_bytes);
+    }
+
+    fclose(f);
+}
+
+/**
+ * seconds - Convert a struct timeval to seconds
+ * @tv: The time
+ */
+static double seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    long long rchar = -1;
+    long long read_bytes = -1;
+    struct timespec start;
+    struct timespec end;
+    struct rusage usage;
+    siginfo_t info;
+    int status;
+    pid_t pid;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s command [arguments]\n", argv[0]);
+        return 2;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+        return 2;
+    } else if (pid == 0) {
+        execvp(argv[1], argv + 1);
+        fprintf(stderr, "Cannot run %s: %s\n", argv[1], strerror(errno));
+        _exit(127);
+    }
+
+    /* Wait without reaping, so that /proc/pid/io still has the totals */
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == 0)
+        read_io(pid, &rchar, &read_bytes);
+
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        fprintf(stderr, "Cannot wait for %s: %s\n", argv[1], strerror(errno));
+        return 2;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* On stderr, the output of the command goes to stdout */
+    fprintf(stderr, "wall_seconds=%.6f\n", end.tv_sec - start.tv_sec +
+            (end.tv_nsec - start.tv_nsec) / 1e9);
+    fprintf(stderr, "user_seconds=%.6f\n", seconds(&usage.ru_utime));
+    fprintf(stderr, "system_seconds=%.6f\n", seconds(&usage.ru_stime));
+    fprintf(stderr, "max_rss_kib=%ld\n", usage.ru_maxrss);
+    fprintf(stderr, "rchar=%lld\n", rchar);
+    fprintf(stderr, "read_bytes=%lld\n", read_bytes);
+    fprintf(stderr, "voluntary_switches=%ld\n", usage.ru_nvcsw);
+    fprintf(stderr, "involuntary_switches=%ld\n", usage.ru_nivcsw);
+    fprintf(stderr, "exit_status=%d\n",
+            WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,337 @@
+/* bench_tree.c - Generate reproducible trees of duplicate files
+ *
+ * Copyright (C) 2008 - 2014 Julian Andres Klode <jak@jak-linux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE             /* GNU extensions (optional) */
+#define _POSIX_C_SOURCE 200809L /* POSIX functions */
+#define _XOPEN_SOURCE      700  /* POSIX.1-2008 */
+
+#define _FILE_OFFSET_BITS   64  /* Large file support */
+
+#include <sys/types.h>          /* mkdir() */
+#include <sys/stat.h>           /* mkdir() */
+#include <sys/xattr.h>          /* fsetxattr() */
+#include <errno.h>              /* errno */
+#include <fcntl.h>              /* open() */
+#include <math.h>               /* pow(), exp(), log() */
+#include <stdint.h>             /* uint64_t */
+#include <stdio.h>              /* printf() */
+#include <stdlib.h>             /* strtod() */
+#include <string.h>             /* strerror() */
+#include <unistd.h>             /* getopt(), write() */
+
+/**
+ * struct group - Files with the same contents
+ * @size: The size of the files
+ * @seed: The seed of the contents
+ */
+struct group {
+    off_t size;
+    uint64_t seed;
+};
+
+/**
+ * struct params - What to generate
+ * @files:    Number of files
+ * @min_size: Minimum file size
+ * @max_size: Maximum file size, sizes are distributed log-uniformly
+ * @dups:     Probability of a file being a copy of an earlier one
+ * @collide:  Probability of a new file having the size of an earlier one
+ * @skew:     Zipf exponent for choosing which file to copy, 0 is uniform
+ * @depth:    Depth of the directory tree
+ * @fanout:   Subdirectories per directory
+ * @xattrs:   Probability of a file having an extended attribute
+ * @seed:     Seed of the random number generator
+ */
+static struct params {
+    unsigned long files;
+    off_t min_size;
+    off_t max_size;
+    double dups;
+    double collide;
+    double skew;
+    unsigned int depth;
+    unsigned int fanout;
+    double xattrs;
+    uint64_t seed;
+} params = {
+    1000, 1, 1024 * 1024, 0.3, 0.1, 1.0, 3, 4, 0.0, 1
+};
+
+/**
+ * next_random - A xorshift64* generator, so trees are equal everywhere
+ * @state: The state of the generator, not 0
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * uniform - A random number in [0, 1)
+ * @state: The state of the generator
+ */
+static double uniform(uint64_t *state)
+{
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * zipf_pick - Pick one of n items with Zipf-distributed probabilities
+ * @state: The state of the generator
+ * @n:     The number of items
+ *
+ * Uses the continuous approximation of the inverse distribution function,
+ * which is plenty for benchmarks and needs no table.
+ */
+static unsigned long zipf_pick(uint64_t *state, unsigned long n)
+{
+    double u = uniform(state);
+    double x;
+
+    if (params.skew <= 0.0)
+        return (unsigned long) (u * n);
+    if (params.skew == 1.0)
+        x = exp(u * log(n + 1.0)) - 1.0;
+    else
+        x = pow(u * (pow(n + 1.0, 1.0 - params.skew) - 1.0) + 1.0,
+                1.0 / (1.0 - params.skew)) - 1.0;
+
+    return x < n ? (unsigned long) x : n - 1;
+}
+
+/**
+ * write_file - Write a file with the contents of a group
+ * @path:  The path of the file
+ * @group: The group of the file
+ * @xattr: The value of the extended attribute to set, or -1 for none
+ */
+static int write_file(const char *path, const struct group *group, int xattr)
+{
+    static unsigned char buf[65536];
+    uint64_t state = group->seed;
+    off_t left = group->size;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    while (left > 0) {
+        size_t len = left < (off_t) sizeof(buf) ? (size_t) left : sizeof(buf);
+        size_t i;
+
+        for (i = 0; i < len; i += sizeof(uint64_t)) {
+            uint64_t word = next_random(&state);
+
+            memcpy(buf + i, &word, len - i < sizeof(word) ? len - i
+                   : sizeof(word));
+        }
+        if (write(fd, buf, len) != (ssize_t) len) {
+            fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+            close(fd);
+            return 1;
+        }
+        left -= len;
+    }
+
+    if (xattr >= 0) {
+        char value[16];
+
+        snprintf(value, sizeof(value), "%d", xattr);
+        if (fsetxattr(fd, "user.bench", value, strlen(value), 0) != 0 &&
+            errno != ENOTSUP) {
+            fprintf(stderr, "Cannot set xattr on %s: %s\n", path,
+                    strerror(errno));
+            close(fd);
+            return 1;
+        }
+    }
+
+    return close(fd);
+}
+
+/**
+ * file_dir - Build the directory of the n-th file, creating it if needed
+ * @root: The root of the tree
+ * @n:    The number of the file
+ * @path: Buffer of 4096 bytes
+ *
+ * Returns: The length of the directory path, or -1 on failure.
+ */
+static int file_dir(const char *root, unsigned long n, char *path)
+{
+    size_t len = snprintf(path, 4096, "%s", root);
+    unsigned int level;
+
+    for (level = 0; level < params.depth; level++) {
+        len += snprintf(path + len, 4096 - len, "/d%lu",
+                        params.fanout ? n % params.fanout : 0);
+        n /= params.fanout ? params.fanout : 1;
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+
+    return len;
+}
+
+/**
+ * usage - Print the usage
+ * @name: The name of the program
+ */
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] directory\n", name);
+    puts("Options:");
+    puts("  -n N       Number of files (1000)");
+    puts("  -s MIN:MAX Range of file sizes, log-uniform (1:1048576)");
+    puts("  -d P       Probability of a file being a duplicate (0.3)");
+    puts("  -c P       Probability of a size collision with other contents (0.1)");
+    puts("  -k S       Zipf exponent for choosing duplicated files (1.0)");
+    puts("  -D N       Depth of the directory tree (3)");
+    puts("  -f N       Subdirectories per directory (4)");
+    puts("  -x P       Probability of a file having an xattr (0.0)");
+    puts("  -S N       Seed (1)");
+}
+
+int main(int argc, char *argv[])
+{
+    struct group *groups;
+    unsigned long ngroups = 0;
+    unsigned long long bytes = 0;
+    unsigned long i;
+    intmax_t min_size;
+    intmax_t max_size;
+    uint64_t state;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:s:d:c:k:D:f:x:S:")) != -1) {
+        switch (opt) {
+        case 'n':
+            params.files = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            if (sscanf(optarg, "%jd:%jd", &min_size, &max_size) != 2) {
+                fprintf(stderr, "Invalid sizes: %s\n", optarg);
+                return 1;
+            }
+            params.min_size = min_size;
+            params.max_size = max_size;
+            break;
+        case 'd':
+            params.dups = strtod(optarg, NULL);
+            break;
+        case 'c':
+            params.collide = strtod(optarg, NULL);
+            break;
+        case 'k':
+            params.skew = strtod(optarg, NULL);
+            break;
+        case 'D':
+            params.depth = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            params.fanout = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            params.xattrs = strtod(optarg, NULL);
+            break;
+        case 'S':
+            params.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind + 1 != argc || params.min_size < 1 ||
+        params.max_size < params.min_size) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (mkdir(argv[optind], 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s: %s\n", argv[optind],
+                strerror(errno));
+        return 1;
+    }
+
+    groups = calloc(params.files ? params.files : 1, sizeof(*groups));
+    if (groups == NULL) {
+        fprintf(stderr, "Cannot allocate memory\n");
+        return 1;
+    }
+
+    state = params.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    for (i = 0; i < params.files; i++) {
+        char path[4096];
+        const struct group *group;
+        int xattr = -1;
+        int len;
+
+        if (ngroups > 0 && uniform(&state) < params.dups) {
+            /* The earliest groups are the most popular */
+            group = &groups[zipf_pick(&state, ngroups)];
+        } else {
+            struct group *g = &groups[ngroups++];
+
+            if (ngroups > 1 && uniform(&state) < params.collide) {
+                g->size = groups[zipf_pick(&state, ngroups - 1)].size;
+            } else {
+                double lo = log((double) params.min_size);
+                double hi = log((double) params.max_size + 1);
+
+                g->size = (off_t) exp(lo + uniform(&state) * (hi - lo));
+                if (g->size > params.max_size)
+                    g->size = params.max_size;
+            }
+            g->seed = next_random(&state) | 1;
+            group = g;
+        }
+
+        if (uniform(&state) < params.xattrs)
+            xattr = next_random(&state) % 4;
+
+        if ((len = file_dir(argv[optind], i, path)) < 0)
+            return 1;
+        snprintf(path + len, sizeof(path) - len, "/f%lu", i);
+
+        if (write_file(path, group, xattr) != 0)
+            return 1;
+        bytes += group->size;
+    }
+
+    printf("files=%lu groups=%lu bytes=%llu\n", params.files, ngroups, bytes);
+
+    free(groups);
+    return 0;
+}
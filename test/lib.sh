@@ -0,0 +1,27 @@
+# Helpers shared by the tests, sourced by each of them.
+#
+# Environment:
+#   HARDLINK     the binary to test (./hardlink)
+
+HARDLINK=${HARDLINK:-./hardlink}
+TMPDIR=$(mktemp -d /tmp/hardlinktest-XXXXXX)
+
+# A hardlink running in the background, stopped when the test exits
+PID=
+trap '[ -n "$PID" ] && kill $PID 2>/dev/null; rm -rf $TMPDIR' EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# The inode of a file in $TMPDIR/tree
+inode() {
+    stat -c %i "$TMPDIR/tree/$1"
+}
+
+# The groups of paths sharing an inode, one line per group
+groups() {
+    (cd $1 && find . -type f -printf '%i %p\n') | sort -k2 |
+        awk '{ g[$1] = g[$1] " " $2 } END { for (i in g) print g[i] }' | sort
+}
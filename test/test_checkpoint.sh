@@ -0,0 +1,51 @@
+#! /bin/bash
+
+# Interrupts hardlink --checkpoint with SIGINT, then checks that resuming
+# with other options is refused, and that resuming with the same options
+# links the same files as a run which was not interrupted.
+
+. "$(dirname "$0")/lib.sh"
+
+# Enough files that the run can be interrupted before it is done
+mkdir $TMPDIR/tree
+for d in $(seq 0 39); do
+    mkdir -p $TMPDIR/tree/d$d/e
+    for i in $(seq 0 99); do
+        echo "contents $(( (d + i) % 37 ))" > $TMPDIR/tree/d$d/f$i
+        echo "contents $(( i % 23 ))" > $TMPDIR/tree/d$d/e/g$i
+    done
+done
+
+cp -a $TMPDIR/tree $TMPDIR/reference
+$HARDLINK -t $TMPDIR/reference > $TMPDIR/out 2>&1 ||
+    fail "reference run failed: $(cat $TMPDIR/out)"
+
+# Interrupt sooner and sooner until a checkpoint is left behind
+for delay in 0.2 0.1 0.05 0.02 0.01 0.005 0.002; do
+    rm -rf $TMPDIR/run $TMPDIR/ck
+    cp -a $TMPDIR/tree $TMPDIR/run
+    timeout -s INT $delay $HARDLINK -t --checkpoint=$TMPDIR/ck \
+        $TMPDIR/run > $TMPDIR/out 2>&1
+    [ -f $TMPDIR/ck ] && break
+done
+[ -f $TMPDIR/ck ] || fail "could not interrupt hardlink --checkpoint"
+
+$HARDLINK --resume=$TMPDIR/ck > $TMPDIR/out 2>&1 &&
+    fail "resuming without -t was not refused"
+grep -q "was written with other options" $TMPDIR/out ||
+    fail "no reason given for refusing: $(cat $TMPDIR/out)"
+$HARDLINK -t -s 2 --resume=$TMPDIR/ck > $TMPDIR/out 2>&1 &&
+    fail "resuming with another --minimum-size was not refused"
+[ -f $TMPDIR/ck ] || fail "refusing to resume removed the checkpoint"
+
+$HARDLINK -t --resume=$TMPDIR/ck > $TMPDIR/out 2>&1 ||
+    fail "resuming failed: $(cat $TMPDIR/out)"
+[ ! -f $TMPDIR/ck ] || fail "the checkpoint was not removed when done"
+
+groups $TMPDIR/reference > $TMPDIR/reference.groups
+groups $TMPDIR/run > $TMPDIR/run.groups
+cmp -s $TMPDIR/reference.groups $TMPDIR/run.groups ||
+    fail "the resumed run linked differently:" \
+         "$(diff $TMPDIR/reference.groups $TMPDIR/run.groups | head)"
+
+echo "OK"
@@ -0,0 +1,89 @@
+#! /bin/bash
+
+# Links files of equal contents while linkat() is made to fail with EMLINK
+# once an inode has LINK_MAX links, by a library preloaded into hardlink.
+# No inode may get more links than that, the files which could not be
+# linked must become masters of their own, and the number of files linked
+# must match the inodes left.
+#
+# Environment:
+#   CC           the compiler for the library (cc)
+
+. "$(dirname "$0")/lib.sh"
+
+LINK_MAX=4
+
+cat > $TMPDIR/emlink.c <<'EOF'
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+int linkat(int olddirfd, const char *oldpath, int newdirfd,
+           const char *newpath, int flags)
+{
+    static int (*real)(int, const char *, int, const char *, int);
+    const char *max = getenv("HARDLINK_TEST_LINK_MAX");
+    struct stat st;
+    int r;
+
+    if (real == NULL)
+        real = (int (*)(int, const char *, int, const char *, int))
+            dlsym(RTLD_NEXT, "linkat");
+    if (flags & AT_EMPTY_PATH)
+        r = fstat(olddirfd, &st);
+    else
+        r = fstatat(olddirfd, oldpath, &st,
+                    (flags & AT_SYMLINK_FOLLOW) ? 0 : AT_SYMLINK_NOFOLLOW);
+    if (max != NULL && r == 0 && st.st_nlink >= (nlink_t) atoi(max)) {
+        errno = EMLINK;
+        return -1;
+    }
+    return real(olddirfd, oldpath, newdirfd, newpath, flags);
+}
+EOF
+${CC:-cc} -shared -fPIC -o $TMPDIR/emlink.so $TMPDIR/emlink.c -ldl ||
+    fail "cannot build the EMLINK library"
+
+for args in "" "-j4" "--max-memory=4K"; do
+    rm -rf $TMPDIR/tree
+    for d in a b c; do
+        mkdir -p $TMPDIR/tree/$d
+        for i in $(seq 0 9); do
+            echo "the same content" > $TMPDIR/tree/$d/f$i
+        done
+    done
+
+    LD_PRELOAD=$TMPDIR/emlink.so HARDLINK_TEST_LINK_MAX=$LINK_MAX \
+        $HARDLINK -t $args $TMPDIR/tree > $TMPDIR/out 2>&1 ||
+        fail "hardlink $args failed: $(cat $TMPDIR/out)"
+    grep -q "Too many links" $TMPDIR/out ||
+        fail "hardlink $args hit no link limit: $(cat $TMPDIR/out)"
+
+    groups $TMPDIR/tree > $TMPDIR/groups
+    [ $(find $TMPDIR/tree -type f | wc -l) = 30 ] ||
+        fail "hardlink $args lost or left files: $(find $TMPDIR/tree)"
+    grep -q "^Files:    30" $TMPDIR/out ||
+        fail "wrong number of files: $(cat $TMPDIR/out)"
+
+    # Every inode within the limit, with a link count matching its paths
+    while read -r paths; do
+        set -- $paths
+        [ $# -le $LINK_MAX ] ||
+            fail "hardlink $args made more than $LINK_MAX links: $paths"
+        [ $(stat -c %h $TMPDIR/tree/$1) = $# ] ||
+            fail "hardlink $args left other links to $1"
+    done < $TMPDIR/groups
+
+    groups=$(wc -l < $TMPDIR/groups)
+    [ $groups -le $(( 2 * 30 / LINK_MAX )) ] ||
+        fail "hardlink $args stopped linking at the limit:" \
+             "$(cat $TMPDIR/groups)"
+    grep -q "^Linked:   $(( 30 - groups )) files" $TMPDIR/out ||
+        fail "hardlink $args counted links wrongly, $groups inodes left:" \
+             "$(cat $TMPDIR/out)"
+done
+
+echo "OK"
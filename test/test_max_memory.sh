@@ -0,0 +1,42 @@
+#! /bin/bash
+
+# Links copies of one tree with and without --max-memory=4K, which spills
+# the files found to temporary files many times over, and checks that the
+# same files end up sharing inodes, also with --respect-name and --jobs.
+
+. "$(dirname "$0")/lib.sh"
+
+# Files of a few sizes and contents, some with the same name in other
+# directories, so that --respect-name links fewer of them
+mkdir $TMPDIR/tree
+for d in 0 1 2 3 4 5 6 7; do
+    for e in 0 1 2; do
+        mkdir -p $TMPDIR/tree/d$d/e$e
+        for i in 0 1 2 3 4 5 6 7 8 9; do
+            n=$(( (d * 7 + e * 3 + i) % 6 ))
+            head -c $(( 100 + (i % 3) * 4096 )) /dev/zero | tr '\0' "$n" \
+                > $TMPDIR/tree/d$d/e$e/f$(( (i + d) % 5 ))-$i
+        done
+    done
+done
+
+for args in "" "--respect-name" "-j4" "--respect-name -j4"; do
+    rm -rf $TMPDIR/plain $TMPDIR/spilled
+    cp -a $TMPDIR/tree $TMPDIR/plain
+    cp -a $TMPDIR/tree $TMPDIR/spilled
+
+    $HARDLINK -t $args $TMPDIR/plain > $TMPDIR/out 2>&1 ||
+        fail "hardlink $args failed: $(cat $TMPDIR/out)"
+    $HARDLINK -t $args --max-memory=4K $TMPDIR/spilled > $TMPDIR/out 2>&1 ||
+        fail "hardlink $args --max-memory=4K failed: $(cat $TMPDIR/out)"
+
+    groups $TMPDIR/plain > $TMPDIR/plain.groups
+    groups $TMPDIR/spilled > $TMPDIR/spilled.groups
+    [ $(wc -l < $TMPDIR/plain.groups) -lt 240 ] ||
+        fail "hardlink $args linked nothing"
+    cmp -s $TMPDIR/plain.groups $TMPDIR/spilled.groups ||
+        fail "--max-memory=4K $args linked differently:" \
+             "$(diff $TMPDIR/plain.groups $TMPDIR/spilled.groups | head)"
+done
+
+echo "OK"
@@ -0,0 +1,47 @@
+#! /bin/bash
+
+# Writes a plan with --plan-out, modifies one of the files it would replace
+# and applies the plan with --apply. The modified file must be skipped and
+# the others linked. Applying the plan again must not link anything, the
+# links are counted as already made.
+
+. "$(dirname "$0")/lib.sh"
+
+mkdir -p $TMPDIR/tree/a $TMPDIR/tree/b
+for name in a/1 a/2 b/1 b/2; do
+    echo "the same content" > $TMPDIR/tree/$name
+done
+touch -d 2020-01-01 $TMPDIR/tree/*/*
+
+$HARDLINK --plan-out $TMPDIR/plan $TMPDIR/tree > $TMPDIR/out 2>&1 ||
+    fail "--plan-out failed: $(cat $TMPDIR/out)"
+[ "$(inode a/1)" != "$(inode a/2)" ] || fail "--plan-out linked files"
+
+# Same size, new contents and modification time
+echo "other content of..." | head -c 17 > $TMPDIR/tree/b/2
+
+$HARDLINK --apply $TMPDIR/plan > $TMPDIR/out 2>&1 ||
+    fail "--apply failed: $(cat $TMPDIR/out)"
+grep -q "b/2 changed since it was compared, skipping" $TMPDIR/out ||
+    fail "modified file not reported: $(cat $TMPDIR/out)"
+grep -q "^Linked:   2 files" $TMPDIR/out ||
+    fail "wrong number of links: $(cat $TMPDIR/out)"
+
+master=$(inode a/1)
+for name in a/2 b/1; do
+    [ "$(inode $name)" = "$master" ] || fail "$name not linked"
+done
+[ "$(inode b/2)" != "$master" ] || fail "modified file b/2 linked"
+[ "$(cat $TMPDIR/tree/b/2)" = "other content of." ] ||
+    fail "modified file b/2 changed"
+
+$HARDLINK --apply $TMPDIR/plan > $TMPDIR/out 2>&1 ||
+    fail "second --apply failed: $(cat $TMPDIR/out)"
+grep -q "^Linked:   0 files" $TMPDIR/out ||
+    fail "second --apply linked files: $(cat $TMPDIR/out)"
+grep -q "^Already:  2 links" $TMPDIR/out ||
+    fail "second --apply did not count existing links: $(cat $TMPDIR/out)"
+grep -q "^Saved:    0 bytes" $TMPDIR/out ||
+    fail "second --apply saved space: $(cat $TMPDIR/out)"
+
+echo "OK"
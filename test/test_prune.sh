@@ -0,0 +1,89 @@
+#! /bin/bash
+
+# Links a tree with --exclude patterns which prune directories and with
+# the same patterns while pruning is disabled by an --include matching
+# nothing. Both runs must link the same files, also with --xdev, which
+# must not link the files of a file system mounted within the tree.
+
+. "$(dirname "$0")/lib.sh"
+
+MOUNTED=
+trap '[ -n "$MOUNTED" ] && umount $TMPDIR/tree/mnt; rm -rf $TMPDIR' EXIT
+
+mkdir $TMPDIR/tree $TMPDIR/tree/mnt
+mount -t tmpfs none $TMPDIR/tree/mnt 2>/dev/null && MOUNTED=1 ||
+    echo "Cannot mount a file system, not testing --xdev across one"
+
+# Fills the tree with files of the same contents, in directories which
+# some of the patterns prune
+populate() {
+    local dir
+
+    find $TMPDIR/tree -mindepth 1 -maxdepth 1 ! -name mnt -exec rm -rf {} +
+    find $TMPDIR/tree/mnt -mindepth 1 -delete
+    (cd $TMPDIR/tree && mkdir -p cache cachex a/cache aa/aa ab/aa 123 x1 \
+                                 keep mnt/cache)
+    for dir in $(find $TMPDIR/tree -type d); do
+        for name in f g.tmp h.bak cache; do
+            [ -d $dir/$name ] || echo "the same content" > $dir/$name
+        done
+    done
+}
+
+# Runs hardlink on a fresh tree, writing the groups to $TMPDIR/$1.groups
+run() {
+    local out=$1
+
+    shift
+    populate
+    $HARDLINK -t -vv "$@" $TMPDIR/tree > $TMPDIR/$out 2>&1 ||
+        fail "hardlink $* failed: $(cat $TMPDIR/$out)"
+    groups $TMPDIR/tree > $TMPDIR/$out.groups
+}
+
+# Each pattern, and whether it prunes a directory; not expanded as globs
+set -f
+for args in "-x \.tmp$ no" "-x cache$ no" "-x /$ no" "-x /cache/ yes" \
+            "-x \bcache\b yes" "-x /([a-z])\1/ yes" "-x /[0-9]+/ yes" \
+            "-x /x[[:digit:]]/ yes" "-x [^/]\.bak$ no" \
+            "-x \bcache\b -x /[0-9]+/ -x \.tmp$ yes"; do
+    prunes=${args##* }
+    args=${args% *}
+
+    for xdev in "" "--xdev"; do
+        run pruned $args $xdev
+        run full $args --include '^$' $xdev
+
+        if [ $prunes = yes ]; then
+            grep -q "^Skipped .*/ (excluded)" $TMPDIR/pruned ||
+                fail "$args $xdev pruned nothing: $(cat $TMPDIR/pruned)"
+        else
+            grep -q "^Skipped .*/ (excluded)" $TMPDIR/pruned &&
+                fail "$args $xdev pruned: $(grep Skipped $TMPDIR/pruned)"
+        fi
+        grep -q "^Skipped .*/ (excluded)" $TMPDIR/full &&
+            fail "$args --include pruned: $(grep Skipped $TMPDIR/full)"
+        [ $(wc -l < $TMPDIR/pruned.groups) -lt 40 ] ||
+            fail "$args $xdev linked nothing"
+
+        cmp -s $TMPDIR/full.groups $TMPDIR/pruned.groups ||
+            fail "$args $xdev linked differently when pruning:" \
+                 "$(diff $TMPDIR/full.groups $TMPDIR/pruned.groups | head)"
+    done
+done
+
+# Files in the mounted file system are linked to each other, but only
+# without --xdev
+if [ -n "$MOUNTED" ]; then
+    run plain
+    grep -q " ./mnt/cache/f.* ./mnt/f" $TMPDIR/plain.groups ||
+        fail "files on the mounted file system not linked"
+    run xdev --xdev
+    grep -q "./mnt/" $TMPDIR/xdev &&
+        fail "--xdev read the mounted file system: $(grep mnt/ $TMPDIR/xdev)"
+    [ $(grep -c "./mnt/" $TMPDIR/xdev.groups) = \
+      $(find $TMPDIR/tree/mnt -type f | wc -l) ] ||
+        fail "--xdev linked files on the mounted file system"
+fi
+
+echo "OK"
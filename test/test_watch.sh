@@ -0,0 +1,61 @@
+#! /bin/bash
+
+# Runs hardlink --watch on a tree, then writes and moves equal files into
+# it. Each new file must be linked to the file already there, which keeps
+# its inode, and the links hardlink renames into place must not be counted
+# as new files.
+
+. "$(dirname "$0")/lib.sh"
+
+# Waits up to 15 seconds for a file to get the given inode
+wait_linked() {
+    local i
+
+    for i in $(seq 150); do
+        [ "$(inode $1)" = "$2" ] && return 0
+        sleep 0.1
+    done
+    fail "$1 not linked: $(cat $TMPDIR/out)"
+}
+
+mkdir -p $TMPDIR/tree/a
+echo "the same content" > $TMPDIR/tree/a/x
+echo "the same content" > $TMPDIR/tree/a/y
+echo "other content..." > $TMPDIR/tree/a/z
+
+$HARDLINK -t -v --watch $TMPDIR/tree > $TMPDIR/out 2>&1 &
+PID=$!
+
+# The first run links y and x, either way round
+for i in $(seq 150); do
+    [ "$(inode a/x)" = "$(inode a/y)" ] && break
+    sleep 0.1
+done
+master=$(inode a/x)
+[ "$(inode a/y)" = "$master" ] || fail "a/y not linked: $(cat $TMPDIR/out)"
+
+# A new file, and one moved in from outside the tree
+echo "the same content" > $TMPDIR/tree/a/new
+echo "the same content" > $TMPDIR/moved
+mv $TMPDIR/moved $TMPDIR/tree/a/moved
+
+# A new directory, walked when created
+mkdir $TMPDIR/tree/b
+echo "the same content" > $TMPDIR/tree/b/sub
+
+for name in a/new a/moved b/sub; do
+    wait_linked $name $master
+done
+[ "$(inode a/x)" = "$master" ] || fail "the resident file a/x was replaced"
+[ "$(inode a/z)" != "$master" ] || fail "a/z linked"
+
+kill -INT $PID
+wait $PID
+PID=
+
+grep -q "^Files:    6" $TMPDIR/out ||
+    fail "wrong number of files: $(cat $TMPDIR/out)"
+grep -q "^Linked:   4 files" $TMPDIR/out ||
+    fail "wrong number of links: $(cat $TMPDIR/out)"
+
+echo "OK"